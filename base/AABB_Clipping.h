@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cassert>
 #include "VulkanglTFModel.h"
+#include "float4.hpp"
 
 namespace AABB_Triangle_Clipping {
 	enum _axis { _X = 0, _Y, _Z };
@@ -20,185 +22,164 @@ namespace AABB_Triangle_Clipping {
 		return result;
 	}
 
-//	inline auto intersect_aabb_triangle(_AABB const& aabb, vkglTF::Vertex** triangle) -> bool
-//	{		
-//		// Convert AABB to center-extents form
-//		glm::vec3 e = glm::vec3((aabb.xmax - aabb.xmin) * 0.5f, (aabb.ymax - aabb.ymin) * 0.5f, (aabb.zmax - aabb.zmin) * 0.5f);
-//		glm::vec3 c = glm::vec3(aabb.xmin + e.x, aabb.ymin + e.y, aabb.zmin + e.z);
-//
-//		glm::vec3 v0 = triangle[0]->pos - c;
-//		glm::vec3 v2 = triangle[1]->pos - c;
-//		glm::vec3 v1 = triangle[2]->pos - c;
-//
-//		// Compute the edge vectors of the triangle  (ABC)
-//		// That is, get the lines between the points as vectors
-//		glm::vec3 f0 = v1 - v0; // B - A
-//		glm::vec3 f1 = v2 - v1; // C - B
-//		glm::vec3 f2 = v0 - v2; // A - C
-//
-//		// Compute the face normals of the AABB, because the AABB
-//		// is at center, and of course axis aligned, we know that 
-//		// it's normals are the X, Y and Z axis.
-//		glm::vec3 u0 = glm::vec3(1.0f, 0.0f, 0.0f);
-//		glm::vec3 u1 = glm::vec3(0.0f, 1.0f, 0.0f);
-//		glm::vec3 u2 = glm::vec3(0.0f, 0.0f, 1.0f);
-//
-//		// There are a total of 13 axis to test!
-//
-//		// We first test against 9 axis, these axis are given by
-//		// cross product combinations of the edges of the triangle
-//		// and the edges of the AABB. You need to get an axis testing
-//		// each of the 3 sides of the AABB against each of the 3 sides
-//		// of the triangle. The result is 9 axis of seperation
-//		// https://awwapp.com/b/umzoc8tiv/
-//
-//		// Compute the 9 axis
-//		glm::vec3 axis_u0_f0 = glm::cross(u0, f0);
-//		glm::vec3 axis_u0_f1 = glm::cross(u0, f1);
-//		glm::vec3 axis_u0_f2 = glm::cross(u0, f2);
-//
-//		glm::vec3 axis_u1_f0 = glm::cross(u1, f0);
-//		glm::vec3 axis_u1_f1 = glm::cross(u1, f1);
-//		glm::vec3 axis_u1_f2 = glm::cross(u2, f2);
-//
-//		glm::vec3 axis_u2_f0 = glm::cross(u2, f0);
-//		glm::vec3 axis_u2_f1 = glm::cross(u2, f1);
-//		glm::vec3 axis_u2_f2 = glm::cross(u2, f2);
-//
-//		// Testing axis: axis_u0_f0
-//		// Project all 3 vertices of the triangle onto the Seperating axis
-//		float p0 = glm::dot(v0, axis_u0_f0);
-//		float p1 = glm::dot(v1, axis_u0_f0);
-//		float p2 = glm::dot(v2, axis_u0_f0);
-//		// Project the AABB onto the seperating axis
-//		// We don't care about the end points of the prjection
-//		// just the length of the half-size of the AABB
-//		// That is, we're only casting the extents onto the 
-//		// seperating axis, not the AABB center. We don't
-//		// need to cast the center, because we know that the
-//		// aabb is at origin compared to the triangle!
-//		float r = e.X * Math.Abs(glm::vec3.Dot(u0, axis_u0_f0)) +
-//			e.Y * Math.Abs(glm::vec3.Dot(u1, axis_u0_f0)) +
-//			e.Z * Math.Abs(glm::vec3.Dot(u2, axis_u0_f0));
-//		// Now do the actual test, basically see if either of
-//		// the most extreme of the triangle points intersects r
-//		// You might need to write Min & Max functions that take 3 arguments
-//		if (Max(-Max(p0, p1, p2), Min(p0, p1, p2)) > r) {
-//			// This means BOTH of the points of the projected triangle
-//			// are outside the projected half-length of the AABB
-//			// Therefore the axis is seperating and we can exit
-//			return false;
-//		}
-//
-//		// Repeat this test for the other 8 seperating axis
-//		// You may wish to make some kind of a helper function to keep
-//		// things readable
-//	TODO: 8 more SAT tests
-//
-//		// Next, we have 3 face normals from the AABB
-//		// for these tests we are conceptually checking if the bounding box
-//		// of the triangle intersects the bounding box of the AABB
-//		// that is to say, the seperating axis for all tests are axis aligned:
-//		// axis1: (1, 0, 0), axis2: (0, 1, 0), axis3 (0, 0, 1)
-//	TODO: 3 SAT tests
-//		// Do the SAT given the 3 primary axis of the AABB
-//		// You already have vectors for this: u0, u1 & u2
-//
-//		// Finally, we have one last axis to test, the face normal of the triangle
-//		// We can get the normal of the triangle by crossing the first two line segments
-//		glm::vec3 triangleNormal = glm::vec3.Cross(f0, f1);
-//TODO: 1 SAT test
-//
-//// Passed testing for all 13 seperating axis that exist!
-//return true;
-//	}
-
-	void _clip_polygon_against_plane(std::vector<glm::vec3>& pg_from, std::vector<glm::vec3>& pg_to, float boundary, _axis axis, _side side) {
-		bool inside_prev, inside_cur; // are the prev and cur vertices inside the clipping plane, respectively?
-		const int pg_from_size = pg_from.size();
-		
-		pg_to.clear();
+	// Separating axis test of a triangle against boxes, run before the clipper so only the boxes the triangle
+	// crosses are clipped. _INSIDE: the triangle is in the box, the clipper would return it unchanged.
+	// _OUTSIDE is only reported past a small tolerance, so the clipper never had geometry to return for it
+	enum _overlap : uint8_t { _OUTSIDE = 0, _CROSSES, _INSIDE };
+
+	const float _SAT_TOLERANCE = 1e-5f;	// relative to the box extent and center
+
+	// Triangle terms shared by every box it is tested against
+	struct _SATTriangle {
+		glm::vec3 v[3];
+		glm::vec3 f[3];		// edges
+		glm::vec3 n;		// face normal
+		glm::vec3 minPos, maxPos;
+		bool sliver;		// nearly degenerate, the rounding of n is as large as n and its axis is not tested
+
+		inline explicit _SATTriangle(const glm::vec3* triangle) {
+			for (int i = 0; i < 3; i++) v[i] = triangle[i];
+			f[0] = v[1] - v[0];
+			f[1] = v[2] - v[1];
+			f[2] = v[0] - v[2];
+			n = glm::cross(f[0], f[1]);
+			minPos = glm::min(glm::min(v[0], v[1]), v[2]);
+			maxPos = glm::max(glm::max(v[0], v[1]), v[2]);
+			const glm::vec3 af0 = glm::abs(f[0]), af1 = glm::abs(f[1]);
+			sliver = glm::length(n) <= 1e-3f * (af0.x + af0.y + af0.z) * (af1.x + af1.y + af1.z);
+		}
+	};
+
+	// Boxes in SoA form, tested against one triangle _AABB_BATCH_SIZE at a time, one per SIMD lane
+	const int _AABB_BATCH_SIZE = 4;
+
+	struct _AABBBatch {
+		alignas(16) float xmin[_AABB_BATCH_SIZE] = {};
+		alignas(16) float ymin[_AABB_BATCH_SIZE] = {};
+		alignas(16) float zmin[_AABB_BATCH_SIZE] = {};
+		alignas(16) float xmax[_AABB_BATCH_SIZE] = {};
+		alignas(16) float ymax[_AABB_BATCH_SIZE] = {};
+		alignas(16) float zmax[_AABB_BATCH_SIZE] = {};
+		int size = 0;
+
+		inline void push_back(const _AABB& AABB) {
+			xmin[size] = AABB.xmin; ymin[size] = AABB.ymin; zmin[size] = AABB.zmin;
+			xmax[size] = AABB.xmax; ymax[size] = AABB.ymax; zmax[size] = AABB.zmax;
+			size++;
+		}
+	};
+
+	// Classifies all lanes, the ones past batch.size hold stale boxes and are to be ignored.
+	// The box face axes use the same inclusive bounds test as before the SAT, the 9 edge cross axes and the
+	// face normal use the box grown by _SAT_TOLERANCE
+	inline void _classify_triangle_against_AABBs(const _SATTriangle& tri, const _AABBBatch& batch, uint8_t overlap[_AABB_BATCH_SIZE]) {
+		using vk3DGRT::float4;
+		const float4 xmin = float4::load(batch.xmin), ymin = float4::load(batch.ymin), zmin = float4::load(batch.zmin);
+		const float4 xmax = float4::load(batch.xmax), ymax = float4::load(batch.ymax), zmax = float4::load(batch.zmax);
+		const float4 triMinX(tri.minPos.x), triMinY(tri.minPos.y), triMinZ(tri.minPos.z);
+		const float4 triMaxX(tri.maxPos.x), triMaxY(tri.maxPos.y), triMaxZ(tri.maxPos.z);
+		float4 separated = (xmax < triMinX) | (xmin > triMaxX) | (ymax < triMinY) | (ymin > triMaxY) | (zmax < triMinZ) | (zmin > triMaxZ);
+		const float4 inside = (xmin <= triMinX) & (triMaxX <= xmax) & (ymin <= triMinY) & (triMaxY <= ymax) & (zmin <= triMinZ) & (triMaxZ <= zmax);
+
+		// box in center-extents form, the triangle relative to its center
+		const float4 half(0.5f);
+		const float4 ex = (xmax - xmin) * half, ey = (ymax - ymin) * half, ez = (zmax - zmin) * half;
+		const float4 cx = xmin + ex, cy = ymin + ey, cz = zmin + ez;
+		const float4 tolerance = float4(_SAT_TOLERANCE) * (ex + ey + ez + abs(cx) + abs(cy) + abs(cz));
+		const float4 vx[3] = { float4(tri.v[0].x) - cx, float4(tri.v[1].x) - cx, float4(tri.v[2].x) - cx };
+		const float4 vy[3] = { float4(tri.v[0].y) - cy, float4(tri.v[1].y) - cy, float4(tri.v[2].y) - cy };
+		const float4 vz[3] = { float4(tri.v[0].z) - cz, float4(tri.v[1].z) - cz, float4(tri.v[2].z) - cz };
+
+		// the axis separates when the triangle projection [pmin, pmax] misses the box projection [-r, r] grown by
+		// the tolerance times the axis length (L1, an upper bound of the L2 length)
+		auto separates = [&](const float4& p0, const float4& p1, const float4& p2, const float4& r) {
+			return (min(min(p0, p1), p2) > r) | (max(max(p0, p1), p2) < -r);
+		};
+		const float4 anx(fabsf(tri.n.x)), any(fabsf(tri.n.y)), anz(fabsf(tri.n.z));
+		const float4 d = float4(tri.n.x) * vx[0] + float4(tri.n.y) * vy[0] + float4(tri.n.z) * vz[0];
+		if (!tri.sliver) separated = separated | (abs(d) > ex * anx + ey * any + ez * anz + tolerance * (anx + any + anz));
+
+		// the edge axes only matter for the lanes the cheaper tests left undecided
+		const int undecided = ~movemask(separated | inside) & ((1 << batch.size) - 1);
+		for (int j = 0; j < 3 && undecided != 0; j++) {
+			const float4 fx(tri.f[j].x), fy(tri.f[j].y), fz(tri.f[j].z);
+			const float4 afx(fabsf(tri.f[j].x)), afy(fabsf(tri.f[j].y)), afz(fabsf(tri.f[j].z));
+			// x cross f = (0, -fz, fy)
+			separated = separated | separates(vz[0] * fy - vy[0] * fz, vz[1] * fy - vy[1] * fz, vz[2] * fy - vy[2] * fz, ey * afz + ez * afy + tolerance * (afy + afz));
+			// y cross f = (fz, 0, -fx)
+			separated = separated | separates(vx[0] * fz - vz[0] * fx, vx[1] * fz - vz[1] * fx, vx[2] * fz - vz[2] * fx, ex * afz + ez * afx + tolerance * (afx + afz));
+			// z cross f = (-fy, fx, 0)
+			separated = separated | separates(vy[0] * fx - vx[0] * fy, vy[1] * fx - vx[1] * fy, vy[2] * fx - vx[2] * fy, ex * afy + ey * afx + tolerance * (afx + afy));
+		}
+		const int separatedMask = movemask(separated);
+		const int insideMask = movemask(inside);
+		for (int i = 0; i < _AABB_BATCH_SIZE; i++) {
+			overlap[i] = (separatedMask >> i) & 1 ? _OUTSIDE : ((insideMask >> i) & 1 ? _INSIDE : _CROSSES);
+		}
+	}
+
+	// A triangle clipped by the 6 planes of an AABB is a convex polygon of at most 3 + 6 vertices. Rounding can
+	// leave it slightly non convex, so the capacity is the bound of any input instead: one plane keeps the inside
+	// vertices and adds one per crossing edge, at most 3n/2 vertices from n. 3 -> 4 -> 6 -> 9 -> 13 -> 19 -> 28
+	const int _MAX_POLYGON_SIZE = 28;
+
+	// Fixed capacity polygon, lives on the stack so clipping does not allocate
+	struct _Polygon {
+		glm::vec3 v[_MAX_POLYGON_SIZE];
+		int size = 0;
+
+		inline void push_back(const glm::vec3& vertex) {
+			assert(size < _MAX_POLYGON_SIZE);
+			v[size++] = vertex;
+		}
+	};
+
+	inline void _clip_polygon_against_plane(const _Polygon& pg_from, _Polygon& pg_to, float boundary, _axis axis, _side side) {
+		bool inside_prev; // is the prev vertex inside the clipping plane?
+		const int pg_from_size = pg_from.size;
+
+		pg_to.size = 0;
 		if (pg_from_size == 0) return;
 		// for the first vkglTF::Vertex
-		inside_prev = _inside(pg_from[0][axis], boundary, side);
-		//if (inside_prev)
-		//	pg_to.push_back(pg_from[0]);
+		inside_prev = _inside(pg_from.v[0][axis], boundary, side);
 
 		for (int index_prev = 0; index_prev < pg_from_size; index_prev++) {
 			const int index_cur = (index_prev + 1) % pg_from_size;
-			const bool inside_cur = _inside(pg_from[index_cur][axis], boundary, side);
-
-			if (inside_prev) {
-				if (inside_cur) { // prev in & cur in
-					pg_to.push_back(pg_from[index_cur]);
-				}
-				else { // prev in & cur out
-					float t = fabsf((pg_from[index_prev][axis] - boundary) / (pg_from[index_prev][axis] - pg_from[index_cur][axis]));
-
-					glm::vec3 vertex;
-					vertex = t * pg_from[index_cur] + (1.0f - t) * pg_from[index_prev];
+			const bool inside_cur = _inside(pg_from.v[index_cur][axis], boundary, side);
 
-					pg_to.push_back(vertex);
-				}
+			if (inside_prev != inside_cur) { // the edge crosses the plane
+				const glm::vec3& prev = pg_from.v[index_prev];
+				const glm::vec3& cur = pg_from.v[index_cur];
+				float t = fabsf((prev[axis] - boundary) / (prev[axis] - cur[axis]));
+				pg_to.push_back(t * cur + (1.0f - t) * prev);
 			}
-			else {
-				if (inside_cur) { // prev out & cur in
-					float t = fabsf((pg_from[index_prev][axis] - boundary) / (pg_from[index_prev][axis] - pg_from[index_cur][axis]));
-
-					glm::vec3 vertex;
-					vertex = t * pg_from[index_cur] + (1.0f - t) * pg_from[index_prev];
-
-					pg_to.push_back(vertex);
-					
-					pg_to.push_back(pg_from[index_cur]);
-				}
-				else { // prev out & cur out
-					// do nothing
-				}
+			if (inside_cur) {
+				pg_to.push_back(pg_from.v[index_cur]);
 			}
 
 			inside_prev = inside_cur;
 		}
 	}
 
-	void _clip_triangle_against_AABB(glm::vec3* triangle, _AABB& AABB, std::vector<glm::vec3>& polygon) {
-		// clip triangle against AABB and return the resulting polygon.
-		// To call this function
-		// 1. set up triangle[0], triangle[1], triangle[2] so that their coord stores p[0], p[1], and p[2], and
-		//    their st stores (1.0, 0.0), (0.0, 1.0), and (0.0, 0.0), respectively.
-		// 2. set up AABB's coordinates.
-		//  Then, calling this function returns a convex polygon.
-		//  From this (non-null) polygon, generate a list of triangles using delauneay trianglulation (for a convex polygon).
-
-		std::vector<glm::vec3> pg[2]; // flip its function during iterations
-		int pg_from = 0;
+	inline void _clip_triangle_against_AABB(const glm::vec3* triangle, const _AABB& AABB, _Polygon& polygon) {
+		// clip triangle against AABB and return the resulting convex polygon, see the std::vector version below
+		_Polygon pg; // ping-pong with the output polygon, which ends up holding the result after the 6 (even) planes
 
-		// initially copy the input triangle to pg_from
-		pg[pg_from].clear();
+		polygon.size = 3;
 		for (int i = 0; i < 3; i++)
-			pg[pg_from].push_back(triangle[i]);
-
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.xmin, _X, _MIN);
-		pg_from = 1 - pg_from;
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.xmax, _X, _MAX);
-
-		pg_from = 1 - pg_from;
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.ymin, _Y, _MIN);
-		pg_from = 1 - pg_from;
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.ymax, _Y, _MAX);
-
-		pg_from = 1 - pg_from;
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.zmin, _Z, _MIN);
-		pg_from = 1 - pg_from;
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.zmax, _Z, _MAX);
-
-		// do this more efficiently ???
-		polygon.clear();
-		for (int i = 0; i < pg[1 - pg_from].size(); i++)
-			polygon.push_back(pg[1 - pg_from][i]);
+			polygon.v[i] = triangle[i];
+
+		_clip_polygon_against_plane(polygon, pg, AABB.xmin, _X, _MIN);
+		_clip_polygon_against_plane(pg, polygon, AABB.xmax, _X, _MAX);
+
+		_clip_polygon_against_plane(polygon, pg, AABB.ymin, _Y, _MIN);
+		_clip_polygon_against_plane(pg, polygon, AABB.ymax, _Y, _MAX);
+
+		_clip_polygon_against_plane(polygon, pg, AABB.zmin, _Z, _MIN);
+		_clip_polygon_against_plane(pg, polygon, AABB.zmax, _Z, _MAX);
 	}
 
-	void _clip_triangle_against_AABB_np(glm::vec3 triangle[3], _AABB& AABB, std::vector<glm::vec3>& polygon) {
+	void _clip_triangle_against_AABB(glm::vec3* triangle, _AABB& AABB, std::vector<glm::vec3>& polygon) {
 		// clip triangle against AABB and return the resulting polygon.
 		// To call this function
 		// 1. set up triangle[0], triangle[1], triangle[2] so that their coord stores p[0], p[1], and p[2], and
@@ -207,31 +188,12 @@ namespace AABB_Triangle_Clipping {
 		//  Then, calling this function returns a convex polygon.
 		//  From this (non-null) polygon, generate a list of triangles using delauneay trianglulation (for a convex polygon).
 
-		std::vector<glm::vec3> pg[2]; // flip its function during iterations
-		int pg_from = 0;
+		_Polygon pg;
+		_clip_triangle_against_AABB(triangle, AABB, pg);
+		polygon.assign(pg.v, pg.v + pg.size);
+	}
 
-		// initially copy the input triangle to pg_from
-		pg[pg_from].clear();
-		for (int i = 0; i < 3; i++)
-			pg[pg_from].push_back(triangle[i]);
-
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.xmin, _X, _MIN);
-		pg_from = 1 - pg_from;
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.xmax, _X, _MAX);
-
-		pg_from = 1 - pg_from;
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.ymin, _Y, _MIN);
-		pg_from = 1 - pg_from;
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.ymax, _Y, _MAX);
-
-		pg_from = 1 - pg_from;
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.zmin, _Z, _MIN);
-		pg_from = 1 - pg_from;
-		_clip_polygon_against_plane(pg[pg_from], pg[1 - pg_from], AABB.zmax, _Z, _MAX);
-
-		// do this more efficiently ???
-		polygon.clear();
-		for (int i = 0; i < pg[1 - pg_from].size(); i++)
-			polygon.push_back(pg[1 - pg_from][i]);
+	void _clip_triangle_against_AABB_np(glm::vec3 triangle[3], _AABB& AABB, std::vector<glm::vec3>& polygon) {
+		_clip_triangle_against_AABB(triangle, AABB, polygon);
 	}
 }
\ No newline at end of file
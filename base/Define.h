@@ -42,23 +42,50 @@
 #define LOAD_GLTF 0
 
  // ---------- split blas ---------- //
-#define SPLIT_BLAS 0		// This macro should be managed with 3dgs.glsl
-#define NUMBER_OF_CELLS_PER_LONGEST_AXIS 10
+#define SPLIT_BLAS 0		// The shaders follow through the blasMode specialization constant (vk3DGRT::BlasMode)
+#define NUMBER_OF_CELLS_PER_LONGEST_AXIS 10	// Default of SplitBLAS::cellsPerLongestAxis, --splitcells at run time
+#define SPLIT_BLAS_ADAPTIVE 0		// 0: uniform grid of NUMBER_OF_CELLS_PER_LONGEST_AXIS, 1: binned SAH partition (SplitBLAS::adaptivePartition)
+#define SPLIT_BLAS_TRIANGLES_PER_CELL 32768	// Target triangle budget of an adaptive cell
+#define SPLIT_BLAS_BATCHED_BUILD 1	// Build all BLASes from one command buffer and a shared scratch pool (SplitBLAS::batchedBuild)
+#define SPLIT_BLAS_SCRATCH_POOL_MB 256	// Scratch pool budget of the batched build, builds beyond it wait for the previous batch
+#define SPLIT_BLAS_CACHE 1	// Keep the split cells in <PLY_FILE>.splitblas and skip the split while the geometry and split settings match
 #define SCENE_EPSILON 1e-4f
 #define ONE_VERTEX_BUFFER false
 
 // ---------- compute pipeline ray query ---------- //
 #define RAY_QUERY 0
-#define TB_SIZE_X 1	// Should be managed with define.glsl
-#define TB_SIZE_Y 2	// Should be managed with define.glsl
+#define TB_SIZE_X 1	// Default workgroup size of particleRendering.comp, specialized at pipeline creation (--tbsize)
+#define TB_SIZE_Y 2
 
 #define MULTIQUEUE 0	// 0 is Default
 #define TIMER_CORRECTION 1
 #define TEXTURE_COMPRESSION 0
-#define ENABLE_HIT_COUNTS 0	// Should be managed with 3dgs.glsl. Only use when the RAY_QUERY is 0.
+#define ENABLE_HIT_COUNTS 0	// Default of --hitcounts, the hitCounts specialization constant. Only use when the RAY_QUERY is 0.
+#define ADAPTIVE_TRACING 0	// Default of --adaptivetracing: k-buffer of the later rounds shrunk to the hits expected to reach minTransmittance in raygen.rgen (RAY_QUERY 0)
 #define EVAL_QUALITY 1
 
 #define USE_ANIMATION 0 // 0 is Default
+#define LOAD_3DGRT_CONTAINER 0	// Load <PLY_FILE>.3dgrt (written with --convert) instead of the .ply
+#define STREAMING_MODEL_UPLOAD 1	// Parse the .ply in chunks on a thread while the previous chunks are uploaded, through the transfer queue when the device has one (vk3DGRT::Model::streamingUpload)
+#define K_BUFFER_SIZE 16	// k-buffer depth (MAX_HIT_PER_TRACE) of the particle rendering pass: 4, 8, 16 or 32, see --kbuffer
+#define K_BUFFER_PERMUTATIONS 0	// Build the pipelines of every compiled k-buffer size at startup for the runtime switch (keypad +), 0 builds the K_BUFFER_SIZE one only
+#define HOST_RESIDENCY 1	// Host particle data kept after the upload (vk3DGRT::HostResidency): 0 keep, 1 container mapping only, 2 nothing
+#define CPU_GAUSSIAN_ENCLOSING 0	// Gaussian enclosing pass on the host instead of particlePrimitives.comp (vk3DGRT::Model::hostEnclosing)
+#define AS_COMPACTION 0	// Compact the BLASes into right-sized buffers after the build. Off: not run on a ray tracing device yet
+#define AS_UPDATE 0	// Build the 3DGRT BLAS/TLAS with ALLOW_UPDATE so edited particles are refitted in place (refitAccelerationStructure3DGRT), see --animateparticles
+#define AS_REFIT_REBUILD_FRACTION 0.25f	// Dirty particle fraction above which a refit rebuilds the BLAS instead
+#define AS_REFIT_MAX_UPDATES 16	// Refits since the last BLAS build before a rebuild, the trace quality drops with each
+#define INSTANCED_BLAS 0	// One unit icosahedron BLAS and a TLAS instance per particle (vk3DGRT::Model::instancedBLAS). Default of --blasmode
+#define PROCEDURAL_PRIMITIVES 0	// One AABB per particle, hit by particleIntersection.rint (vk3DGRT::Model::proceduralPrimitives). Default of --blasmode
+#define PARTICLE_DENSITY_LAYOUT 0	// ParticleDensity read per hit (vk3DGRT::DensityLayout): 0 float (48 bytes), 1 packed (32 bytes). Default of --densitylayout
+#define FRUSTUM_CULLING 0	// Leave the split cells / particle instances outside the camera frustum out of the TLAS, built again on camera moves in the frame command buffer
+
+#if INSTANCED_BLAS && SPLIT_BLAS
+#error "INSTANCED_BLAS and SPLIT_BLAS can not be combined"
+#endif
+#if PROCEDURAL_PRIMITIVES && (SPLIT_BLAS || INSTANCED_BLAS)
+#error "PROCEDURAL_PRIMITIVES can not be combined with SPLIT_BLAS or INSTANCED_BLAS"
+#endif
 
 #define N_IS_UP		// Should be managed with 3DGRT Asset Num.
 //#define Y_IS_UP
@@ -128,6 +155,8 @@
 
 /*** 3DGS ***/
 #define BUFFER_REFERENCE false		// This macro should be managed with 3dgs.glsl
-#define NUM_OF_GAUSSIANS 1024	// This macro should be managed with 3dgs.glsl
+#define NUM_OF_GAUSSIANS 1024	// Workgroup size of particlePrimitives.comp, specialized at pipeline creation
+#define ALPHA_MIN_THRESHOLD 0.0039215686275f	// Specialized into the shaders (alphaMinThreshold). Particles of a lower density never pass it and are dropped at activation
 #define MAX_N_FEATURES 3
+#define SPH_ACTIVE_DEGREE_EPSILON 1e-3f	// SH bands whose coefficients all stay within it are skipped per particle (ParticleDensity::sphActiveDegree), --shepsilon
 #define SPECULAR_DIMENSION 3 * ((MAX_N_FEATURES + 1) * (MAX_N_FEATURES + 1) - 1)
\ No newline at end of file
@@ -0,0 +1,391 @@
+/*
+ * Abura Soba, 2025
+ *
+ * Vulkan3DGRTEnclosing.cpp
+ *
+ * Host implementation of the Gaussian enclosing pass (particlePrimitives.comp).
+ * Particles are processed 4 at a time, one per SIMD lane, and split into contiguous ranges over a thread pool.
+ * Kept particles are compacted with a prefix sum instead of the shader's atomic counter, so the output order
+ * is deterministic (the order of the splat set).
+ */
+
+#include "Vulkan3DGRTEnclosing.h"
+#include "threadpool.hpp"
+#include "float4.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+namespace vk3DGRT {
+	namespace enclosing {
+		const uint32_t adaptiveKernelClamping = 1 << 0;	// vks::utils::MOGRenderAdaptiveKernelClamping
+
+		const float goldenRatio = 1.618033988749895f;
+		const float icosaEdge = 1.323169076499215f;
+		const float icosaVrtScale = 0.5f * icosaEdge;
+
+		const float icosaHedronVrt[icosaHedronNumVrt][3] = {
+			{ -1, goldenRatio, 0 }, { 1, goldenRatio, 0 }, { 0, 1, -goldenRatio },
+			{ -goldenRatio, 0, -1 }, { -goldenRatio, 0, 1 }, { 0, 1, goldenRatio },
+			{ goldenRatio, 0, 1 }, { 0, -1, goldenRatio }, { -1, -goldenRatio, 0 },
+			{ 0, -1, -goldenRatio }, { goldenRatio, 0, -1 }, { 1, -goldenRatio, 0 }
+		};
+
+		const uint32_t icosaHedronTri[icosaHedronNumTri][3] = {
+			{ 0, 1, 2 }, { 0, 2, 3 }, { 0, 3, 4 }, { 0, 4, 5 }, { 0, 5, 1 },
+			{ 6, 1, 5 }, { 6, 5, 7 }, { 6, 7, 11 }, { 6, 11, 10 }, { 6, 10, 1 },
+			{ 8, 4, 3 }, { 8, 3, 9 }, { 8, 9, 11 }, { 8, 11, 7 }, { 8, 7, 4 },
+			{ 9, 3, 2 }, { 9, 2, 10 }, { 9, 10, 11 },
+			{ 5, 4, 7 }, { 1, 10, 2 }
+		};
+
+		static float kernelScale(float density, float modulatedMinResponse, uint32_t opts, float kernelDegree)
+		{
+			const float responseModulation = (opts & adaptiveKernelClamping) != 0 ? density : 1.0f;
+			const float minResponse = std::min(modulatedMinResponse / responseModulation, 0.97f);
+
+			// bump kernel
+			if (kernelDegree < 0) {
+				const float k = std::abs(kernelDegree);
+				const float s = 1.0f / std::pow(3.0f, k);
+				return std::pow((1.f / (std::log(minResponse) - 1.f) + 1.f) / s, 1.f / k);
+			}
+
+			// linear kernel
+			if (kernelDegree == 0) {
+				return ((1.0f - minResponse) / 3.0f) / -0.329630334487f;
+			}
+
+			// generalized gaussian of degree b : scaling a = -4.5/3^b
+			const float b = kernelDegree;
+			const float a = -4.5f / std::pow(3.0f, b);
+			return std::pow(std::log(minResponse) / a, 1.0f / b);
+		}
+
+		// Splits [0, count) into contiguous ranges (multiples of 4 particles) and runs func(range, begin, end) on a thread pool
+		template<typename Func>
+		static void parallelRanges(size_t count, size_t numRanges, Func func)
+		{
+			const size_t rangeSize = ((count + numRanges - 1) / numRanges + 3) / 4 * 4;
+			if (numRanges == 1) {
+				func(0, 0, count);
+				return;
+			}
+			vks::ThreadPool threadPool;
+			threadPool.setThreadCount((uint32_t)numRanges);
+			for (size_t r = 0; r < numRanges; r++) {
+				const size_t begin = std::min(count, r * rangeSize);
+				const size_t end = std::min(count, begin + rangeSize);
+				threadPool.threads[r]->addJob([=] { func(r, begin, end); });
+			}
+			threadPool.wait();
+		}
+
+		static size_t rangeCount(size_t count)
+		{
+			return std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), (count + 4095) / 4096));
+		}
+
+		/*
+		* Albedo/specular rejection test of particlePrimitives.comp for the particles [first, first + 4), keep[lane] = 0 for outliers.
+		* Like the shader it reads 3 * (specularDimension - 1) specular vectors from the particle's own offset, so it runs into
+		* the following particles (out of range reads are treated as zero)
+		*/
+		static void filterBlock(const SplatSet& splatSet, size_t first, size_t numLanes, uint8_t* keep)
+		{
+			const size_t specularDimension = splatSet.specularDimension();
+			const size_t numFeatures = splatSet.f_rest.size();
+			alignas(16) float lanes[3][4] = {};
+
+			for (size_t lane = 0; lane < numLanes; lane++) {
+				for (int c = 0; c < 3; c++) lanes[c][lane] = splatSet.f_dc[(first + lane) * 3 + c];
+			}
+			const float4 albedoX = float4::load(lanes[0]), albedoY = float4::load(lanes[1]), albedoZ = float4::load(lanes[2]);
+			const float4 albedoStrength = sqrt(albedoX * albedoX + albedoY * albedoY + albedoZ * albedoZ);
+
+			float4 specularStrength(0.0f);
+			float4 maxSpecular(0.0f);
+			float4 minSpecular(1e10f);
+			for (size_t i = 1; i < specularDimension; i++) {
+				for (size_t lane = 0; lane < numLanes; lane++) {
+					const size_t featureIdx = (first + lane) * specularDimension + 3 * i;
+					for (int c = 0; c < 3; c++) lanes[c][lane] = featureIdx + c < numFeatures ? splatSet.f_rest[featureIdx + c] : 0.0f;
+				}
+				const float4 x = float4::load(lanes[0]), y = float4::load(lanes[1]), z = float4::load(lanes[2]);
+				specularStrength = specularStrength + sqrt(x * x + y * y + z * z);
+				maxSpecular = max(specularStrength, maxSpecular);
+				minSpecular = min(specularStrength, minSpecular);
+			}
+
+			const float4 ratio = maxSpecular / (minSpecular + float4(1e-5f));
+			alignas(16) float albedoOut[4], ratioOut[4];
+			albedoStrength.store(albedoOut);
+			ratio.store(ratioOut);
+			for (size_t lane = 0; lane < numLanes; lane++) {
+				// the particles below ALPHA_MIN_THRESHOLD never pass the alpha test of the hit shaders (response <= 1)
+				const float density = 1.0f / (1.0f + std::exp(-splatSet.opacity[first + lane]));
+				keep[lane] = !(albedoOut[lane] > 3.0f || ratioOut[lane] > 150.0f) && density > ALPHA_MIN_THRESHOLD;
+			}
+		}
+
+		uint32_t activeSphDegree(const float* specular, size_t specularDimension, float sphDegreeEpsilon)
+		{
+			// from the last coefficient down, the band of the first one above epsilon
+			for (size_t coeff = specularDimension / 3; coeff > 0; coeff--) {
+				const float* rgb = specular + (coeff - 1) * 3;
+				if (std::abs(rgb[0]) > sphDegreeEpsilon || std::abs(rgb[1]) > sphDegreeEpsilon || std::abs(rgb[2]) > sphDegreeEpsilon) {
+					return static_cast<uint32_t>(std::sqrt(static_cast<float>(coeff)) + 1e-3f);
+				}
+			}
+			return 0;
+		}
+
+		size_t activateParticles(const SplatSet& splatSet, std::vector<float>& densities, std::vector<float>& sphCoefficients, glm::vec3& aabbMin, glm::vec3& aabbMax,
+			float sphDegreeEpsilon)
+		{
+			const size_t specularDimension = splatSet.specularDimension();
+			const size_t sphStride = 3 + specularDimension;
+			const size_t numSplats = splatSet.size();
+			const size_t numRanges = rangeCount(numSplats);
+
+			// (1) outlier filter, kept particles per range
+			std::vector<uint8_t> keep(numSplats);
+			std::vector<size_t> rangeOffsets(numRanges + 1, 0);
+			parallelRanges(numSplats, numRanges, [&](size_t range, size_t begin, size_t end) {
+				size_t kept = 0;
+				for (size_t i = begin; i < end; i += 4) {
+					const size_t numLanes = std::min<size_t>(4, end - i);
+					filterBlock(splatSet, i, numLanes, &keep[i]);
+					for (size_t lane = 0; lane < numLanes; lane++) kept += keep[i + lane];
+				}
+				rangeOffsets[range + 1] = kept;
+			});
+			for (size_t r = 0; r < numRanges; r++) rangeOffsets[r + 1] += rangeOffsets[r];
+			const size_t numKept = rangeOffsets[numRanges];
+
+			// (2) activation, written at the prefix sum of the kept particles
+			densities.resize(numKept * densityStride);
+			sphCoefficients.resize(numKept * sphStride);
+			std::vector<glm::vec3> rangeMin(numRanges, glm::vec3(FLT_MAX)), rangeMax(numRanges, glm::vec3(-FLT_MAX));
+			parallelRanges(numSplats, numRanges, [&](size_t range, size_t begin, size_t end) {
+				size_t saveIdx = rangeOffsets[range];
+				for (size_t i = begin; i < end; i++) {
+					if (!keep[i])
+						continue;
+
+					glm::vec3 position = glm::make_vec3(&splatSet.positions[i * 3]);
+					glm::vec4 quaternion = glm::normalize(glm::make_vec4(&splatSet.rotation[i * 4]));
+					glm::vec3 scale = glm::exp(glm::make_vec3(&splatSet.scale[i * 3]));	// scale activation
+					float density = 1.0f / (1.0f + std::exp(-splatSet.opacity[i]));	// sigmoid activation
+					const float* specular = splatSet.f_rest.data() + i * specularDimension;
+					const float sphActiveDegree = static_cast<float>(activeSphDegree(specular, specularDimension, sphDegreeEpsilon));
+
+					float* particleDensity = &densities[saveIdx * densityStride];
+					const float values[densityStride] = {
+						position.x, position.y, position.z, density,
+						quaternion.x, quaternion.y, quaternion.z, quaternion.w,
+						scale.x, scale.y, scale.z, sphActiveDegree
+					};
+					std::copy(values, values + densityStride, particleDensity);
+
+					float* sph = &sphCoefficients[saveIdx * sphStride];
+					std::copy(&splatSet.f_dc[i * 3], &splatSet.f_dc[i * 3] + 3, sph);
+					std::copy(specular, specular + specularDimension, sph + 3);
+
+					rangeMin[range] = glm::min(rangeMin[range], position);
+					rangeMax[range] = glm::max(rangeMax[range], position);
+					saveIdx++;
+				}
+			});
+
+			aabbMin = glm::vec3(FLT_MAX);
+			aabbMax = glm::vec3(-FLT_MAX);
+			for (size_t r = 0; r < numRanges; r++) {
+				aabbMin = glm::min(aabbMin, rangeMin[r]);
+				aabbMax = glm::max(aabbMax, rangeMax[r]);
+			}
+			return numKept;
+		}
+
+		// Enclosing icosahedra of the particles [first, first + numLanes), one per lane
+		static void icosaHedronBlock(const float* densities, size_t first, size_t numLanes, const Options& options, bool adaptive, float kernelScaleConst, float* vertices)
+		{
+			// ParticleDensity to lanes: position, density, quaternion (wxyz), scale
+			alignas(16) float lanes[densityStride][4];
+			alignas(16) float kernelScales[4];
+			for (size_t lane = 0; lane < 4; lane++) {
+				const float* particle = densities + (first + std::min(lane, numLanes - 1)) * densityStride;
+				for (size_t k = 0; k < densityStride; k++) lanes[k][lane] = particle[k];
+				kernelScales[lane] = !adaptive ? kernelScaleConst : kernelScale(particle[3], options.kernelMinResponse, options.opts, options.kernelDegree);
+			}
+			const float4 px = float4::load(lanes[0]), py = float4::load(lanes[1]), pz = float4::load(lanes[2]);
+			const float4 w = float4::load(lanes[4]), x = float4::load(lanes[5]), y = float4::load(lanes[6]), z = float4::load(lanes[7]);
+
+			// quaternionWXYZToMatrixTranspose (utils.glsl), columns c0 c1 c2
+			const float4 one(1.0f), two(2.0f);
+			const float4 xx = x * x, yy = y * y, zz = z * z;
+			const float4 xy = x * y, xz = x * z, yz = y * z;
+			const float4 wx = w * x, wy = w * y, wz = w * z;
+			const float4 c0x = one - two * (yy + zz), c0y = two * (xy + wz), c0z = two * (xz - wy);
+			const float4 c1x = two * (xy - wz), c1y = one - two * (xx + zz), c1z = two * (yz + wx);
+			const float4 c2x = two * (xz + wy), c2y = two * (yz - wx), c2z = one - two * (xx + yy);
+
+			const float4 kernelScale4 = float4::load(kernelScales);
+			const float4 vrtScale(icosaVrtScale);
+			const float4 kx = kernelScale4 * float4::load(lanes[8]) * vrtScale;
+			const float4 ky = kernelScale4 * float4::load(lanes[9]) * vrtScale;
+			const float4 kz = kernelScale4 * float4::load(lanes[10]) * vrtScale;
+
+			alignas(16) float out[3][4];
+			for (uint32_t i = 0; i < icosaHedronNumVrt; i++) {
+				const float4 vx = kx * float4(icosaHedronVrt[i][0]);
+				const float4 vy = ky * float4(icosaHedronVrt[i][1]);
+				const float4 vz = kz * float4(icosaHedronVrt[i][2]);
+				(c0x * vx + c1x * vy + c2x * vz + px).store(out[0]);
+				(c0y * vx + c1y * vy + c2y * vz + py).store(out[1]);
+				(c0z * vx + c1z * vy + c2z * vz + pz).store(out[2]);
+				for (size_t lane = 0; lane < numLanes; lane++) {
+					float* vert = vertices + ((first + lane) * icosaHedronNumVrt + i) * 3;
+					vert[0] = out[0][lane];
+					vert[1] = out[1][lane];
+					vert[2] = out[2][lane];
+				}
+			}
+		}
+
+		void buildIcosaHedra(const float* densities, size_t numParticles, const Options& options, std::vector<float>& vertices, std::vector<uint32_t>& indices)
+		{
+			auto startTime = std::chrono::high_resolution_clock::now();
+
+			vertices.resize(numParticles * icosaHedronNumVrt * 3);
+			indices.resize(numParticles * icosaHedronNumTri * 3);
+
+			// without adaptive clamping the kernel scale does not depend on the particle
+			const bool adaptive = (options.opts & adaptiveKernelClamping) != 0;
+			const float kernelScaleConst = adaptive ? 0.0f : kernelScale(1.0f, options.kernelMinResponse, options.opts, options.kernelDegree);
+
+			parallelRanges(numParticles, rangeCount(numParticles), [&](size_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i += 4) {
+					icosaHedronBlock(densities, i, std::min<size_t>(4, end - i), options, adaptive, kernelScaleConst, vertices.data());
+				}
+				for (size_t i = begin; i < end; i++) {
+					uint32_t* tri = &indices[i * icosaHedronNumTri * 3];
+					const uint32_t triIdxOffset = (uint32_t)(icosaHedronNumVrt * i);
+					for (uint32_t t = 0; t < icosaHedronNumTri; t++) {
+						tri[t * 3 + 0] = icosaHedronTri[t][0] + triIdxOffset;
+						tri[t * 3 + 1] = icosaHedronTri[t][1] + triIdxOffset;
+						tri[t * 3 + 2] = icosaHedronTri[t][2] + triIdxOffset;
+					}
+				}
+			});
+
+			auto endTime = std::chrono::high_resolution_clock::now();
+			std::cout << "Enclosing icosahedra built on the host in " << std::chrono::duration<double, std::milli>(endTime - startTime).count() << "ms (" << numParticles << " particles)" << std::endl;
+		}
+
+		void buildUnitIcosaHedron(std::vector<float>& vertices, std::vector<uint32_t>& indices)
+		{
+			vertices.resize(icosaHedronNumVrt * 3);
+			indices.resize(icosaHedronNumTri * 3);
+			for (uint32_t i = 0; i < icosaHedronNumVrt; i++)
+				for (uint32_t k = 0; k < 3; k++)
+					vertices[i * 3 + k] = icosaHedronVrt[i][k] * icosaVrtScale;
+			for (uint32_t t = 0; t < icosaHedronNumTri; t++)
+				for (uint32_t k = 0; k < 3; k++)
+					indices[t * 3 + k] = icosaHedronTri[t][k];
+		}
+
+		void packParticleDensities(const float* densities, size_t numParticles, std::vector<uint32_t>& packed)
+		{
+			packed.resize(numParticles * packedDensityStride);
+			parallelRanges(numParticles, rangeCount(numParticles), [&](size_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					const float* particle = densities + i * densityStride;
+					uint32_t* dst = &packed[i * packedDensityStride];
+					// packUnorm2x16(vec2(density, 0)) | sphActiveDegree << 16
+					memcpy(dst, particle, sizeof(float) * 3);
+					const uint32_t density = static_cast<uint32_t>(std::round(std::clamp(particle[3], 0.0f, 1.0f) * 65535.0f));
+					dst[3] = density | (static_cast<uint32_t>(particle[11]) << 16);
+					dst[4] = glm::packHalf2x16(glm::vec2(particle[4], particle[5]));
+					dst[5] = glm::packHalf2x16(glm::vec2(particle[6], particle[7]));
+					dst[6] = glm::packHalf2x16(glm::vec2(particle[8], particle[9]));
+					dst[7] = glm::packHalf2x16(glm::vec2(particle[10], 0.0f));
+				}
+			});
+		}
+
+		void buildInstanceTransforms(const float* densities, size_t numParticles, const Options& options, std::vector<float>& transforms)
+		{
+			auto startTime = std::chrono::high_resolution_clock::now();
+
+			transforms.resize(numParticles * 12);
+			const bool adaptive = (options.opts & adaptiveKernelClamping) != 0;
+			const float kernelScaleConst = adaptive ? 0.0f : kernelScale(1.0f, options.kernelMinResponse, options.opts, options.kernelDegree);
+
+			parallelRanges(numParticles, rangeCount(numParticles), [&](size_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					const float* particle = densities + i * densityStride;
+					const float w = particle[4], x = particle[5], y = particle[6], z = particle[7];
+					const float ks = !adaptive ? kernelScaleConst : kernelScale(particle[3], options.kernelMinResponse, options.opts, options.kernelDegree);
+
+					// quaternionWXYZToMatrixTranspose (utils.glsl) columns, scaled by the kernel scaled particle scale
+					const float c[3][3] = {
+						{ 1.0f - 2.0f * (y * y + z * z), 2.0f * (x * y + w * z), 2.0f * (x * z - w * y) },
+						{ 2.0f * (x * y - w * z), 1.0f - 2.0f * (x * x + z * z), 2.0f * (y * z + w * x) },
+						{ 2.0f * (x * z + w * y), 2.0f * (y * z - w * x), 1.0f - 2.0f * (x * x + y * y) }
+					};
+					float* transform = &transforms[i * 12];
+					for (int row = 0; row < 3; row++) {
+						for (int col = 0; col < 3; col++)
+							transform[row * 4 + col] = c[col][row] * ks * particle[8 + col];
+						transform[row * 4 + 3] = particle[row];
+					}
+				}
+			});
+
+			auto endTime = std::chrono::high_resolution_clock::now();
+			std::cout << "Instance transforms built on the host in " << std::chrono::duration<double, std::milli>(endTime - startTime).count() << "ms (" << numParticles << " particles)" << std::endl;
+		}
+
+		void buildParticleAabbs(const float* densities, size_t numParticles, const Options& options, std::vector<float>& aabbs)
+		{
+			auto startTime = std::chrono::high_resolution_clock::now();
+
+			aabbs.resize(numParticles * 6);
+			const bool adaptive = (options.opts & adaptiveKernelClamping) != 0;
+			const float kernelScaleConst = adaptive ? 0.0f : kernelScale(1.0f, options.kernelMinResponse, options.opts, options.kernelDegree);
+
+			parallelRanges(numParticles, rangeCount(numParticles), [&](size_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					const float* particle = densities + i * densityStride;
+					const float w = particle[4], x = particle[5], y = particle[6], z = particle[7];
+					const float ks = !adaptive ? kernelScaleConst : kernelScale(particle[3], options.kernelMinResponse, options.opts, options.kernelDegree);
+
+					// same columns as buildInstanceTransforms, the unit sphere (inscribed in the unit icosahedron) maps to the ellipsoid
+					const float c[3][3] = {
+						{ 1.0f - 2.0f * (y * y + z * z), 2.0f * (x * y + w * z), 2.0f * (x * z - w * y) },
+						{ 2.0f * (x * y - w * z), 1.0f - 2.0f * (x * x + z * z), 2.0f * (y * z + w * x) },
+						{ 2.0f * (x * z + w * y), 2.0f * (y * z - w * x), 1.0f - 2.0f * (x * x + y * y) }
+					};
+					float* aabb = &aabbs[i * 6];
+					for (int row = 0; row < 3; row++) {
+						// half extent of the ellipsoid along the axis: length of the matrix row
+						float extent = 0.0f;
+						for (int col = 0; col < 3; col++) {
+							const float e = c[col][row] * ks * particle[8 + col];
+							extent += e * e;
+						}
+						extent = std::sqrt(extent);
+						aabb[row] = particle[row] - extent;
+						aabb[3 + row] = particle[row] + extent;
+					}
+				}
+			});
+
+			auto endTime = std::chrono::high_resolution_clock::now();
+			std::cout << "Particle AABBs built on the host in " << std::chrono::duration<double, std::milli>(endTime - startTime).count() << "ms (" << numParticles << " particles)" << std::endl;
+		}
+	}
+}
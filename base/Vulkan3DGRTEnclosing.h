@@ -0,0 +1,54 @@
+/*
+ * Abura Soba, 2025
+ *
+ * Vulkan3DGRTEnclosing.h
+ *
+ * Host implementation of the Gaussian enclosing pass (particlePrimitives.comp)
+ */
+
+#pragma once
+
+#include "Vulkan3DGRTModel.h"
+
+#include <vector>
+
+namespace vk3DGRT {
+	namespace enclosing {
+		const uint32_t icosaHedronNumVrt = 12;
+		const uint32_t icosaHedronNumTri = 20;
+		const size_t densityStride = 12;	// floats per ParticleDensity
+		const size_t packedDensityStride = 8;	// uints per packed ParticleDensity (DensityLayoutPacked)
+
+		// Same values as vks::utils::GaussianEnclosingUniformData
+		struct Options {
+			uint32_t opts = 0;					// vks::utils::MOGRenderOpts
+			float kernelMinResponse = 0.0113f;
+			float kernelDegree = 4.0f;
+		};
+
+		// Outlier and ALPHA_MIN_THRESHOLD filter and activation of a PLY splat set. Writes the kept particles in their original order,
+		// laid out like the ParticleDensity and float ParticleSphCoefficient buffers, with the activeSphDegree of each in its last float
+		size_t activateParticles(const SplatSet& splatSet, std::vector<float>& densities, std::vector<float>& sphCoefficients, glm::vec3& aabbMin, glm::vec3& aabbMax,
+			float sphDegreeEpsilon = SPH_ACTIVE_DEGREE_EPSILON);
+
+		// Highest SH band of a particle with a coefficient beyond sphDegreeEpsilon, 0 when only the albedo is left.
+		// specular holds specularDimension floats, RGB triplets of the coefficients 1 and up (SplatSet::f_rest)
+		uint32_t activeSphDegree(const float* specular, size_t specularDimension, float sphDegreeEpsilon);
+
+		// Packed ParticleDensity of the hit shaders (DensityLayoutPacked), same as particlePrimitives.comp: fp32 position,
+		// unorm16 density and sphActiveDegree in the first uvec4, fp16 quaternion and scale in the second
+		void packParticleDensities(const float* densities, size_t numParticles, std::vector<uint32_t>& packed);
+
+		// Enclosing icosahedron of every activated particle (12 vertices, 20 triangles each), ready for the BLAS build
+		void buildIcosaHedra(const float* densities, size_t numParticles, const Options& options, std::vector<float>& vertices, std::vector<uint32_t>& indices);
+
+		// Icosahedron shared by every particle in the instanced BLAS mode (the enclosing icosahedron before kernel scale, rotation and translation)
+		void buildUnitIcosaHedron(std::vector<float>& vertices, std::vector<uint32_t>& indices);
+
+		// Per particle 3x4 row major transform of the unit icosahedron (rotation * kernel scaled scale, position), laid out like VkTransformMatrixKHR
+		void buildInstanceTransforms(const float* densities, size_t numParticles, const Options& options, std::vector<float>& transforms);
+
+		// Per particle bounds of the kernel scaled ellipsoid (min xyz, max xyz), laid out like VkAabbPositionsKHR
+		void buildParticleAabbs(const float* densities, size_t numParticles, const Options& options, std::vector<float>& aabbs);
+	}
+}
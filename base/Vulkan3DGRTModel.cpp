@@ -1,11 +1,213 @@
 #include "Vulkan3DGRTModel.h"
+#include "Vulkan3DGRTEnclosing.h"
+#include "threadpool.hpp"
 //#include "torch/script.h"
 #include "miniply.h"
 #include "chrono"
 
+#include <thread>
+#include <sstream>
+#include <fstream>
+#include <functional>
+#include <array>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+
 namespace vk3DGRT {
-	bool PLYLoader::loadPLYModel(const char *filename, SplatSet & output)
+#if !defined(__ANDROID__)
+	/*
+	* Fast path for the common 3DGS layout: binary_little_endian, the vertex element comes first
+	* and every vertex property is a float. Returns false for anything else so that the caller
+	* can fall back to miniply.
+	*/
+	bool PLYLoader::openMapped(const char* filename, uint32_t requestedSphDegree)
 	{
+		const uint16_t endianTest = 1;
+		if (*(const uint8_t*)&endianTest != 1) return false;
+
+		file = std::make_unique<vks::MappedFile>();
+		if (!file->open(filename)) return false;
+
+		// Parse the ascii header
+		const char* headerEnd = nullptr;
+		const char* endMarker = "end_header";
+		for (size_t i = 0; i + 10 < file->size && i < (1 << 16); i++) {
+			if (memcmp(file->data + i, endMarker, 10) == 0) {
+				size_t j = i + 10;
+				if (j < file->size && file->data[j] == '\r') j++;
+				if (j < file->size && file->data[j] == '\n') headerEnd = file->data + j + 1;
+				break;
+			}
+		}
+		if (!headerEnd) return false;
+
+		std::istringstream header(std::string(file->data, headerEnd - file->data));
+		std::string line, token;
+		std::vector<std::string> properties;
+		size_t numVerts = 0;
+		bool binaryLE = false, inVertex = false, vertexSeen = false;
+		while (std::getline(header, line)) {
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			std::istringstream ls(line);
+			ls >> token;
+			if (token == "format") {
+				ls >> token;
+				binaryLE = (token == "binary_little_endian");
+			}
+			else if (token == "element") {
+				std::string elementName;
+				ls >> elementName;
+				if (elementName == "vertex") {
+					if (vertexSeen) return false;
+					ls >> numVerts;
+					inVertex = vertexSeen = true;
+				}
+				else {
+					// Any element preceding the vertices would shift the data offset
+					if (!vertexSeen) return false;
+					inVertex = false;
+				}
+			}
+			else if (token == "property" && inVertex) {
+				std::string type, name;
+				ls >> type >> name;
+				if (type != "float" && type != "float32") return false;
+				properties.push_back(name);
+			}
+		}
+		if (!binaryLE || numVerts == 0) return false;
+
+		rowStride = properties.size() * sizeof(float);
+		if ((size_t)(file->data + file->size - headerEnd) < numVerts * rowStride) return false;
+
+		auto column = [&](const std::string& name) -> int {
+			for (size_t i = 0; i < properties.size(); i++)
+				if (properties[i] == name) return (int)i;
+			return -1;
+		};
+
+		size_t numRest = 0;
+		for (const std::string& property : properties)
+			numRest += property.compare(0, 7, "f_rest_") == 0;
+		const uint32_t fileSphDegree = sphDegreeFromRestCount(numRest);
+		if (fileSphDegree == UINT32_MAX) return false;
+		sphDegree = std::min(requestedSphDegree, fileSphDegree);
+		const size_t fileCoeffs = numRest / 3;
+		const size_t specularDimension = sphSpecularDimension(sphDegree);
+
+		// Source column of every destination float, in the order of each SplatSet field
+		bool allFound = true;
+		for (int i = 0; i < 3; i++) {
+			posCols[i] = column(std::string(1, (char)('x' + i)));
+			scaleCols[i] = column("scale_" + std::to_string(i));
+			dcCols[i] = column("f_dc_" + std::to_string(i));
+			allFound &= posCols[i] >= 0 && scaleCols[i] >= 0 && dcCols[i] >= 0;
+		}
+		for (int i = 0; i < 4; i++) {
+			rotCols[i] = column("rot_" + std::to_string(i));
+			allFound &= rotCols[i] >= 0;
+		}
+		opacityCol = column("opacity");
+		allFound &= opacityCol >= 0;
+		// f_rest is stored channel-major in the file, interleave the kept bands to RGB triplets
+		for (size_t i = 0; i < specularDimension / 3; i++) {
+			for (int c = 0; c < 3; c++) {
+				restCols[i * 3 + c] = column("f_rest_" + std::to_string(i + fileCoeffs * c));
+				allFound &= restCols[i * 3 + c] >= 0;
+			}
+		}
+		if (!allFound) return false;
+
+		rows = headerEnd;
+		numRows = numVerts;
+		return true;
+	}
+
+	void PLYLoader::extractRows(size_t begin, size_t end, SplatPointers dst) const
+	{
+		const size_t specularDimension = sphSpecularDimension(sphDegree);
+		for (size_t v = begin; v < end; v++) {
+			const char* src = rows + v * rowStride;
+			auto fetch = [src](int col) {
+				float value;
+				memcpy(&value, src + col * sizeof(float), sizeof(float));
+				return value;
+			};
+			const size_t dstIdx = v - begin;
+			for (int i = 0; i < 3; i++) {
+				dst.positions[dstIdx * 3 + i] = fetch(posCols[i]);
+				dst.scale[dstIdx * 3 + i] = fetch(scaleCols[i]);
+				dst.f_dc[dstIdx * 3 + i] = fetch(dcCols[i]);
+			}
+			for (int i = 0; i < 4; i++)
+				dst.rotation[dstIdx * 4 + i] = fetch(rotCols[i]);
+			dst.opacity[dstIdx] = fetch(opacityCol);
+			for (size_t i = 0; i < specularDimension; i++)
+				dst.f_rest[dstIdx * specularDimension + i] = fetch(restCols[i]);
+		}
+	}
+
+	void PLYLoader::closeMapped()
+	{
+		file.reset();
+		rows = nullptr;
+		numRows = 0;
+	}
+
+	bool PLYLoader::loadPLYModelMapped(const char* filename, SplatSet& output, uint32_t requestedSphDegree)
+	{
+		auto t0 = std::chrono::high_resolution_clock::now();
+
+		if (!openMapped(filename, requestedSphDegree)) {
+			closeMapped();
+			return false;
+		}
+
+		auto t1 = std::chrono::high_resolution_clock::now();
+
+		const size_t numVerts = numRows;
+		output.sphDegree = sphDegree;
+		const size_t specularDimension = output.specularDimension();
+		output.positions.resize(numVerts * 3);
+		output.scale.resize(numVerts * 3);
+		output.rotation.resize(numVerts * 4);
+		output.opacity.resize(numVerts);
+		output.f_dc.resize(numVerts * 3);
+		output.f_rest.resize(numVerts * specularDimension);
+
+		auto t2 = std::chrono::high_resolution_clock::now();
+
+		vks::ThreadPool ownThreadPool;
+		if (!threadPool) {
+			initLoadThreadPool(ownThreadPool);
+		}
+		const size_t numWorkers = parallelForRanges(threadPool ? *threadPool : ownThreadPool, numVerts, [&](size_t, size_t begin, size_t end) {
+			extractRows(begin, end, {
+				&output.positions[begin * 3], &output.scale[begin * 3], &output.rotation[begin * 4], &output.opacity[begin],
+				&output.f_dc[begin * 3], output.f_rest.data() + begin * specularDimension });
+		});
+		closeMapped();
+
+		auto t3 = std::chrono::high_resolution_clock::now();
+
+		auto ms = [](auto a, auto b) { return std::chrono::duration<double, std::milli>(b - a).count(); };
+		std::cout << "\nFile loaded in " << (long long)ms(t0, t3) << "ms (mmap+header " << ms(t0, t1) << "ms, alloc " << ms(t1, t2)
+			<< "ms, extract " << ms(t2, t3) << "ms on " << numWorkers << " threads, " << numVerts << " splats, SH degree " << output.sphDegree << ")" << std::endl;
+
+		return true;
+	}
+#endif
+
+	bool PLYLoader::loadPLYModel(const char *filename, SplatSet & output, uint32_t sphDegree)
+	{
+#if !defined(__ANDROID__)
+		if (loadPLYModelMapped(filename, output, sphDegree)) {
+			return true;
+		}
+		std::cout << "Falling back to miniply for " << filename << std::endl;
+#endif
+
 		auto startTime = std::chrono::high_resolution_clock::now();
 
 #if defined(__ANDROID__)
@@ -53,29 +255,35 @@ namespace vk3DGRT {
 				output.rotation.resize(numVerts * 4);
 				output.opacity.resize(numVerts);
 				output.f_dc.resize(numVerts * 3);
-				output.f_rest.resize(numVerts * 45);
+				// the number of f_rest properties tells the SH degree stored in the file
+				uint32_t numRest = 0;
+				while (reader.find_property(("f_rest_" + std::to_string(numRest)).c_str()) != miniply::kInvalidIndex)
+					numRest++;
+				uint32_t fileSphDegree = sphDegreeFromRestCount(numRest);
+				if (fileSphDegree == UINT32_MAX)
+				{
+					std::cout << "Warning: " << numRest << " f_rest properties match no SH degree, loading degree 0" << std::endl;
+					fileSphDegree = 0;
+				}
+				output.sphDegree = std::min(sphDegree, fileSphDegree);
+				const uint32_t specularDimension = (uint32_t)output.specularDimension();
+				output.f_rest.resize(numVerts * specularDimension);
 				// load progress
-				const uint32_t total = numVerts * (3 + 3 + 4 + 1 + 3 + 45);
+				const uint32_t total = numVerts * (3 + 3 + 4 + 1 + 3 + specularDimension);
 				uint32_t       loaded = 0;
 
 				// put that first so the loading progress looks better
-				if (reader.find_properties(indices, 45, "f_rest_0", "f_rest_1", "f_rest_2", "f_rest_3", "f_rest_4", "f_rest_5",
-					"f_rest_6", "f_rest_7", "f_rest_8", "f_rest_9", "f_rest_10", "f_rest_11", "f_rest_12",
-					"f_rest_13", "f_rest_14", "f_rest_15", "f_rest_16", "f_rest_17", "f_rest_18",
-					"f_rest_19", "f_rest_20", "f_rest_21", "f_rest_22", "f_rest_23", "f_rest_24",
-					"f_rest_25", "f_rest_26", "f_rest_27", "f_rest_28", "f_rest_29", "f_rest_30", "f_rest_31",
-					"f_rest_32", "f_rest_33", "f_rest_34", "f_rest_35", "f_rest_36", "f_rest_37", "f_rest_38",
-					"f_rest_39", "f_rest_40", "f_rest_41", "f_rest_42", "f_rest_43", "f_rest_44"))
+				if (specularDimension > 0)
 				{
-					uint32_t reorderedIndices[45];
-					for (int i = 0; i < 15; i ++)
-					{	
-						reorderedIndices[i * 3] = indices[i];
-						reorderedIndices[i * 3 + 1] = indices[i + 15];
-						reorderedIndices[i * 3 + 2] = indices[i + 30];
+					// f_rest is stored channel-major in the file, interleave the kept bands to RGB triplets
+					uint32_t reorderedIndices[SPECULAR_DIMENSION];
+					for (uint32_t i = 0; i < specularDimension / 3; i++)
+					{
+						for (uint32_t c = 0; c < 3; c++)
+							reorderedIndices[i * 3 + c] = reader.find_property(("f_rest_" + std::to_string(i + numRest / 3 * c)).c_str());
 					}
-					reader.extract_properties(reorderedIndices, 45, miniply::PLYPropertyType::Float, output.f_rest.data());
-					loaded += numVerts * 45;
+					reader.extract_properties(reorderedIndices, specularDimension, miniply::PLYPropertyType::Float, output.f_rest.data());
+					loaded += numVerts * specularDimension;
 				}
 				if (reader.find_properties(indices, 3, "x", "y", "z"))
 				{
@@ -124,8 +332,123 @@ namespace vk3DGRT {
 		return gsFound;
 	}
 
+	bool Model::loadContainer(const char* filename)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+
+		const char* data = nullptr;
+		size_t size = 0;
+#if defined(__ANDROID__)
+		AAsset* asset = AAssetManager_open(androidApp->activity->assetManager, filename, AASSET_MODE_STREAMING);
+		if (!asset) {
+			std::cout << "Error: failed to open asset of 3dgrt format" << std::endl;
+			return false;
+		}
+		containerBuffer.resize(AAsset_getLength(asset));
+		AAsset_read(asset, containerBuffer.data(), containerBuffer.size());
+		AAsset_close(asset);
+		data = (const char*)containerBuffer.data();
+		size = containerBuffer.size();
+#else
+		containerFile = std::make_unique<vks::MappedFile>();
+		if (!containerFile->open(filename)) {
+			std::cout << "Error: failed to map container file: " << filename << std::endl;
+			return false;
+		}
+		data = containerFile->data;
+		size = containerFile->size;
+#endif
+
+		auto mapTime = std::chrono::high_resolution_clock::now();
+
+		const void* sectionData[container::SectionCount];
+		const container::Header* header = container::read(data, size, filename, sectionData);
+		if (!header) {
+			return false;
+		}
+		const uint32_t containerSphDegree = sphDegreeFromRestCount(header->specularDimension);
+
+		auto checkTime = std::chrono::high_resolution_clock::now();
+
+		numParticles = header->numParticles;
+		aabbMin = glm::make_vec3(header->aabbMin);
+		aabbMax = glm::make_vec3(header->aabbMax);
+		particleDensityData = sectionData[container::SectionParticleDensity];
+		particleSphCoefficientData = sectionData[container::SectionParticleSphCoefficient];
+		preActivated = true;
+
+		if (sphDegree < containerSphDegree) {
+			// drop the bands above the selected degree, the mapped section can't be uploaded as is anymore
+			const size_t containerStride = 3 + header->specularDimension;
+			const size_t sphStride = 3 + specularDimension();
+			const float* src = (const float*)particleSphCoefficientData;
+			packedSphCoefficients.resize(numParticles * sphStride);
+			for (size_t i = 0; i < numParticles; i++)
+				memcpy(&packedSphCoefficients[i * sphStride], src + i * containerStride, sphStride * sizeof(float));
+			particleSphCoefficientData = packedSphCoefficients.data();
+		}
+		sphDegree = std::min(sphDegree, containerSphDegree);
+
+		auto endTime = std::chrono::high_resolution_clock::now();
+		std::cout << "\nContainer loaded in " << std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count() << "ms (map "
+			<< std::chrono::duration<double, std::milli>(mapTime - startTime).count() << "ms, checksum "
+			<< std::chrono::duration<double, std::milli>(checkTime - mapTime).count() << "ms, " << numParticles << " particles)" << std::endl;
+		return true;
+	}
+
+	size_t Model::sphCoefficientStride() const
+	{
+		return vk3DGRT::sphCoefficientStride(sphStorage, specularDimension());
+	}
+
+	void Model::reportSphActiveDegrees() const
+	{
+		// fetchParticleSphCoefficients reads the coefficients up to min(sphActiveDegree, sphDegree) of a particle
+		const float* particleDensity = static_cast<const float*>(particleDensityData);
+		size_t counts[MAX_N_FEATURES + 1] = {};
+		size_t fetchedCoeffs = 0;
+		for (size_t i = 0; i < numParticles; i++) {
+			const uint32_t degree = std::min(static_cast<uint32_t>(particleDensity[i * 12 + 11]), sphDegree);
+			counts[degree]++;
+			fetchedCoeffs += (degree + 1) * (degree + 1);
+		}
+		std::cout << "SH active degree";
+		for (uint32_t degree = 0; degree <= sphDegree; degree++) {
+			std::cout << (degree == 0 ? " " : ", ") << degree << ": " << counts[degree];
+		}
+		const size_t storedCoeffs = numParticles * (sphDegree + 1) * (sphDegree + 1);
+		std::cout << " particles, " << (storedCoeffs > 0 ? 100.0 * fetchedCoeffs / storedCoeffs : 100.0) << "% of the SH coefficients fetched per hit" << std::endl;
+	}
+
+	void Model::encodeSphCoefficients()
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+
+		const size_t sphStride = 3 + specularDimension();
+		const size_t encodedStride = sphCoefficientStride() / sizeof(uint32_t);
+		const float* sph = (const float*)particleSphCoefficientData;
+		encodedSphCoefficients.assign(numParticles * encodedStride, 0u);
+
+		double squaredError = 0.0;
+		for (size_t i = 0; i < numParticles; i++) {
+			squaredError += vk3DGRT::encodeSphCoefficients(sphStorage, sph + i * sphStride, specularDimension(), encodedSphCoefficients.data() + i * encodedStride);
+		}
+
+		particleSphCoefficientData = encodedSphCoefficients.data();
+
+		auto endTime = std::chrono::high_resolution_clock::now();
+		std::cout << "SH coefficients encoded in " << std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count() << "ms ("
+			<< sphStride * sizeof(float) << " -> " << sphCoefficientStride() << " Bytes per particle, RMSE "
+			<< std::sqrt(squaredError / std::max<size_t>(1, numParticles * sphStride)) << ")" << std::endl;
+	}
+
 	void Model::load3DGRTModel(std::string filename, vks::VulkanDevice* device)
 	{
+		loadStartTime = std::chrono::high_resolution_clock::now();
+		// every parallel step of the load runs on the same threads
+		loadThreadPool = std::make_shared<vks::ThreadPool>();
+		initLoadThreadPool(*loadThreadPool);
+
 		if (filename.find_last_of(".") != std::string::npos) {
 
 			// Can't load .pt file in C++ since the model file is exported using pickle module
@@ -143,16 +466,72 @@ namespace vk3DGRT {
 			//		return;
 			//	}
 			//}
+#if !defined(__ANDROID__)
+			if (filename.substr(filename.find_last_of(".") + 1) == "ply" && streamingUpload && !mortonOrder && !hostEnclosing && !instancedBLAS && !proceduralPrimitives && sphStorage == SphStorageFloat)
+			{
+				// Only the header now, the rows are extracted while they are uploaded
+				streamingLoader = std::make_unique<PLYLoader>();
+				streamingLoader->threadPool = loadThreadPool.get();
+				if (streamingLoader->openMapped(filename.c_str(), sphDegree)) {
+					sphDegree = streamingLoader->sphDegree;
+					numParticles = streamingLoader->numRows;
+					return;
+				}
+				streamingLoader.reset();
+				std::cout << "Streaming upload not possible for " << filename << ", loading it at once" << std::endl;
+			}
+#endif
 			if (filename.substr(filename.find_last_of(".") + 1) == "ply") // .ply file
 			{
 				PLYLoader plyLoader;
-				plyLoader.loadPLYModel(filename.c_str(), splatSet);
+				plyLoader.threadPool = loadThreadPool.get();
+				plyLoader.loadPLYModel(filename.c_str(), splatSet, sphDegree);
+				sphDegree = splatSet.sphDegree;
+				if (mortonOrder) {
+					reorderSplatSetMorton(splatSet, loadThreadPool.get());
+				}
+
+				numParticles = splatSet.size();
+				for (size_t i = 0; i < numParticles; i++) {
+					glm::vec3 position = glm::make_vec3(&splatSet.positions[i * 3]);
+					aabbMin = glm::min(aabbMin, position);
+					aabbMax = glm::max(aabbMax, position);
+				}
+			}
+			else if (filename.substr(filename.find_last_of(".") + 1) == "3dgrt") // pre-activated container
+			{
+				if (!loadContainer(filename.c_str())) {
+					vks::tools::exitFatal("Failed to load container: \"" + filename, -1);
+					return;
+				}
 			}
 			else
 			{
 				vks::tools::exitFatal("Unsupported Extensnion: \"" + filename.substr(filename.find_last_of(".") + 1), -1);
 				return;
 			}
+
+			if (!preActivated && (hostEnclosing || instancedBLAS || proceduralPrimitives || sphStorage != SphStorageFloat)) {
+				// The encoded buffer must follow the particle order, so activate and compact on the host
+				// instead of in particlePrimitives.comp (whose atomic compaction order is not deterministic)
+				numParticles = enclosing::activateParticles(splatSet, packedDensities, packedSphCoefficients, aabbMin, aabbMax, sphDegreeEpsilon);
+				std::cout << "Activated " << numParticles << " of " << splatSet.size() << " splats (outliers and densities below ALPHA_MIN_THRESHOLD dropped)" << std::endl;
+				particleDensityData = packedDensities.data();
+				particleSphCoefficientData = packedSphCoefficients.data();
+				preActivated = true;
+				if (hostResidency != HostResidencyKeep) {
+					releaseSplatSet();
+				}
+			}
+			if (preActivated) {
+				reportSphActiveDegrees();
+			}
+			if (sphStorage != SphStorageFloat) {
+				encodeSphCoefficients();
+				packedSphCoefficients.clear();
+				packedSphCoefficients.shrink_to_fit();
+			}
+			loadThreadPool.reset();
 		}
 		else
 		{
@@ -160,65 +539,387 @@ namespace vk3DGRT {
 		}
 	}
 
-	void Model::allocateAttributeBuffers(vks::VulkanDevice* vulkanDevice, VkQueue queue)
+	void Model::allocateAttributeBuffers(vks::VulkanDevice* vulkanDevice, VkQueue queue, VkQueue transferQueue)
 	{
 		VkFlags transferSrcBit = VK_FLAGS_NONE;
 #if SPLIT_BLAS && !RAY_QUERY
 		transferSrcBit = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 #endif
-		vertices.count = 3 * 12 * splatSet.size();
+		// one enclosing icosahedron per particle, or the unit icosahedron shared by all instances,
+		// or one AABB (6 floats) per particle and no triangles for the procedural primitives
+		const size_t numIcosaHedra = instancedBLAS ? 1 : size();
+		vertices.count = proceduralPrimitives ? 6 * size() : 3 * 12 * numIcosaHedra;
 		VK_CHECK_RESULT(vulkanDevice->createBuffer(
 			VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | transferSrcBit,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 			&vertices.storageBuffer,
 			sizeof(float) * vertices.count));
 
-		indices.count = 3 * 20 * splatSet.size();
+		indices.count = proceduralPrimitives ? 1 : 3 * 20 * numIcosaHedra;
 		VK_CHECK_RESULT(vulkanDevice->createBuffer(
 			VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | transferSrcBit,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 			&indices.storageBuffer,
 			sizeof(float) * indices.count))
 
-		positions.count = 3 * splatSet.size();
+		if (preActivated) {
+			// The raw PLY attributes are never read by the enclosing pass, only keep its bindings valid
+			for (Attributes* attribute : { &positions, &rotations, &scales, &densities, &featuresAlbedo, &featuresSpecular }) {
+				attribute->count = 1;
+				VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &attribute->storageBuffer, sizeof(float)));
+			}
+			loadTimeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - loadStartTime).count();
+			loadProgress = 1.0f;
+			return;
+		}
+
+		positions.count = 3 * size();
 		VK_CHECK_RESULT(vulkanDevice->createBuffer(
 			VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 			&positions.storageBuffer,
 			sizeof(float) * positions.count));
-		vulkanDevice->copyBuffer(splatSet.positions.data(), &positions.storageBuffer, queue);
 
-		rotations.count = 4 * splatSet.size();
+		rotations.count = 4 * size();
 		VK_CHECK_RESULT(vulkanDevice->createBuffer(
 			VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 			&rotations.storageBuffer,
 			sizeof(float) * rotations.count));
-		vulkanDevice->copyBuffer(splatSet.rotation.data(), &rotations.storageBuffer, queue);
 
-		scales.count = 3 * splatSet.size();
+		scales.count = 3 * size();
 		VK_CHECK_RESULT(vulkanDevice->createBuffer(
 			VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 			&scales.storageBuffer,
 			sizeof(float) * scales.count));
-		vulkanDevice->copyBuffer(splatSet.scale.data(), &scales.storageBuffer, queue);
 
-		densities.count = splatSet.size();
+		densities.count = (int)size();
 		VK_CHECK_RESULT(vulkanDevice->createBuffer(
 			VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 			&densities.storageBuffer,
 			sizeof(float) * densities.count));
-		vulkanDevice->copyBuffer(splatSet.opacity.data(), &densities.storageBuffer, queue);
 
-		featuresAlbedo.count = 3 * splatSet.size();
+		featuresAlbedo.count = 3 * size();
 		VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &featuresAlbedo.storageBuffer, sizeof(float) * featuresAlbedo.count));
-		vulkanDevice->copyBuffer(splatSet.f_dc.data(), &featuresAlbedo.storageBuffer, queue);
 
-		featuresSpecular.count = SPECULAR_DIMENSION * splatSet.size();
-		VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &featuresSpecular.storageBuffer, sizeof(float) * featuresSpecular.count));
-		vulkanDevice->copyBuffer(splatSet.f_rest.data(), &featuresSpecular.storageBuffer, queue);
+		// degree 0 has no specular coefficients, keep a placeholder for the binding
+		featuresSpecular.count = (int)(specularDimension() * size());
+		VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &featuresSpecular.storageBuffer, sizeof(float) * std::max(featuresSpecular.count, 1)));
+
+#if !defined(__ANDROID__)
+		if (streamingLoader) {
+			// a dedicated transfer family when the device has one, the copies then overlap the work on queue as well
+			attributeQueueFamilyIndex = vulkanDevice->queueFamilyIndices.graphics;
+			if (transferQueue != VK_NULL_HANDLE && vulkanDevice->queueFamilyIndices.transfer != vulkanDevice->queueFamilyIndices.graphics) {
+				attributeQueueFamilyIndex = vulkanDevice->queueFamilyIndices.transfer;
+				queue = transferQueue;
+			}
+			attributeUpload = std::async(std::launch::async, &Model::streamAttributes, this, vulkanDevice, queue, attributeQueueFamilyIndex);
+			return;
+		}
+		else
+#endif
+		{
+			vulkanDevice->copyBuffer(splatSet.positions.data(), &positions.storageBuffer, queue);
+			vulkanDevice->copyBuffer(splatSet.rotation.data(), &rotations.storageBuffer, queue);
+			vulkanDevice->copyBuffer(splatSet.scale.data(), &scales.storageBuffer, queue);
+			vulkanDevice->copyBuffer(splatSet.opacity.data(), &densities.storageBuffer, queue);
+			vulkanDevice->copyBuffer(splatSet.f_dc.data(), &featuresAlbedo.storageBuffer, queue);
+			if (featuresSpecular.count > 0)
+				vulkanDevice->copyBuffer(splatSet.f_rest.data(), &featuresSpecular.storageBuffer, queue);
+			if (hostResidency != HostResidencyKeep) {
+				releaseSplatSet();
+			}
+		}
+
+		loadTimeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - loadStartTime).count();
+		loadProgress = 1.0f;
+	}
+
+	void Model::waitForAttributes(vks::VulkanDevice* vulkanDevice, VkQueue queue)
+	{
+#if !defined(__ANDROID__)
+		if (!attributeUpload.valid()) {
+			return;
+		}
+		while (attributeUpload.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+			std::cout << "\rStreaming model " << static_cast<int>(100.0f * loadProgress) << "%" << std::flush;
+		}
+		try {
+			attributeUpload.get();
+		}
+		catch (const std::exception& e) {
+			vks::tools::exitFatal(std::string("Could not stream the model: ") + e.what(), -1);
+		}
+
+		// acquire the buffers released by the transfer family at the end of streamAttributes
+		if (attributeQueueFamilyIndex != vulkanDevice->queueFamilyIndices.graphics && size() > 0) {
+			std::vector<VkBufferMemoryBarrier> barriers = attributeOwnershipBarriers(attributeQueueFamilyIndex, vulkanDevice->queueFamilyIndices.graphics);
+			for (VkBufferMemoryBarrier& barrier : barriers) {
+				barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+			}
+			VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+				0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data(), 0, nullptr);
+			vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+		}
+		loadTimeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - loadStartTime).count();
+#endif
+	}
+
+#if !defined(__ANDROID__)
+	std::vector<VkBufferMemoryBarrier> Model::attributeOwnershipBarriers(uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex)
+	{
+		std::vector<VkBufferMemoryBarrier> barriers;
+		for (Attributes* attribute : { &positions, &scales, &rotations, &densities, &featuresAlbedo, &featuresSpecular }) {
+			if (attribute->count == 0) continue;	// placeholder, never copied
+			VkBufferMemoryBarrier barrier = vks::initializers::bufferMemoryBarrier();
+			barrier.srcQueueFamilyIndex = srcQueueFamilyIndex;
+			barrier.dstQueueFamilyIndex = dstQueueFamilyIndex;
+			barrier.buffer = attribute->storageBuffer.buffer;
+			barrier.offset = 0;
+			barrier.size = VK_WHOLE_SIZE;
+			barriers.push_back(barrier);
+		}
+		return barriers;
+	}
+
+	/*
+	* Pipelined .ply upload: a loader thread extracts fixed size row chunks (on all cores) straight into a ring of
+	* persistently mapped staging buffers while the chunks before are copied to the attribute buffers, so the load
+	* takes about max(parse, upload) instead of their sum.
+	* Runs on the allocateAttributeBuffers thread, which alone submits to queue. Copies are recorded from a pool of its own,
+	* the last chunk releases the buffers to the graphics family when queue is of another one (see waitForAttributes).
+	*/
+	void Model::streamAttributes(vks::VulkanDevice* vulkanDevice, VkQueue queue, uint32_t queueFamilyIndex)
+	{
+		const size_t chunkRows = 1 << 16;
+		const size_t ringSize = 3;
+
+		auto startTime = std::chrono::high_resolution_clock::now();
+
+		// attributes in PLYLoader::SplatPointers order and their floats per row
+		const size_t numAttributes = 6;
+		Attributes* attributes[numAttributes] = { &positions, &scales, &rotations, &densities, &featuresAlbedo, &featuresSpecular };
+		const size_t components[numAttributes] = { 3, 3, 4, 1, 3, specularDimension() };
+		size_t slotOffsets[numAttributes];
+		size_t slotSize = 0;
+		for (size_t i = 0; i < numAttributes; i++) {
+			slotOffsets[i] = slotSize;
+			slotSize += chunkRows * components[i] * sizeof(float);
+		}
+
+		struct StagingSlot {
+			vks::Buffer buffer;
+			VkCommandBuffer commandBuffer;
+			VkFence fence;
+		};
+		// vulkanDevice->commandPool belongs to the render thread
+		VkCommandPool commandPool = vulkanDevice->createCommandPool(queueFamilyIndex);
+		std::array<StagingSlot, ringSize> slots;
+		for (StagingSlot& slot : slots) {
+			VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &slot.buffer, slotSize));
+			VK_CHECK_RESULT(slot.buffer.map());
+			slot.commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, commandPool, false);
+			VkFenceCreateInfo fenceInfo = vks::initializers::fenceCreateInfo(VK_FLAGS_NONE);
+			VK_CHECK_RESULT(vkCreateFence(vulkanDevice->logicalDevice, &fenceInfo, nullptr, &slot.fence));
+		}
+
+		const size_t numChunks = (size() + chunkRows - 1) / chunkRows;
+		std::mutex mutex;
+		std::condition_variable chunkCondition;
+		size_t chunksParsed = 0;
+		size_t chunksReleased = 0;	// chunks whose staging slot can be refilled
+		bool loaderFailed = false;	// the loader thread stopped early, its exception is rethrown by loader.get()
+		double parseTime = 0.0;
+
+		std::future<void> loader = std::async(std::launch::async, [&]() {
+			for (size_t chunk = 0; chunk < numChunks; chunk++) {
+				try {
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						chunkCondition.wait(lock, [&]() { return chunk < chunksReleased + ringSize; });
+					}
+					auto parseStart = std::chrono::high_resolution_clock::now();
+
+					const size_t begin = chunk * chunkRows;
+					const size_t count = std::min(size(), begin + chunkRows) - begin;
+					float* dst[numAttributes];
+					for (size_t i = 0; i < numAttributes; i++)
+						dst[i] = (float*)((char*)slots[chunk % ringSize].buffer.mapped + slotOffsets[i]);
+					parallelForRanges(*loadThreadPool, count, [&](size_t, size_t first, size_t last) {
+						streamingLoader->extractRows(begin + first, begin + last, {
+							dst[0] + first * components[0], dst[1] + first * components[1], dst[2] + first * components[2],
+							dst[3] + first * components[3], dst[4] + first * components[4], dst[5] + first * components[5] });
+					});
+					for (size_t i = 0; i < count; i++) {
+						glm::vec3 position = glm::make_vec3(dst[0] + i * 3);
+						aabbMin = glm::min(aabbMin, position);
+						aabbMax = glm::max(aabbMax, position);
+					}
+
+					parseTime += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - parseStart).count();
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						chunksParsed++;
+					}
+					chunkCondition.notify_all();
+				}
+				catch (...) {
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						loaderFailed = true;
+					}
+					chunkCondition.notify_all();
+					throw;
+				}
+			}
+		});
+
+		// waits until the copy of a chunk is done and hands its staging slot back to the loader thread
+		auto releaseChunk = [&](size_t chunk) {
+			StagingSlot& slot = slots[chunk % ringSize];
+			VK_CHECK_RESULT(vkWaitForFences(vulkanDevice->logicalDevice, 1, &slot.fence, VK_TRUE, UINT64_MAX));
+			VK_CHECK_RESULT(vkResetFences(vulkanDevice->logicalDevice, 1, &slot.fence));
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				chunksReleased++;
+			}
+			chunkCondition.notify_all();
+			loadProgress = static_cast<float>(chunk + 1) / numChunks;
+		};
+
+		double parseWaitTime = 0.0;
+		size_t chunksSubmitted = 0;
+		for (size_t chunk = 0; chunk < numChunks; chunk++) {
+			auto waitStart = std::chrono::high_resolution_clock::now();
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				chunkCondition.wait(lock, [&]() { return chunksParsed > chunk || loaderFailed; });
+				if (chunksParsed <= chunk) {
+					break;
+				}
+			}
+			parseWaitTime += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - waitStart).count();
+
+			StagingSlot& slot = slots[chunk % ringSize];
+			const size_t begin = chunk * chunkRows;
+			const size_t count = std::min(size(), begin + chunkRows) - begin;
+			VkCommandBufferBeginInfo beginInfo = vks::initializers::commandBufferBeginInfo();
+			beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+			VK_CHECK_RESULT(vkBeginCommandBuffer(slot.commandBuffer, &beginInfo));
+			for (size_t i = 0; i < numAttributes; i++) {
+				if (components[i] == 0) continue;
+				VkBufferCopy region{ slotOffsets[i], begin * components[i] * sizeof(float), count * components[i] * sizeof(float) };
+				vkCmdCopyBuffer(slot.commandBuffer, slot.buffer.buffer, attributes[i]->storageBuffer.buffer, 1, &region);
+			}
+			if (chunk == numChunks - 1 && queueFamilyIndex != vulkanDevice->queueFamilyIndices.graphics) {
+				std::vector<VkBufferMemoryBarrier> barriers = attributeOwnershipBarriers(queueFamilyIndex, vulkanDevice->queueFamilyIndices.graphics);
+				for (VkBufferMemoryBarrier& barrier : barriers) {
+					barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+				}
+				vkCmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+					0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data(), 0, nullptr);
+			}
+			VK_CHECK_RESULT(vkEndCommandBuffer(slot.commandBuffer));
+			VkSubmitInfo submitInfo = vks::initializers::submitInfo();
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &slot.commandBuffer;
+			VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, slot.fence));
+			chunksSubmitted++;
+
+			// the previous copy overlapped the parsing of this chunk, recycle its slot
+			if (chunk > 0)
+				releaseChunk(chunk - 1);
+		}
+		// the last copy, or every copy still in flight when the loader failed
+		for (size_t chunk = chunksReleased; chunk < chunksSubmitted; chunk++)
+			releaseChunk(chunk);
+
+		for (StagingSlot& slot : slots) {
+			vkDestroyFence(vulkanDevice->logicalDevice, slot.fence, nullptr);
+			slot.buffer.unmap();
+			slot.buffer.destroy();
+		}
+		vkDestroyCommandPool(vulkanDevice->logicalDevice, commandPool, nullptr);
+		loader.get();
+		streamingLoader.reset();
+		loadThreadPool.reset();
+		loadProgress = 1.0f;
+
+		auto endTime = std::chrono::high_resolution_clock::now();
+		std::cout << "\nFile streamed in " << std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count() << "ms (parse "
+			<< parseTime << "ms, waited on parsing " << parseWaitTime << "ms, " << numChunks << " chunks of " << chunkRows << " rows, "
+			<< size() << " splats, SH degree " << sphDegree << ")" << std::endl;
+	}
+#endif
+
+	void Model::uploadPreActivatedParticles(vks::Buffer& particleDensities, vks::Buffer& particleSphCoefficients, vks::VulkanDevice* vulkanDevice, VkQueue queue)
+	{
+		// Container sections are laid out exactly like the device buffers, copy them straight from the mapping
+		vulkanDevice->copyBuffer(const_cast<void*>(particleDensityData), &particleDensities, queue);
+		vulkanDevice->copyBuffer(const_cast<void*>(particleSphCoefficientData), &particleSphCoefficients, queue);
+	}
+
+	void Model::uploadPackedParticleDensities(vks::Buffer& packedParticleDensities, vks::VulkanDevice* vulkanDevice, VkQueue queue)
+	{
+		std::vector<uint32_t> packed;
+		enclosing::packParticleDensities(static_cast<const float*>(particleDensityData), numParticles, packed);
+		vulkanDevice->copyBuffer(packed.data(), &packedParticleDensities, queue);
+	}
+
+	size_t Model::releaseSplatSet()
+	{
+		size_t released = 0;
+		for (std::vector<float>* attribute : { &splatSet.positions, &splatSet.f_dc, &splatSet.f_rest, &splatSet.opacity, &splatSet.scale, &splatSet.rotation }) {
+			released += attribute->capacity() * sizeof(float);
+			attribute->clear();
+			attribute->shrink_to_fit();
+		}
+		return released;
+	}
+
+	void Model::releaseHostParticles()
+	{
+		if (hostResidency == HostResidencyKeep) {
+			return;
+		}
+		size_t released = releaseSplatSet();
+		const bool packedSph = particleSphCoefficientData == packedSphCoefficients.data() || particleSphCoefficientData == encodedSphCoefficients.data();
+		const bool packedDensity = particleDensityData == packedDensities.data();
+		released += packedDensities.capacity() * sizeof(float) + packedSphCoefficients.capacity() * sizeof(float) + encodedSphCoefficients.capacity() * sizeof(uint32_t);
+		packedDensities.clear();
+		packedDensities.shrink_to_fit();
+		packedSphCoefficients.clear();
+		packedSphCoefficients.shrink_to_fit();
+		encodedSphCoefficients.clear();
+		encodedSphCoefficients.shrink_to_fit();
+
+		size_t mapped = 0;
+#if defined(__ANDROID__)
+		// read into memory, not a mapping
+		released += containerBuffer.capacity();
+		containerBuffer.clear();
+		containerBuffer.shrink_to_fit();
+		particleDensityData = nullptr;
+		particleSphCoefficientData = nullptr;
+#else
+		if (containerFile && hostResidency == HostResidencyMapped) {
+			mapped = containerFile->size;
+		}
+		else {
+			containerFile.reset();
+		}
+		if (packedDensity || !mapped) particleDensityData = nullptr;
+		if (packedSph || !mapped) particleSphCoefficientData = nullptr;
+#endif
+		std::cout << "Released " << released / (1024 * 1024) << " MB of host particle data";
+		if (mapped) {
+			std::cout << ", " << mapped / (1024 * 1024) << " MB container kept mapped";
+		}
+		std::cout << std::endl;
 	}
 }
 
@@ -3,36 +3,194 @@
 #include "vulkan/vulkan.h"
 #include "VulkanDevice.h"
 #include "Define.h"
+#include "mappedfile.hpp"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <future>
+#include <functional>
+
 #if defined(__ANDROID__)
 #include <android/asset_manager.h>
 #endif
 
+namespace vks {
+	class ThreadPool;
+}
+
 namespace vk3DGRT {
+	// number of specular (f_rest) coefficients of a SH degree, 45 for degree 3
+	inline uint32_t sphSpecularDimension(uint32_t sphDegree) { return 3 * ((sphDegree + 1) * (sphDegree + 1) - 1); }
+	// SH degree of a file holding numRest f_rest properties, UINT32_MAX if it matches no degree
+	inline uint32_t sphDegreeFromRestCount(size_t numRest)
+	{
+		for (uint32_t degree = 0; degree <= MAX_N_FEATURES; degree++) {
+			if (sphSpecularDimension(degree) == numRest) return degree;
+		}
+		return UINT32_MAX;
+	}
+
 	struct SplatSet {
 		// standard poiont cloud attributes
 		std::vector<float> positions; // point positions (x,y,z)
 		// specific data fields introduced by INRIA for 3DGS
 		std::vector<float> f_dc;      // 3 components per point (f_dc_0, f_dc_1, f_dc_2 in ply file)
-		std::vector<float> f_rest;    // 45 components per point (f_rest_0 to f_rest_44 in ply file), SH coeficients
+		std::vector<float> f_rest;    // sphSpecularDimension(sphDegree) components per point (up to f_rest_0 to f_rest_44 in ply file), SH coeficients
 		std::vector<float> opacity;   // 1 value per point in ply file
 		std::vector<float> scale;     // 3 components per point in ply file
 		std::vector<float> rotation;  // 4 components per point in ply file - a quaternion
 
+		uint32_t sphDegree = MAX_N_FEATURES;	// SH degree held in f_rest
+
 		// returns the number of splats in the set
 		inline size_t size() const { return positions.size() / 3; }
+		inline size_t specularDimension() const { return sphSpecularDimension(sphDegree); }
 	};
 
+	// Sorts the splats along a 3D Morton curve so that particles close in space are also close in memory.
+	// Runs on threadPool, on a pool of its own when it is null
+	void reorderSplatSetMorton(SplatSet& splatSet, vks::ThreadPool* threadPool = nullptr);
+
+	// Threads of the pool a load runs its ranges on
+	void initLoadThreadPool(vks::ThreadPool& threadPool);
+	// Splits [0, count) into one contiguous range per thread of threadPool (at most) and waits for all of them, returns the number of ranges
+	size_t parallelForRanges(vks::ThreadPool& threadPool, size_t count, const std::function<void(size_t thread, size_t begin, size_t end)>& func);
+
 	class PLYLoader {
 	public:
 		PLYLoader() {}
 		~PLYLoader() {}
 
-		bool loadPLYModel(const char *filename, SplatSet & output);
+		// Only the f_rest bands up to sphDegree (or the degree stored in the file if lower) are extracted
+		bool loadPLYModel(const char *filename, SplatSet & output, uint32_t sphDegree = MAX_N_FEATURES);
+
+#if !defined(__ANDROID__)
+		// Destination of extractRows, laid out like the SplatSet fields starting at the first extracted row
+		struct SplatPointers {
+			float* positions;
+			float* scale;
+			float* rotation;
+			float* opacity;
+			float* f_dc;
+			float* f_rest;
+		};
+
+		// The mapped fast path split in steps so that rows can be extracted in chunks (see Model::streamAttributes)
+		bool openMapped(const char* filename, uint32_t requestedSphDegree);
+		void extractRows(size_t begin, size_t end, SplatPointers dst) const;	// thread safe
+		void closeMapped();
+
+		size_t numRows = 0;						// valid after openMapped
+		uint32_t sphDegree = MAX_N_FEATURES;	// valid after openMapped
+#endif
+		vks::ThreadPool* threadPool = nullptr;	// of the load the loader is part of, a pool of its own per file when null
+
+	private:
+#if !defined(__ANDROID__)
+		// mmap + multithreaded fast path for binary little-endian float PLYs
+		bool loadPLYModelMapped(const char* filename, SplatSet& output, uint32_t requestedSphDegree);
+
+		std::unique_ptr<vks::MappedFile> file;
+		const char* rows = nullptr;
+		size_t rowStride = 0;
+		// source column of every destination float, in the order of each SplatSet field
+		int posCols[3], scaleCols[3], rotCols[4], opacityCol, dcCols[3], restCols[SPECULAR_DIMENSION];
+#endif
+	};
+
+	/*
+	* Native binary container (.3dgrt)
+	* Particles are stored already activated, outlier filtered and packed exactly like the
+	* ParticleDensity (48 bytes) and ParticleSphCoefficient device buffers, so loading is a plain
+	* mapping + staging copy. Every section starts at a multiple of sectionAlignment.
+	*/
+	namespace container {
+		const char magic[8] = { '3', 'D', 'G', 'R', 'T', 'B', 'I', 'N' };
+		const uint32_t version = 2;	// 2: ParticleDensity::sphActiveDegree in the former padding
+		const uint64_t sectionAlignment = 256;
+
+		enum SectionType : uint32_t {
+			SectionParticleDensity = 0,
+			SectionParticleSphCoefficient = 1,
+			SectionCount
+		};
+
+		struct Section {
+			uint32_t type;
+			uint32_t stride;		// bytes per particle
+			uint64_t offset;		// from the beginning of the file
+			uint64_t size;
+			uint64_t checksum;
+		};
+
+		struct Header {
+			char magic[8];
+			uint32_t version;
+			uint32_t headerSize;
+			uint64_t numParticles;
+			uint32_t specularDimension;	// sphSpecularDimension of the stored SH degree
+			uint32_t numSections;
+			float aabbMin[3];
+			float aabbMax[3];
+			Section sections[SectionCount];
+		};
+
+		uint64_t checksum(const void* data, size_t size);
+		// Activates, filters and packs a PLY splat set the way particlePrimitives.comp does
+		void pack(const SplatSet& splatSet, std::vector<float>& densities, std::vector<float>& sphCoefficients, glm::vec3& aabbMin, glm::vec3& aabbMax);
+		// Offline converter
+		bool write(const char* filename, const SplatSet& splatSet);
+		// Checks the header, the section layout and the section checksums of the size bytes of a container at data and
+		// points sectionData at the sections. Returns the header, null (after printing why) if filename is not a valid container
+		const Header* read(const char* data, size_t size, const char* filename, const void* sectionData[SectionCount]);
+	}
+
+	// Storage of the particle SH coefficients on the device. This enum should be managed with 3dgs.glsl
+	enum SphStorageMode : uint32_t {
+		SphStorageFloat = 0,	// 48 floats per particle at degree 3 (192 bytes)
+		SphStorageHalf = 1,		// 48 halfs per particle at degree 3 (96 bytes)
+		SphStorageUnorm8 = 2,	// albedo in half, specular as 8 bit codes between a per particle min/max (64 bytes at degree 3)
+	};
+	// bytes per particle of the SH coefficients (3 + specularDimension floats) stored in mode
+	size_t sphCoefficientStride(SphStorageMode mode, size_t specularDimension);
+	// Encodes the SH coefficients of one particle at src into the sphCoefficientStride bytes at dst, which must be zeroed.
+	// Returns the squared error of the coefficients the shaders decode
+	double encodeSphCoefficients(SphStorageMode mode, const float* src, size_t specularDimension, uint32_t* dst);
+
+	// Acceleration structure layout of the particles, the blasMode specialization constant. This enum should be managed with 3dgs.glsl
+	enum BlasMode : uint32_t {
+		BlasModeIcosahedra = 0,	// one BLAS of the enclosing icosahedra
+		BlasModeSplit = 1,		// SPLIT_BLAS
+		BlasModeInstanced = 2,	// Model::instancedBLAS
+		BlasModeProcedural = 3,	// Model::proceduralPrimitives
+	};
+
+	// ParticleDensity layout read by the hit shaders, the densityLayout specialization constant. This enum should be managed with 3dgs.glsl
+	enum DensityLayout : uint32_t {
+		DensityLayoutFloat = 0,		// fp32 position, density, quaternion, scale and sphActiveDegree (48 bytes)
+		DensityLayoutPacked = 1,	// fp32 position, unorm16 density, 16 bit sphActiveDegree, fp16 quaternion and scale (32 bytes)
+	};
+
+	// DensityLayoutPacked particle, written by particlePrimitives.comp or enclosing::packParticleDensities
+	struct PackedParticleDensity {
+		glm::vec3 position;
+		uint32_t densitySphActiveDegree;	// unorm16 density | sphActiveDegree << 16
+		uint32_t quaternion[2];				// fp16 x 4
+		uint32_t scale[2];					// fp16 x 3, zero padded
+	};
+	// 2 uvec4 per particle of DENSITY_LAYOUT_PACKED (3dgs.glsl), enclosing::packedDensityStride uints
+	static_assert(sizeof(PackedParticleDensity) == 32, "PackedParticleDensity must match the packed layout of the shaders");
+
+	// Host copies of the particles kept once they are on the device (Model::releaseHostParticles)
+	enum HostResidency : uint32_t {
+		HostResidencyKeep = 0,		// splatSet and the packed particles stay for the whole session
+		HostResidencyMapped = 1,	// host copies freed, a .3dgrt container stays mapped (page cache, shared between processes and reclaimable)
+		HostResidencyRelease = 2,	// everything freed, only the summaries (size, AABB, SH degree) remain
 	};
 
 	class Model {
@@ -42,12 +200,100 @@ namespace vk3DGRT {
 
 		SplatSet splatSet;		// Loaded 3DGRT model from .ply/.pt file
 
+		size_t numParticles = 0;
+		glm::vec3 aabbMin{ FLT_MAX, FLT_MAX, FLT_MAX };
+		glm::vec3 aabbMax{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+		// Loaded from a .3dgrt container: splatSet stays empty and the enclosing pass only builds the icosahedra
+		bool preActivated = false;
+		const void* particleDensityData = nullptr;
+		const void* particleSphCoefficientData = nullptr;
+
+		// Selected before loading. Any mode but SphStorageFloat packs the particles on the host at load time (like hostEnclosing)
+		SphStorageMode sphStorage = SphStorageFloat;
+		// Selected before loading, lowered to the degree the file holds if that is smaller.
+		// Bands above it are never read from the file nor uploaded (sphEvalDegree must not exceed it)
+		uint32_t sphDegree = MAX_N_FEATURES;
+		// Selected before loading. The SH bands of a particle whose coefficients all stay within it are never fetched
+		// nor evaluated, its highest band left goes to ParticleDensity::sphActiveDegree
+		float sphDegreeEpsilon = SPH_ACTIVE_DEGREE_EPSILON;
+		// Selected before the upload. The float ParticleDensity buffer is kept for the enclosing pass and the refits,
+		// DensityLayoutPacked adds the packed copy the hit shaders read instead
+		DensityLayout densityLayout = static_cast<DensityLayout>(PARTICLE_DENSITY_LAYOUT);
+		// Selected before loading. Morton order the .ply splats (containers keep the order they were converted with)
+		bool mortonOrder = false;
+		// Selected before loading. Parse the .ply in chunks on a thread started by allocateAttributeBuffers, overlapped with
+		// their upload. Only used with float SH storage and without Morton order, splatSet stays empty and the AABB is known
+		// after waitForAttributes
+		bool streamingUpload = STREAMING_MODEL_UPLOAD;
+		// Selected before loading. Activate the .ply particles on the host and build their enclosing icosahedra with
+		// vk3DGRT::enclosing instead of particlePrimitives.comp (no streaming upload, the raw attributes never reach the device)
+		bool hostEnclosing = CPU_GAUSSIAN_ENCLOSING;
+		// Selected before loading, must match the shaders (INSTANCED_BLAS). One unit icosahedron BLAS with a TLAS instance per
+		// particle: the particles are packed on the host like hostEnclosing and vertices/indices only hold the unit icosahedron
+		bool instancedBLAS = INSTANCED_BLAS;
+		// Selected before loading, must match the shaders (PROCEDURAL_PRIMITIVES). One AABB primitive per particle hit by the
+		// intersection shader: the particles are packed on the host like hostEnclosing and vertices holds the VkAabbPositionsKHR
+		bool proceduralPrimitives = PROCEDURAL_PRIMITIVES;
+		// Selected before loading. Any mode but HostResidencyKeep frees splatSet as soon as it is uploaded or packed,
+		// releaseHostParticles frees the rest. numParticles and the AABB are computed at load time and stay valid
+		HostResidency hostResidency = static_cast<HostResidency>(HOST_RESIDENCY);
+
+		// From load3DGRTModel until the attributes are on the device
+		double loadTimeMs = 0.0;
+		// Fraction of the attribute rows on the device, written by the streaming upload thread
+		std::atomic<float> loadProgress{ 0.0f };
+
 		struct Attributes {
 			int count;
 			vks::Buffer storageBuffer;
 		} positions, rotations, scales, densities, vertices, indices, featuresAlbedo, featuresSpecular;
 
+		inline size_t size() const { return numParticles; }
+		inline size_t specularDimension() const { return sphSpecularDimension(sphDegree); }
+		// bytes per particle in the particleSphCoefficients buffer
+		size_t sphCoefficientStride() const;
+
 		void load3DGRTModel(std::string filename, vks::VulkanDevice* device);
-		void allocateAttributeBuffers(vks::VulkanDevice* vulkanDevice, VkQueue queue);
+		// With streamingUpload the rows are parsed and copied on a thread, through transferQueue when it is given and of
+		// another family than queue. Neither queue may be used by the caller until waitForAttributes
+		void allocateAttributeBuffers(vks::VulkanDevice* vulkanDevice, VkQueue queue, VkQueue transferQueue = VK_NULL_HANDLE);
+		// Blocks until the streaming upload is done, printing its progress, and hands the buffers over to the family of queue.
+		// Returns at once without streaming upload. A loader error is fatal
+		void waitForAttributes(vks::VulkanDevice* vulkanDevice, VkQueue queue);
+		void uploadPreActivatedParticles(vks::Buffer& particleDensities, vks::Buffer& particleSphCoefficients, vks::VulkanDevice* vulkanDevice, VkQueue queue);
+		// DensityLayoutPacked copy of the pre-activated particles, for the paths that skip particlePrimitives.comp
+		void uploadPackedParticleDensities(vks::Buffer& packedParticleDensities, vks::VulkanDevice* vulkanDevice, VkQueue queue);
+		// Once the device buffers and the host enclosing geometry are built. particleDensityData and particleSphCoefficientData
+		// are null afterwards, unless they point into a container mapping kept by HostResidencyMapped
+		void releaseHostParticles();
+
+	private:
+		bool loadContainer(const char* filename);
+		void encodeSphCoefficients();
+		void reportSphActiveDegrees() const;	// of the host packed or mapped particles
+		size_t releaseSplatSet();	// bytes freed
+#if !defined(__ANDROID__)
+		void streamAttributes(vks::VulkanDevice* vulkanDevice, VkQueue queue, uint32_t queueFamilyIndex);
+		// queue ownership of the streamed attribute buffers
+		std::vector<VkBufferMemoryBarrier> attributeOwnershipBarriers(uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex);
+
+		std::unique_ptr<PLYLoader> streamingLoader;		// opened in load3DGRTModel, extracted by streamAttributes
+		std::future<void> attributeUpload;			// streamAttributes, from allocateAttributeBuffers until waitForAttributes
+		uint32_t attributeQueueFamilyIndex = 0;		// of the queue the attributes were streamed through
+#endif
+		std::chrono::high_resolution_clock::time_point loadStartTime;
+		std::shared_ptr<vks::ThreadPool> loadThreadPool;	// from load3DGRTModel until the attributes are on the device
+
+		// host side particles when they are packed at load time instead of mapped from a container
+		std::vector<float> packedDensities;
+		std::vector<float> packedSphCoefficients;
+		std::vector<uint32_t> encodedSphCoefficients;
+
+#if defined(__ANDROID__)
+		std::vector<uint8_t> containerBuffer;
+#else
+		std::unique_ptr<vks::MappedFile> containerFile;
+#endif
 	};
 }
\ No newline at end of file
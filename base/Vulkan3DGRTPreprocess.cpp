@@ -0,0 +1,358 @@
+/*
+ * Abura Soba, 2025
+ *
+ * Vulkan3DGRTPreprocess.cpp
+ *
+ * Load time processing of the splats that never touches the device (Morton reorder, SH encoding, the .3dgrt
+ * container and the thread pool ranges of the loader), kept apart from Model so that the checks of tests/ build without Vulkan
+ */
+
+#include "Vulkan3DGRTModel.h"
+#include "Vulkan3DGRTEnclosing.h"
+#include "threadpool.hpp"
+
+#include <thread>
+#include <array>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cmath>
+
+namespace vk3DGRT {
+	void initLoadThreadPool(vks::ThreadPool& threadPool)
+	{
+		threadPool.setThreadCount(std::max(1u, std::thread::hardware_concurrency()));
+	}
+
+	size_t parallelForRanges(vks::ThreadPool& threadPool, size_t count, const std::function<void(size_t thread, size_t begin, size_t end)>& func)
+	{
+		const size_t numThreads = std::max<size_t>(1, std::min<size_t>(threadPool.threads.size(), (count + 4095) / 4096));
+		const size_t rangeSize = (count + numThreads - 1) / numThreads;
+		const size_t numRanges = count == 0 ? 1 : (count + rangeSize - 1) / rangeSize;
+		if (numRanges == 1) {
+			func(0, 0, count);
+			return 1;
+		}
+		for (size_t t = 0; t < numRanges; t++) {
+			const size_t begin = t * rangeSize;
+			const size_t end = std::min(count, begin + rangeSize);
+			threadPool.threads[t]->addJob([&func, t, begin, end] { func(t, begin, end); });
+		}
+		threadPool.wait();
+		return numRanges;
+	}
+
+	// Spreads the lower 21 bits of v so that there are two zero bits between each of them
+	static uint64_t expandBits21(uint64_t v)
+	{
+		v &= 0x1fffff;
+		v = (v | (v << 32)) & 0x1f00000000ffffull;
+		v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+		v = (v | (v << 8)) & 0x100f00f00f00f00full;
+		v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+		v = (v | (v << 2)) & 0x1249249249249249ull;
+		return v;
+	}
+
+	// Parallel LSD radix sort of (key, value) pairs, 8 bits per pass
+	static void radixSortPairs(vks::ThreadPool& threadPool, std::vector<uint64_t>& keys, std::vector<uint32_t>& values, uint32_t numKeyBits)
+	{
+		const size_t count = keys.size();
+		std::vector<uint64_t> keysTmp(count);
+		std::vector<uint32_t> valuesTmp(count);
+		std::vector<std::array<size_t, 256>> histograms(std::max<size_t>(1, threadPool.threads.size()));
+
+		for (uint32_t shift = 0; shift < numKeyBits; shift += 8) {
+			for (auto& histogram : histograms)
+				histogram.fill(0);
+			parallelForRanges(threadPool, count, [&](size_t thread, size_t begin, size_t end) {
+				std::array<size_t, 256>& histogram = histograms[thread];
+				for (size_t i = begin; i < end; i++)
+					histogram[(keys[i] >> shift) & 0xff]++;
+			});
+
+			// exclusive prefix sum in (digit, thread) order keeps the sort stable
+			size_t offset = 0;
+			bool singleDigit = false;
+			for (size_t digit = 0; digit < 256; digit++) {
+				size_t digitCount = 0;
+				for (size_t t = 0; t < histograms.size(); t++) {
+					size_t bucket = histograms[t][digit];
+					histograms[t][digit] = offset;
+					offset += bucket;
+					digitCount += bucket;
+				}
+				singleDigit |= (digitCount == count);
+			}
+			if (singleDigit)
+				continue;	// every key has the same digit, the pass would not move anything
+
+			parallelForRanges(threadPool, count, [&](size_t thread, size_t begin, size_t end) {
+				std::array<size_t, 256>& histogram = histograms[thread];
+				for (size_t i = begin; i < end; i++) {
+					size_t dst = histogram[(keys[i] >> shift) & 0xff]++;
+					keysTmp[dst] = keys[i];
+					valuesTmp[dst] = values[i];
+				}
+			});
+			keys.swap(keysTmp);
+			values.swap(valuesTmp);
+		}
+	}
+
+	void reorderSplatSetMorton(SplatSet& splatSet, vks::ThreadPool* threadPool)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+		vks::ThreadPool ownThreadPool;
+		if (!threadPool) {
+			initLoadThreadPool(ownThreadPool);
+			threadPool = &ownThreadPool;
+		}
+
+		const size_t count = splatSet.size();
+		glm::vec3 aabbMin(FLT_MAX), aabbMax(-FLT_MAX);
+		for (size_t i = 0; i < count; i++) {
+			glm::vec3 position = glm::make_vec3(&splatSet.positions[i * 3]);
+			aabbMin = glm::min(aabbMin, position);
+			aabbMax = glm::max(aabbMax, position);
+		}
+		const glm::vec3 extent = glm::max(aabbMax - aabbMin, glm::vec3(FLT_MIN));
+		const float maxCode = (float)((1 << 21) - 1);
+
+		// quantize positions to 21 bits per axis and interleave them into 63 bit keys
+		std::vector<uint64_t> keys(count);
+		std::vector<uint32_t> order(count);
+		parallelForRanges(*threadPool, count, [&](size_t, size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				glm::vec3 normalized = (glm::make_vec3(&splatSet.positions[i * 3]) - aabbMin) / extent;
+				glm::uvec3 code = glm::uvec3(glm::clamp(normalized, 0.0f, 1.0f) * maxCode);
+				keys[i] = expandBits21(code.x) | (expandBits21(code.y) << 1) | (expandBits21(code.z) << 2);
+				order[i] = (uint32_t)i;
+			}
+		});
+
+		auto keyTime = std::chrono::high_resolution_clock::now();
+
+		radixSortPairs(*threadPool, keys, order, 63);
+
+		auto sortTime = std::chrono::high_resolution_clock::now();
+
+		// gather every attribute array through the sorted order
+		auto permute = [&](std::vector<float>& attribute) {
+			const size_t stride = attribute.size() / count;
+			std::vector<float> sorted(attribute.size());
+			parallelForRanges(*threadPool, count, [&](size_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++)
+					memcpy(&sorted[i * stride], &attribute[(size_t)order[i] * stride], stride * sizeof(float));
+			});
+			attribute.swap(sorted);
+		};
+		if (count > 0) {
+			for (std::vector<float>* attribute : { &splatSet.positions, &splatSet.f_dc, &splatSet.f_rest, &splatSet.opacity, &splatSet.scale, &splatSet.rotation })
+				permute(*attribute);
+		}
+
+		auto endTime = std::chrono::high_resolution_clock::now();
+		auto ms = [](auto a, auto b) { return std::chrono::duration<double, std::milli>(b - a).count(); };
+		std::cout << "Morton reorder in " << (long long)ms(startTime, endTime) << "ms (keys " << ms(startTime, keyTime) << "ms, radix sort "
+			<< ms(keyTime, sortTime) << "ms, permute " << ms(sortTime, endTime) << "ms)" << std::endl;
+	}
+
+	size_t sphCoefficientStride(SphStorageMode mode, size_t specularDimension)
+	{
+		const size_t sphStride = 3 + specularDimension;
+		switch (mode) {
+		case SphStorageHalf:
+			return (sphStride + 1) / 2 * sizeof(uint32_t);
+		case SphStorageUnorm8:
+			// 3 header words + 4 codes per word, padded to 16 bytes
+			return (3 + (specularDimension + 3) / 4 + 3) / 4 * 4 * sizeof(uint32_t);
+		default:
+			return sphStride * sizeof(float);
+		}
+	}
+
+	/*
+	* Load time SH encoder, decoded by fetchParticleSphCoefficients (gaussianfunctions.glsl)
+	* SphStorageHalf   : 3 + specularDimension halfs, two per word (the last one zero padded)
+	* SphStorageUnorm8 : word 0 = half2(albedo.r, albedo.g), word 1 = half2(albedo.b, specular min),
+	*                    word 2 = half2(specular max, 0), words 3.. = specularDimension unorm8 codes (4 per word, low byte first)
+	*/
+	double encodeSphCoefficients(SphStorageMode mode, const float* src, size_t specularDimension, uint32_t* dst)
+	{
+		const size_t sphStride = 3 + specularDimension;
+		double squaredError = 0.0;
+		if (mode == SphStorageFloat) {
+			memcpy(dst, src, sphStride * sizeof(float));
+			return squaredError;
+		}
+
+		if (mode == SphStorageHalf) {
+			for (size_t j = 0; j < sphStride; j++) {
+				uint32_t half = glm::packHalf2x16(glm::vec2(src[j], 0.0f));
+				dst[j / 2] |= half << (16 * (j % 2));
+				float decoded = glm::unpackHalf2x16(half).x;
+				squaredError += (decoded - src[j]) * (decoded - src[j]);
+			}
+			return squaredError;
+		}
+
+		// SphStorageUnorm8
+		float specularMin = FLT_MAX, specularMax = -FLT_MAX;
+		for (size_t j = 3; j < sphStride; j++) {
+			specularMin = std::min(specularMin, src[j]);
+			specularMax = std::max(specularMax, src[j]);
+		}
+		dst[0] = glm::packHalf2x16(glm::vec2(src[0], src[1]));
+		dst[1] = glm::packHalf2x16(glm::vec2(src[2], specularMin));
+		dst[2] = glm::packHalf2x16(glm::vec2(specularMax, 0.0f));
+		const glm::vec3 albedo(glm::unpackHalf2x16(dst[0]), glm::unpackHalf2x16(dst[1]).x);
+		for (int j = 0; j < 3; j++) {
+			squaredError += (albedo[j] - src[j]) * (albedo[j] - src[j]);
+		}
+
+		// quantize against the range the shader actually decodes
+		specularMin = glm::unpackHalf2x16(dst[1]).y;
+		specularMax = glm::unpackHalf2x16(dst[2]).x;
+		const float range = specularMax - specularMin;
+		for (size_t j = 0; j < specularDimension; j++) {
+			float normalized = range > 0.0f ? (src[3 + j] - specularMin) / range : 0.0f;
+			uint32_t code = (uint32_t)glm::clamp(std::round(normalized * 255.0f), 0.0f, 255.0f);
+			dst[3 + j / 4] |= code << (8 * (j % 4));
+			float decoded = specularMin + range * (code / 255.0f);
+			squaredError += (decoded - src[3 + j]) * (decoded - src[3 + j]);
+		}
+		return squaredError;
+	}
+
+	namespace container {
+		// FNV-1a over 64 bit words (tail bytes folded in one by one)
+		uint64_t checksum(const void* data, size_t size)
+		{
+			const uint64_t prime = 0x100000001b3ull;
+			uint64_t hash = 0xcbf29ce484222325ull;
+			const uint8_t* bytes = (const uint8_t*)data;
+			size_t i = 0;
+			for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+				uint64_t word;
+				memcpy(&word, bytes + i, sizeof(uint64_t));
+				hash = (hash ^ word) * prime;
+			}
+			for (; i < size; i++) {
+				hash = (hash ^ bytes[i]) * prime;
+			}
+			return hash;
+		}
+
+		static uint64_t alignOffset(uint64_t offset)
+		{
+			return (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+		}
+
+		void pack(const SplatSet& splatSet, std::vector<float>& densities, std::vector<float>& sphCoefficients, glm::vec3& aabbMin, glm::vec3& aabbMax)
+		{
+			enclosing::activateParticles(splatSet, densities, sphCoefficients, aabbMin, aabbMax);
+		}
+
+		bool write(const char* filename, const SplatSet& splatSet)
+		{
+			auto startTime = std::chrono::high_resolution_clock::now();
+
+			const size_t densityStride = 12;
+			const size_t sphStride = 3 + splatSet.specularDimension();
+			const size_t numSplats = splatSet.size();
+
+			std::vector<float> densities;
+			std::vector<float> sphCoefficients;
+			glm::vec3 aabbMin, aabbMax;
+			pack(splatSet, densities, sphCoefficients, aabbMin, aabbMax);
+
+			Header header{};
+			memcpy(header.magic, magic, sizeof(magic));
+			header.version = version;
+			header.headerSize = sizeof(Header);
+			header.specularDimension = (uint32_t)splatSet.specularDimension();
+			header.numSections = SectionCount;
+
+			header.numParticles = densities.size() / densityStride;
+			for (int i = 0; i < 3; i++) {
+				header.aabbMin[i] = aabbMin[i];
+				header.aabbMax[i] = aabbMax[i];
+			}
+
+			const std::vector<float>* payloads[SectionCount] = { &densities, &sphCoefficients };
+			const size_t strides[SectionCount] = { densityStride, sphStride };
+			uint64_t offset = alignOffset(sizeof(Header));
+			for (uint32_t i = 0; i < SectionCount; i++) {
+				Section& section = header.sections[i];
+				section.type = i;
+				section.stride = (uint32_t)(strides[i] * sizeof(float));
+				section.offset = offset;
+				section.size = payloads[i]->size() * sizeof(float);
+				section.checksum = checksum(payloads[i]->data(), section.size);
+				offset = alignOffset(offset + section.size);
+			}
+
+			std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+			if (!out.is_open()) {
+				std::cout << "Error: failed to create container file: " << filename << std::endl;
+				return false;
+			}
+			const char padding[sectionAlignment] = {};
+			out.write((const char*)&header, sizeof(Header));
+			uint64_t written = sizeof(Header);
+			for (uint32_t i = 0; i < SectionCount; i++) {
+				out.write(padding, header.sections[i].offset - written);
+				out.write((const char*)payloads[i]->data(), header.sections[i].size);
+				written = header.sections[i].offset + header.sections[i].size;
+			}
+			out.close();
+			if (!out) {
+				std::cout << "Error: failed to write container file: " << filename << std::endl;
+				return false;
+			}
+
+			auto endTime = std::chrono::high_resolution_clock::now();
+			long long writeTime = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
+			std::cout << "Container written in " << writeTime << "ms (" << header.numParticles << " of " << numSplats << " splats kept, "
+				<< written << " Bytes): " << filename << std::endl;
+			return true;
+		}
+
+		const Header* read(const char* data, size_t size, const char* filename, const void* sectionData[SectionCount])
+		{
+			const Header* header = (const Header*)data;
+			if (size < sizeof(Header) || memcmp(header->magic, magic, sizeof(magic)) != 0) {
+				std::cout << "Error: not a 3dgrt container: " << filename << std::endl;
+				return nullptr;
+			}
+			if (header->version != version || header->headerSize != sizeof(Header) || header->numSections != SectionCount) {
+				std::cout << "Error: unsupported 3dgrt container version " << header->version << ", convert the .ply again" << std::endl;
+				return nullptr;
+			}
+			if (sphDegreeFromRestCount(header->specularDimension) == UINT32_MAX) {
+				std::cout << "Error: container holds " << header->specularDimension << " specular coefficients, which matches no SH degree" << std::endl;
+				return nullptr;
+			}
+
+			const uint32_t expectedStrides[SectionCount] = { 12 * sizeof(float), (uint32_t)((3 + header->specularDimension) * sizeof(float)) };
+			for (uint32_t i = 0; i < SectionCount; i++) {
+				const Section& section = header->sections[i];
+				if (section.type != i || section.stride != expectedStrides[i] || section.size != header->numParticles * section.stride ||
+					section.offset % sectionAlignment != 0 || section.offset + section.size > size) {
+					std::cout << "Error: corrupted section " << i << " in container: " << filename << std::endl;
+					return nullptr;
+				}
+				sectionData[i] = data + section.offset;
+			}
+
+			for (uint32_t i = 0; i < SectionCount; i++) {
+				if (checksum(sectionData[i], header->sections[i].size) != header->sections[i].checksum) {
+					std::cout << "Error: checksum mismatch in section " << i << " of container: " << filename << std::endl;
+					return nullptr;
+				}
+			}
+			return header;
+		}
+	}
+}
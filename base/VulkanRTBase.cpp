@@ -1184,6 +1184,26 @@ VulkanRTBase::VulkanRTBase()
 	commandLineParser.add("benchmarkresultfile", { "-bf", "--benchfilename" }, 1, "Set file name for benchmark results");
 	commandLineParser.add("benchmarkresultframes", { "-bt", "--benchframetimes" }, 0, "Save frame times to benchmark results file");
 	commandLineParser.add("benchmarkframes", { "-bfs", "--benchmarkframes" }, 1, "Only render the given number of frames");
+	commandLineParser.add("sphstorage", { "-sh", "--sphstorage" }, 1, "Select SH coefficient storage (float, fp16 or unorm8)");
+	commandLineParser.add("mortonorder", { "-mo", "--mortonorder" }, 0, "Sort the splats along a Morton curve at load time");
+	commandLineParser.add("hostenclosing", { "-he", "--hostenclosing" }, 0, "Run the Gaussian enclosing pass on the CPU");
+	commandLineParser.add("hostresidency", { "-hr", "--hostresidency" }, 1, "Select the host particle data kept after the upload (keep, mapped or release)");
+	commandLineParser.add("shdegree", { "-sd", "--shdegree" }, 1, "Load and upload the SH bands up to this degree only (0 to 3)");
+	commandLineParser.add("shepsilon", { "-se", "--shepsilon" }, 1, "Skip the SH bands of a particle whose coefficients all stay within this value (0 skips the zero bands only)");
+	commandLineParser.add("densitylayout", { "-dl", "--densitylayout" }, 1, "Select the particle density layout read per hit (float or packed)");
+	commandLineParser.add("convert", { "-cv", "--convert" }, 1, "Convert a 3DGRT .ply model to the pre-activated .3dgrt container and exit");
+	commandLineParser.add("splitcells", { "-sc", "--splitcells" }, 1, "Set the split BLAS cells per longest scene axis (SPLIT_BLAS)");
+	commandLineParser.add("splitclipcheck", { "-scc", "--splitclipcheck" }, 1, "Check the split BLAS separating axis test against the clipper on a .ply model, time both and exit (SPLIT_BLAS)");
+	commandLineParser.add("splittune", { "-st", "--splittune" }, 1, "Build and trace every comma separated split BLAS cell count, write the results to csv and exit (SPLIT_BLAS)");
+	commandLineParser.add("frustumculling", { "-fc", "--frustumculling" }, 0, "Leave the split cells / particle instances outside the camera frustum out of the TLAS, the host waits for the queue and builds it again on camera moves");
+	commandLineParser.add("nofrustumculling", { "-nfc", "--nofrustumculling" }, 0, "Keep the split cells / particle instances outside the camera frustum in the TLAS (FRUSTUM_CULLING)");
+	commandLineParser.add("blasmode", { "-bm", "--blasmode" }, 1, "Select the particle acceleration structures (icosahedra, instanced or procedural)");
+	commandLineParser.add("animateparticles", { "-ap", "--animateparticles" }, 1, "Move the first N particles along a circle, the 3DGRT acceleration structures are refitted every frame (icosahedra BLAS mode)");
+	commandLineParser.add("hitcounts", { "-hc", "--hitcounts" }, 0, "Write the per pixel ray hit counts of the 100th frame to results/texts (ray tracing pipeline only)");
+	commandLineParser.add("adaptivetracing", { "-at", "--adaptivetracing" }, 0, "Shrink the k-buffer of the later rounds to the hits expected to reach the minimum transmittance (ray tracing pipeline only)");
+	commandLineParser.add("tbsize", { "-tb", "--tbsize" }, 1, "Set the x,y workgroup size of the ray query compute pass (RAY_QUERY)");
+	commandLineParser.add("kbuffer", { "-kb", "--kbuffer" }, 1, "Select the k-buffer size of the particle rendering pass (4, 8, 16 or 32)");
+	commandLineParser.add("kbuffersweep", { "-ks", "--kbuffersweep" }, 0, "Trace the dataset cameras with every k-buffer size, write the results to csv and exit");
 
 	commandLineParser.parse(args);
 	if (commandLineParser.isSet("help")) {
@@ -1468,7 +1488,7 @@ bool VulkanRTBase::initVulkan()
 	// and encapsulates functions related to a device
 	vulkanDevice = new vks::VulkanDevice(physicalDevice);
 
-	VkResult res = vulkanDevice->createLogicalDevice(enabledFeatures, enabledDeviceExtensions, deviceCreatepNextChain);
+	VkResult res = vulkanDevice->createLogicalDevice(enabledFeatures, enabledDeviceExtensions, deviceCreatepNextChain, true, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT);
 	if (res != VK_SUCCESS) {
 		vks::tools::exitFatal("Could not create Vulkan device: \n" + vks::tools::errorString(res), res);
 		return false;
@@ -1480,6 +1500,10 @@ bool VulkanRTBase::initVulkan()
 #if MULTIQUEUE
 	vkGetDeviceQueue(device, vulkanDevice->queueFamilyIndices.graphics, 1, &presentQueue);
 #endif
+	transferQueue = graphicsQueue;
+	if (vulkanDevice->queueFamilyIndices.transfer != vulkanDevice->queueFamilyIndices.graphics) {
+		vkGetDeviceQueue(device, vulkanDevice->queueFamilyIndices.transfer, 0, &transferQueue);
+	}
 
 	// Find a suitable depth and/or stencil format
 	VkBool32 validFormat{ false };
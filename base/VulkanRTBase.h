@@ -171,6 +171,8 @@ protected:
 	// Handle to the device graphics queue that command buffers are submitted to
 	VkQueue graphicsQueue{ VK_NULL_HANDLE };
 	VkQueue presentQueue{ VK_NULL_HANDLE };
+	// Queue of the dedicated transfer family, the graphics queue when the device has none
+	VkQueue transferQueue{ VK_NULL_HANDLE };
 	// Depth buffer format (selected during Vulkan initialization)
 	VkFormat depthFormat;
 	// Command buffer pool
@@ -44,6 +44,7 @@ namespace vks {
 			MOGRenderAdaptiveKernelClamping = 1 << 0,
 			MOGRenderWithNormals = 1 << 1,
 			MOGRenderWithHitCounts = 1 << 2,
+			MOGRenderPreActivatedParticles = 1 << 3,	// particles come from a .3dgrt container
 			MOGRenderDefault = MOGRenderNone
 		};
 
@@ -65,6 +66,8 @@ namespace vks {
 			alignas(4) float kernelMinResponse;
 			alignas(4) unsigned int opts;
 			alignas(4) float degree;
+			alignas(4) unsigned int firstGaussian = 0;	// [firstGaussian, numOfGaussians) are enclosed, a sub range only when refitting
+			alignas(16) glm::vec4 translation = glm::vec4(0.0f);	// xyz moves the pre-activated particles of the range first (refit edits)
 		};
 
 		void updateLightStaticInfo(UniformDataStatic& uniformDataStaticLight, BaseFrameObject& currentFrame, vkglTF::Model &scene, vks::VulkanDevice *vulkanDevice, VkQueue graphicsQueue);
@@ -0,0 +1,97 @@
+/*
+ * Abura Soba, 2025
+ *
+ * 4 lane float vector (SSE2, NEON or scalar), shared by the host passes that process 4 items at a time
+ */
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FLOAT4_SSE 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define FLOAT4_NEON 1
+#endif
+
+namespace vk3DGRT {
+	// Comparisons return a mask with all the bits of the lanes where they hold, combined with | and &.
+	// movemask packs the lanes of a mask into the low 4 bits
+	struct float4 {
+#if defined(FLOAT4_SSE)
+		__m128 v;
+		float4(__m128 v) : v(v) {}
+		explicit float4(float s) : v(_mm_set1_ps(s)) {}
+		static float4 load(const float* p) { return _mm_load_ps(p); }
+		void store(float* p) const { _mm_store_ps(p, v); }
+		friend float4 operator+(float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+		friend float4 operator-(float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+		friend float4 operator*(float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+		friend float4 operator/(float4 a, float4 b) { return _mm_div_ps(a.v, b.v); }
+		friend float4 operator-(float4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+		friend float4 sqrt(float4 a) { return _mm_sqrt_ps(a.v); }
+		friend float4 abs(float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+		// b is returned when a is NaN, like std::max(b, a) / std::min(b, a)
+		friend float4 max(float4 a, float4 b) { return _mm_max_ps(a.v, b.v); }
+		friend float4 min(float4 a, float4 b) { return _mm_min_ps(a.v, b.v); }
+		friend float4 operator<(float4 a, float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+		friend float4 operator>(float4 a, float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+		friend float4 operator<=(float4 a, float4 b) { return _mm_cmple_ps(a.v, b.v); }
+		friend float4 operator|(float4 a, float4 b) { return _mm_or_ps(a.v, b.v); }
+		friend float4 operator&(float4 a, float4 b) { return _mm_and_ps(a.v, b.v); }
+		friend int movemask(float4 a) { return _mm_movemask_ps(a.v); }
+#elif defined(FLOAT4_NEON)
+		float32x4_t v;
+		float4(float32x4_t v) : v(v) {}
+		explicit float4(float s) : v(vdupq_n_f32(s)) {}
+		static float4 load(const float* p) { return vld1q_f32(p); }
+		void store(float* p) const { vst1q_f32(p, v); }
+		friend float4 operator+(float4 a, float4 b) { return vaddq_f32(a.v, b.v); }
+		friend float4 operator-(float4 a, float4 b) { return vsubq_f32(a.v, b.v); }
+		friend float4 operator*(float4 a, float4 b) { return vmulq_f32(a.v, b.v); }
+		friend float4 operator/(float4 a, float4 b) { return vdivq_f32(a.v, b.v); }
+		friend float4 operator-(float4 a) { return vnegq_f32(a.v); }
+		friend float4 sqrt(float4 a) { return vsqrtq_f32(a.v); }
+		friend float4 abs(float4 a) { return vabsq_f32(a.v); }
+		friend float4 max(float4 a, float4 b) { return vbslq_f32(vcgtq_f32(a.v, b.v), a.v, b.v); }
+		friend float4 min(float4 a, float4 b) { return vbslq_f32(vcltq_f32(a.v, b.v), a.v, b.v); }
+		friend float4 operator<(float4 a, float4 b) { return vreinterpretq_f32_u32(vcltq_f32(a.v, b.v)); }
+		friend float4 operator>(float4 a, float4 b) { return vreinterpretq_f32_u32(vcgtq_f32(a.v, b.v)); }
+		friend float4 operator<=(float4 a, float4 b) { return vreinterpretq_f32_u32(vcleq_f32(a.v, b.v)); }
+		friend float4 operator|(float4 a, float4 b) { return vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(a.v), vreinterpretq_u32_f32(b.v))); }
+		friend float4 operator&(float4 a, float4 b) { return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a.v), vreinterpretq_u32_f32(b.v))); }
+		friend int movemask(float4 a) {
+			const uint32x4_t m = vshrq_n_u32(vreinterpretq_u32_f32(a.v), 31);
+			return int(vgetq_lane_u32(m, 0) | (vgetq_lane_u32(m, 1) << 1) | (vgetq_lane_u32(m, 2) << 2) | (vgetq_lane_u32(m, 3) << 3));
+		}
+#else
+		float v[4];
+		float4() {}
+		explicit float4(float s) { for (int i = 0; i < 4; i++) v[i] = s; }
+		static float4 load(const float* p) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = p[i]; return r; }
+		void store(float* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+		template<typename Op> static float4 apply(float4 a, float4 b, Op op) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = op(a.v[i], b.v[i]); return r; }
+		static float lane(uint32_t bits) { float f; memcpy(&f, &bits, sizeof(float)); return f; }
+		static uint32_t bits(float f) { uint32_t b; memcpy(&b, &f, sizeof(float)); return b; }
+		friend float4 operator+(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x + y; }); }
+		friend float4 operator-(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x - y; }); }
+		friend float4 operator*(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x * y; }); }
+		friend float4 operator/(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x / y; }); }
+		friend float4 operator-(float4 a) { return apply(a, a, [](float x, float) { return -x; }); }
+		friend float4 sqrt(float4 a) { return apply(a, a, [](float x, float) { return std::sqrt(x); }); }
+		friend float4 abs(float4 a) { return apply(a, a, [](float x, float) { return std::fabs(x); }); }
+		friend float4 max(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x > y ? x : y; }); }
+		friend float4 min(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x < y ? x : y; }); }
+		friend float4 operator<(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return lane(x < y ? ~0u : 0u); }); }
+		friend float4 operator>(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return lane(x > y ? ~0u : 0u); }); }
+		friend float4 operator<=(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return lane(x <= y ? ~0u : 0u); }); }
+		friend float4 operator|(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return lane(bits(x) | bits(y)); }); }
+		friend float4 operator&(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return lane(bits(x) & bits(y)); }); }
+		friend int movemask(float4 a) { int m = 0; for (int i = 0; i < 4; i++) m |= int(bits(a.v[i]) >> 31) << i; return m; }
+#endif
+	};
+}
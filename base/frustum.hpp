@@ -6,6 +6,8 @@
 * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
 */
 
+#pragma once
+
 #include <array>
 #include <math.h>
 #include <glm/glm.hpp>
@@ -57,9 +59,10 @@ namespace vks
 			}
 		}
 		
-		bool checkSphere(glm::vec3 pos, float radius)
+		// checkSphere and checkBox only test the first numPlanes planes (4: the side planes, 5: and the near plane)
+		bool checkSphere(glm::vec3 pos, float radius, int numPlanes = 6)
 		{
-			for (auto i = 0; i < planes.size(); i++)
+			for (auto i = 0; i < numPlanes; i++)
 			{
 				if ((planes[i].x * pos.x) + (planes[i].y * pos.y) + (planes[i].z * pos.z) + planes[i].w <= -radius)
 				{
@@ -68,5 +71,19 @@ namespace vks
 			}
 			return true;
 		}
+
+		bool checkBox(glm::vec3 boxMin, glm::vec3 boxMax, int numPlanes = 6)
+		{
+			for (auto i = 0; i < numPlanes; i++)
+			{
+				// corner of the box furthest along the plane normal
+				glm::vec3 corner(planes[i].x >= 0.0f ? boxMax.x : boxMin.x, planes[i].y >= 0.0f ? boxMax.y : boxMin.y, planes[i].z >= 0.0f ? boxMax.z : boxMin.z);
+				if ((planes[i].x * corner.x) + (planes[i].y * corner.y) + (planes[i].z * corner.z) + planes[i].w < 0.0f)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
 	};
 }
@@ -0,0 +1,90 @@
+/*
+ * Sogang Univ, Graphics Lab, 2024
+ *
+ * Abura Soba, 2025
+ *
+ * Read-only memory mapped file
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif !defined(__ANDROID__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace vks
+{
+#if !defined(__ANDROID__)
+	class MappedFile
+	{
+	public:
+		const char* data = nullptr;
+		size_t size = 0;
+
+		MappedFile() {}
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		~MappedFile() { close(); }
+
+		bool open(const char* filename)
+		{
+			close();
+#if defined(_WIN32)
+			file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE) return false;
+			LARGE_INTEGER fileSize;
+			if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) return false;
+			size = (size_t)fileSize.QuadPart;
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping == NULL) return false;
+			data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+			fd = ::open(filename, O_RDONLY);
+			if (fd < 0) return false;
+			struct stat st;
+			if (fstat(fd, &st) != 0 || st.st_size == 0) return false;
+			size = (size_t)st.st_size;
+			void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (ptr == MAP_FAILED) return false;
+			// advice values are not flags, one call each
+			madvise(ptr, size, MADV_SEQUENTIAL);
+			madvise(ptr, size, MADV_WILLNEED);
+			data = (const char*)ptr;
+#endif
+			return data != nullptr;
+		}
+
+		void close()
+		{
+#if defined(_WIN32)
+			if (data) UnmapViewOfFile(data);
+			if (mapping != NULL) CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+			mapping = NULL;
+			file = INVALID_HANDLE_VALUE;
+#else
+			if (data) munmap((void*)data, size);
+			if (fd >= 0) ::close(fd);
+			fd = -1;
+#endif
+			data = nullptr;
+			size = 0;
+		}
+
+	private:
+#if defined(_WIN32)
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = NULL;
+#else
+		int fd = -1;
+#endif
+	};
+#endif
+}
@@ -18,7 +18,12 @@
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/hash.hpp>
 #include <vector>
-//#include <unordered_map>
+#include <thread>
+#include <numeric>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <fstream>
 
 using namespace std;
 
@@ -46,10 +51,11 @@ struct AccelerationStructure {
 };
 
 void SplitBLAS::copyDeviceToHost(vks::Buffer& vertexBuffer, vks::Buffer& indexBuffer, VkQueue& queue) {
-	vertices.resize(vertexBuffer.size);
-	indices.resize(indexBuffer.size);
-	vertCnt = vertexBuffer.size;
-	idxCnt = indexBuffer.size;
+	// buffer sizes are in bytes
+	vertices.resize(vertexBuffer.size / sizeof(float));
+	indices.resize(indexBuffer.size / sizeof(uint32_t));
+	vertCnt = (uint32_t)vertices.size();
+	idxCnt = (uint32_t)indices.size();
 
 	/*** Vetices ***/
 	vks::Buffer stagingBuffer;
@@ -88,8 +94,53 @@ void SplitBLAS::copyDeviceToHost(vks::Buffer& vertexBuffer, vks::Buffer& indexBu
 	vkFreeMemory(vulkanDevice->logicalDevice, stagingBuffer.memory, nullptr);
 }
 
+/*
+* Open addressing (linear probing) vertex deduplication for one cell at a time. The slots hold indices into the
+* cell's vertex array and are reused for the next cell, so indexing a cell does not allocate once the table is
+* large enough. Vertices compare with operator== like the std::unordered_map it replaces (0 and -0 are equal)
+*/
+class CellVertexTable {
+	vector<uint32_t> slots;		// vertex index + 1, 0 is empty
+	uint32_t mask = 0;
+
+	static uint32_t hash(const glm::vec3& vertex) {
+		uint32_t h = 0x811c9dc5u;
+		for (int i = 0; i < 3; i++) {
+			uint32_t bits = 0;
+			if (vertex[i] != 0.0f) memcpy(&bits, &vertex[i], sizeof(float));
+			h = (h ^ bits) * 0x01000193u;
+			h ^= h >> 15;
+		}
+		return h;
+	}
+
+public:
+	// maxVertices: upper bound of the vertices of the next cell
+	void reset(size_t maxVertices) {
+		size_t capacity = 16;
+		while (capacity < maxVertices * 2) capacity *= 2;
+		if (slots.size() < capacity) slots.resize(capacity);
+		std::fill(slots.begin(), slots.begin() + capacity, 0u);
+		mask = static_cast<uint32_t>(capacity - 1);
+	}
+
+	// index of vertex in vertices, appended if it is not there yet
+	uint32_t insert(const glm::vec3& vertex, vector<glm::vec3>& vertices) {
+		for (uint32_t slot = hash(vertex) & mask;; slot = (slot + 1) & mask) {
+			if (slots[slot] == 0) {
+				vertices.push_back(vertex);
+				slots[slot] = static_cast<uint32_t>(vertices.size());
+				return slots[slot] - 1;
+			}
+			if (vertices[slots[slot] - 1] == vertex) return slots[slot] - 1;
+		}
+	}
+};
+
 void SplitBLAS::saveGeometries_SBLAS(std::vector<glm::vec3>& vertexBuffer, std::vector<uint32_t>& indexBuffer) {
 	/* split cells with aabb-triangle clipping */
+	minPos = glm::vec3(FLT_MAX);
+	maxPos = glm::vec3(-FLT_MAX);
 	for (int i = 0; i < vertexBuffer.size(); i++) {
 		if (vertexBuffer[i].x > maxPos.x) maxPos.x = vertexBuffer[i].x;
 		if (vertexBuffer[i].x < minPos.x) minPos.x = vertexBuffer[i].x;
@@ -104,87 +155,452 @@ void SplitBLAS::saveGeometries_SBLAS(std::vector<glm::vec3>& vertexBuffer, std::
 
 	const glm::vec3 sceneSize = maxPos - minPos;
 	const float maxSize = glm::max(glm::max(sceneSize.x, sceneSize.y), sceneSize.z);
-	const float gridSize = maxSize / NUMBER_OF_CELLS_PER_LONGEST_AXIS;
+	const int cellsPerAxis = static_cast<int>(std::max(cellsPerLongestAxis, 1u));
+	const float gridSize = maxSize / cellsPerAxis;
 	const glm::ivec3 numCells = glm::ivec3(
-		(maxSize == sceneSize.x) ? NUMBER_OF_CELLS_PER_LONGEST_AXIS : static_cast<int>(sceneSize.x / gridSize) + 1,
-		(maxSize == sceneSize.y) ? NUMBER_OF_CELLS_PER_LONGEST_AXIS : static_cast<int>(sceneSize.y / gridSize) + 1,
-		(maxSize == sceneSize.z) ? NUMBER_OF_CELLS_PER_LONGEST_AXIS : static_cast<int>(sceneSize.z / gridSize) + 1
+		(maxSize == sceneSize.x) ? cellsPerAxis : static_cast<int>(sceneSize.x / gridSize) + 1,
+		(maxSize == sceneSize.y) ? cellsPerAxis : static_cast<int>(sceneSize.y / gridSize) + 1,
+		(maxSize == sceneSize.z) ? cellsPerAxis : static_cast<int>(sceneSize.z / gridSize) + 1
 	);
-	numCellsTotal = numCells.x * numCells.y * numCells.z;
+	auto partitionStartTime = std::chrono::high_resolution_clock::now();
+	numCellsTotal = adaptivePartition ? buildAdaptiveCells(vertexBuffer, indexBuffer) : numCells.x * numCells.y * numCells.z;
+	splitStats.partitionTimeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - partitionStartTime).count();
 
-	h_splittedVert.resize(numCellsTotal);
-	h_splittedIdx.resize(numCellsTotal);
-	h_splittedPrimitiveId.resize(numCellsTotal);
+	h_splittedVert.assign(numCellsTotal, {});
+	h_splittedIdx.assign(numCellsTotal, {});
+	h_splittedPrimitiveId.assign(numCellsTotal, {});
 
 	auto calcIdx = [numCells](glm::ivec3 idx)->int {return numCells.x * numCells.y * idx.z + numCells.x * idx.y + idx.x; };
 	assert(indexBuffer.size() % 3 == 0);
 
 	std::vector<AABB_Triangle_Clipping::_AABB> gridAabb(numCellsTotal);
 
-	//split space by square cells
-	for (int i = 0; i < numCells.x; ++i) {
-		for (int j = 0; j < numCells.y; ++j) {
-			for (int k = 0; k < numCells.z; ++k) {
-				gridAabb[calcIdx({ i, j, k })] = {
-					minPos.x + i * gridSize, minPos.y + j * gridSize, minPos.z + k * gridSize,
-					minPos.x + (i + 1) * gridSize, minPos.y + (j + 1) * gridSize, minPos.z + (k + 1) * gridSize
-				};
+	if (adaptivePartition) {
+		for (const PartitionNode& node : partitionNodes) {
+			if (node.children != 0) continue;
+			gridAabb[node.cellIdx] = { node.boxMin.x, node.boxMin.y, node.boxMin.z, node.boxMax.x, node.boxMax.y, node.boxMax.z };
+		}
+	}
+	else {
+		//split space by square cells
+		for (int i = 0; i < numCells.x; ++i) {
+			for (int j = 0; j < numCells.y; ++j) {
+				for (int k = 0; k < numCells.z; ++k) {
+					gridAabb[calcIdx({ i, j, k })] = {
+						minPos.x + i * gridSize, minPos.y + j * gridSize, minPos.z + k * gridSize,
+						minPos.x + (i + 1) * gridSize, minPos.y + (j + 1) * gridSize, minPos.z + (k + 1) * gridSize
+					};
+				}
 			}
 		}
 	}
 
-	std::vector<std::unordered_map<glm::vec3, uint32_t>> uniqueVertices(numCellsTotal);
+	// Clipped triangles of a contiguous range of input triangles, in the order they were produced.
+	// One growing arena per thread instead of one vector per cell and thread
+	struct ClippedTriangles {
+		vector<glm::vec3> vert;			// 3 per clipped triangle
+		vector<uint32_t> cellIdx;
+		vector<uint32_t> primitiveId;
+		vector<uint32_t> cellCounts;	// clipped triangles per cell
+	};
+	const size_t numTriangles = indexBuffer.size() / 3;
+	const size_t numThreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), (numTriangles + 4095) / 4096));
+	vector<ClippedTriangles> threadOutputs(numThreads);
+	std::atomic<uint64_t> cellsClipped{ 0 };
+	std::atomic<uint64_t> cellsAccepted{ 0 };
+
+	auto runThreads = [numThreads](size_t count, const std::function<void(size_t, size_t, size_t)>& func) {
+		const size_t rangeSize = (count + numThreads - 1) / numThreads;
+		vector<std::thread> workers;
+		for (size_t t = 1; t < numThreads; t++) {
+			workers.emplace_back(func, t, std::min(count, t * rangeSize), std::min(count, (t + 1) * rangeSize));
+		}
+		func(0, 0, std::min(count, rangeSize));
+		for (auto& worker : workers) worker.join();
+	};
 
-	int last_percent = -1;
 	// split vertexes
-	uint32_t primitiveId = 0;
-	for (int i = 0; i < indexBuffer.size(); i += 3) {
-		glm::vec3 tri[3] = { vertexBuffer[indexBuffer[i]], vertexBuffer[indexBuffer[i + 1]], vertexBuffer[indexBuffer[i + 2]] };
-		glm::vec3 triMinPos = glm::min(glm::min(tri[0], tri[1]), tri[2]);
-		glm::vec3 triMaxPos = glm::max(glm::max(tri[0], tri[1]), tri[2]);
-
-		for (int cellIdx = 0; cellIdx < numCellsTotal; ++cellIdx) {
-			if (gridAabb[cellIdx].xmax < triMinPos.x || gridAabb[cellIdx].xmin > triMaxPos.x) continue;
-			if (gridAabb[cellIdx].ymax < triMinPos.y || gridAabb[cellIdx].ymin > triMaxPos.y) continue;
-			if (gridAabb[cellIdx].zmax < triMinPos.z || gridAabb[cellIdx].zmin > triMaxPos.z) continue;
-
-			//TODO : test aabb-triangle intersection before clipping
-			std::vector<glm::vec3> polygon;
-			AABB_Triangle_Clipping::_clip_triangle_against_AABB(tri, gridAabb[cellIdx], polygon);
-
-			if (polygon.size() == 0) continue;
-			for (int k = 1; k < polygon.size() - 1; ++k) {
-				if (uniqueVertices[cellIdx].count(polygon[0]) == 0) {
-					uniqueVertices[cellIdx][polygon[0]] = static_cast<uint32_t>(h_splittedVert[cellIdx].size());
-					h_splittedVert[cellIdx].push_back(polygon[0]);
+	auto startTime = std::chrono::high_resolution_clock::now();
+	runThreads(numTriangles, [&](size_t thread, size_t begin, size_t end) {
+		ClippedTriangles& clippedTriangles = threadOutputs[thread];
+		clippedTriangles.cellCounts.assign(numCellsTotal, 0);
+		AABB_Triangle_Clipping::_Polygon polygon;
+		AABB_Triangle_Clipping::_AABBBatch batch;
+		uint8_t overlap[AABB_Triangle_Clipping::_AABB_BATCH_SIZE];
+		uint32_t batchCells[AABB_Triangle_Clipping::_AABB_BATCH_SIZE];
+		vector<uint32_t> candidateCells;
+		uint64_t clipped = 0;
+		uint64_t accepted = 0;
+		int last_percent = -1;
+
+		for (size_t primitiveId = begin; primitiveId < end; primitiveId++) {
+			const uint32_t* triIdx = &indexBuffer[primitiveId * 3];
+			glm::vec3 tri[3] = { vertexBuffer[triIdx[0]], vertexBuffer[triIdx[1]], vertexBuffer[triIdx[2]] };
+			const AABB_Triangle_Clipping::_SATTriangle satTri(tri);
+			const glm::vec3& triMinPos = satTri.minPos;
+			const glm::vec3& triMaxPos = satTri.maxPos;
+
+			// candidate cells in ascending index, like the sequential loop over every cell
+			candidateCells.clear();
+			if (adaptivePartition) {
+				uint32_t stack[64];
+				int top = 0;
+				stack[top++] = 0;
+				while (top > 0) {
+					const PartitionNode& node = partitionNodes[stack[--top]];
+					if (glm::any(glm::lessThan(node.boxMax, triMinPos)) || glm::any(glm::greaterThan(node.boxMin, triMaxPos))) continue;
+					if (node.children == 0) {
+						candidateCells.push_back(node.cellIdx);
+						continue;
+					}
+					stack[top++] = node.children + 1;
+					stack[top++] = node.children;
 				}
-				h_splittedIdx[cellIdx].push_back(uniqueVertices[cellIdx][polygon[0]]);
+			}
+			else {
+				// only the cells under the triangle bounds, widened by one cell for the inclusive overlap test below
+				const glm::vec3 maxCell = glm::vec3(numCells - 1);
+				const glm::ivec3 cellMin = glm::ivec3(glm::clamp(glm::floor((triMinPos - minPos) / gridSize) - 1.0f, glm::vec3(0.0f), maxCell));
+				const glm::ivec3 cellMax = glm::ivec3(glm::clamp(glm::floor((triMaxPos - minPos) / gridSize) + 1.0f, glm::vec3(0.0f), maxCell));
+				for (int k = cellMin.z; k <= cellMax.z; ++k)
+					for (int j = cellMin.y; j <= cellMax.y; ++j)
+						for (int i = cellMin.x; i <= cellMax.x; ++i)
+							candidateCells.push_back(static_cast<uint32_t>(calcIdx({ i, j, k })));
+			}
 
-				if (uniqueVertices[cellIdx].count(polygon[k]) == 0) {
-					uniqueVertices[cellIdx][polygon[k]] = static_cast<uint32_t>(h_splittedVert[cellIdx].size());
-					h_splittedVert[cellIdx].push_back(polygon[k]);
+			// candidates overlapping the triangle bounds go through the separating axis test a batch at a time,
+			// only the cells the triangle crosses are clipped
+			auto clipBatch = [&]() {
+				AABB_Triangle_Clipping::_classify_triangle_against_AABBs(satTri, batch, overlap);
+				for (int lane = 0; lane < batch.size; lane++) {
+					if (overlap[lane] == AABB_Triangle_Clipping::_OUTSIDE) continue;
+					const uint32_t cellIdx = batchCells[lane];
+
+					if (overlap[lane] == AABB_Triangle_Clipping::_INSIDE) {
+						accepted++;
+						polygon.size = 3;
+						for (int v = 0; v < 3; v++) polygon.v[v] = tri[v];
+					}
+					else {
+						AABB_Triangle_Clipping::_clip_triangle_against_AABB(tri, gridAabb[cellIdx], polygon);
+						clipped++;
+					}
+
+					for (int v = 1; v < polygon.size - 1; ++v) {
+						clippedTriangles.vert.push_back(polygon.v[0]);
+						clippedTriangles.vert.push_back(polygon.v[v]);
+						clippedTriangles.vert.push_back(polygon.v[v + 1]);
+						clippedTriangles.cellIdx.push_back(cellIdx);
+						clippedTriangles.primitiveId.push_back(static_cast<uint32_t>(primitiveId / 20));
+						clippedTriangles.cellCounts[cellIdx]++;
+					}
 				}
-				h_splittedIdx[cellIdx].push_back(uniqueVertices[cellIdx][polygon[k]]);
-
-				if (uniqueVertices[cellIdx].count(polygon[k + 1]) == 0) {
-					uniqueVertices[cellIdx][polygon[k + 1]] = static_cast<uint32_t>(h_splittedVert[cellIdx].size());
-					h_splittedVert[cellIdx].push_back(polygon[k + 1]);
+				batch.size = 0;
+			};
+			batch.size = 0;
+			for (uint32_t cellIdx : candidateCells) {
+				if (gridAabb[cellIdx].xmax < triMinPos.x || gridAabb[cellIdx].xmin > triMaxPos.x) continue;
+				if (gridAabb[cellIdx].ymax < triMinPos.y || gridAabb[cellIdx].ymin > triMaxPos.y) continue;
+				if (gridAabb[cellIdx].zmax < triMinPos.z || gridAabb[cellIdx].zmin > triMaxPos.z) continue;
+
+				batchCells[batch.size] = cellIdx;
+				batch.push_back(gridAabb[cellIdx]);
+				if (batch.size == AABB_Triangle_Clipping::_AABB_BATCH_SIZE) clipBatch();
+			}
+			if (batch.size > 0) clipBatch();
+
+			// the first range reports for all of them
+			if (thread == 0) {
+				int percent = static_cast<int>(std::floor((primitiveId + 1 - begin) * 100.0f / (end - begin)));
+				if (percent != last_percent) {
+					cout << "\rprogress: " << percent << "% " << flush;
+					last_percent = percent;
 				}
-				h_splittedIdx[cellIdx].push_back(uniqueVertices[cellIdx][polygon[k + 1]]);
+			}
+		}
+		cellsClipped += clipped;
+		cellsAccepted += accepted;
+	});
+	cout << "\n";
 
-				h_splittedPrimitiveId[cellIdx].push_back(primitiveId / 20);
+	// group the clipped triangles by cell (counting sort), thread by thread so each cell keeps the sequential order
+	auto clipTime = std::chrono::high_resolution_clock::now();
+	vector<size_t> cellStart(numCellsTotal + 1, 0);
+	vector<vector<size_t>> threadCursor(numThreads, vector<size_t>(numCellsTotal));
+	for (uint32_t cellIdx = 0; cellIdx < numCellsTotal; cellIdx++) {
+		size_t cursor = cellStart[cellIdx];
+		for (size_t t = 0; t < numThreads; t++) {
+			threadCursor[t][cellIdx] = cursor;
+			cursor += threadOutputs[t].cellCounts[cellIdx];
+		}
+		cellStart[cellIdx + 1] = cursor;
+	}
+	const size_t numClippedTriangles = cellStart[numCellsTotal];
+	vector<glm::vec3> sortedVert(numClippedTriangles * 3);
+	vector<uint32_t> sortedPrimitiveId(numClippedTriangles);
+	runThreads(numThreads, [&](size_t, size_t begin, size_t end) {
+		for (size_t t = begin; t < end; t++) {
+			ClippedTriangles& clippedTriangles = threadOutputs[t];
+			vector<size_t>& cursor = threadCursor[t];
+			for (size_t i = 0; i < clippedTriangles.cellIdx.size(); i++) {
+				const size_t dst = cursor[clippedTriangles.cellIdx[i]]++;
+				std::copy(&clippedTriangles.vert[i * 3], &clippedTriangles.vert[i * 3] + 3, &sortedVert[dst * 3]);
+				sortedPrimitiveId[dst] = clippedTriangles.primitiveId[i];
 			}
+			clippedTriangles = ClippedTriangles();
 		}
-		primitiveId++;
-		int percent = static_cast<int>(std::floor((i + 1) * 100.0f / indexBuffer.size()));
-		if (percent != last_percent) {
-			cout << "\rprogress: " << percent << "% " << flush;
-			last_percent = percent;
+	});
+
+	// index every cell, the vertex table and scratch vertices of a thread are reused from cell to cell
+	runThreads(numCellsTotal, [&](size_t, size_t begin, size_t end) {
+		CellVertexTable vertexTable;
+		vector<glm::vec3> cellVert;
+		for (size_t cellIdx = begin; cellIdx < end; cellIdx++) {
+			const size_t first = cellStart[cellIdx], count = cellStart[cellIdx + 1] - first;
+			if (count == 0) continue;
+
+			vertexTable.reset(count * 3);
+			cellVert.clear();
+			vector<uint32_t>& cellIndices = h_splittedIdx[cellIdx];
+			cellIndices.resize(count * 3);
+			for (size_t i = 0; i < count * 3; i++) {
+				cellIndices[i] = vertexTable.insert(sortedVert[first * 3 + i], cellVert);
+			}
+			h_splittedVert[cellIdx].assign(cellVert.begin(), cellVert.end());
+			h_splittedPrimitiveId[cellIdx].assign(sortedPrimitiveId.begin() + first, sortedPrimitiveId.begin() + first + count);
 		}
+	});
+	auto endTime = std::chrono::high_resolution_clock::now();
+
+	splitStats.numTriangles = numTriangles;
+	splitStats.numThreads = static_cast<uint32_t>(numThreads);
+	splitStats.cellsClipped = cellsClipped;
+	splitStats.cellsAccepted = cellsAccepted;
+	splitStats.clipTimeMs = std::chrono::duration<double, std::milli>(clipTime - startTime).count();
+	splitStats.indexTimeMs = std::chrono::duration<double, std::milli>(endTime - clipTime).count();
+	splitStats.numClippedTriangles = numClippedTriangles;
+	splitStats.numCellsUsed = 0;
+	splitStats.maxCellTriangles = 0;
+	for (uint32_t cellIdx = 0; cellIdx < numCellsTotal; cellIdx++) {
+		const size_t count = cellStart[cellIdx + 1] - cellStart[cellIdx];
+		if (count > 0) splitStats.numCellsUsed++;
+		splitStats.maxCellTriangles = std::max(splitStats.maxCellTriangles, count);
 	}
+	cout << "Split " << numTriangles << " triangles into " << numCellsTotal << " cells in " << splitStats.clipTimeMs + splitStats.indexTimeMs << "ms (clip "
+		<< splitStats.clipTimeMs << "ms, index " << splitStats.indexTimeMs << "ms, " << numThreads << " threads, "
+		<< splitStats.cellsClipped << " triangle/cell clips, " << splitStats.cellsAccepted << " inside their cell)\n";
+	cout << (adaptivePartition ? "Adaptive" : "Uniform") << " partition: " << splitStats.numCellsUsed << " BLASes, " << numClippedTriangles << " triangles after clipping (+"
+		<< (numTriangles > 0 ? 100.0 * (double(numClippedTriangles) - double(numTriangles)) / double(numTriangles) : 0.0) << "%), "
+		<< (splitStats.numCellsUsed > 0 ? numClippedTriangles / splitStats.numCellsUsed : 0) << " avg / " << splitStats.maxCellTriangles << " max triangles per BLAS";
+	if (adaptivePartition) cout << ", depth " << splitStats.partitionDepth << ", built in " << splitStats.partitionTimeMs << "ms";
 	cout << "\n";
 }
 
+/*
+* Adaptive cells: binary split of the scene bounds chosen with binned SAH over the triangle bounds, where a triangle
+* straddling the plane counts on both sides since it is clipped into both. A node stops at trianglesPerCell or when
+* no plane reduces its larger side, so dense regions get small cells and empty space is not split into many cells
+*/
+uint32_t SplitBLAS::buildAdaptiveCells(const std::vector<glm::vec3>& vertexBuffer, const std::vector<uint32_t>& indexBuffer) {
+	const int numBins = 32;
+	const uint32_t maxDepth = 32;
+	const size_t numTriangles = indexBuffer.size() / 3;
+
+	vector<glm::vec3> triMinPos(numTriangles), triMaxPos(numTriangles);
+	for (size_t t = 0; t < numTriangles; t++) {
+		const glm::vec3& v0 = vertexBuffer[indexBuffer[t * 3]];
+		const glm::vec3& v1 = vertexBuffer[indexBuffer[t * 3 + 1]];
+		const glm::vec3& v2 = vertexBuffer[indexBuffer[t * 3 + 2]];
+		triMinPos[t] = glm::min(glm::min(v0, v1), v2);
+		triMaxPos[t] = glm::max(glm::max(v0, v1), v2);
+	}
+	auto halfArea = [](const glm::vec3& extent) { return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x; };
+
+	partitionNodes.clear();
+	partitionNodes.push_back({ minPos, maxPos });
+	uint32_t numLeaves = 0;
+	splitStats.partitionDepth = 0;
+
+	std::function<void(uint32_t, vector<uint32_t>&, uint32_t)> splitNode = [&](uint32_t nodeIdx, vector<uint32_t>& triangles, uint32_t depth) {
+		const glm::vec3 boxMin = partitionNodes[nodeIdx].boxMin;
+		const glm::vec3 boxMax = partitionNodes[nodeIdx].boxMax;
+		const glm::vec3 extent = boxMax - boxMin;
+		splitStats.partitionDepth = std::max(splitStats.partitionDepth, depth);
+
+		int bestAxis = -1;
+		float bestPlane = 0.0f;
+		float bestCost = FLT_MAX;
+		if (triangles.size() > trianglesPerCell && depth < maxDepth) {
+			for (int axis = 0; axis < 3; axis++) {
+				if (extent[axis] <= SCENE_EPSILON) continue;
+				const float binWidth = extent[axis] / numBins;
+				size_t startCount[numBins] = {};
+				size_t endCount[numBins] = {};
+				for (uint32_t t : triangles) {
+					startCount[glm::clamp(static_cast<int>((triMinPos[t][axis] - boxMin[axis]) / binWidth), 0, numBins - 1)]++;
+					endCount[glm::clamp(static_cast<int>((triMaxPos[t][axis] - boxMin[axis]) / binWidth), 0, numBins - 1)]++;
+				}
+				size_t leftCount[numBins];
+				for (int b = 0; b < numBins; b++) leftCount[b] = startCount[b] + (b > 0 ? leftCount[b - 1] : 0);
+
+				size_t rightCount = 0;
+				for (int b = numBins - 2; b >= 0; b--) {
+					rightCount += endCount[b + 1];
+					const float plane = boxMin[axis] + (b + 1) * binWidth;
+					glm::vec3 leftExtent = extent, rightExtent = extent;
+					leftExtent[axis] = plane - boxMin[axis];
+					rightExtent[axis] = boxMax[axis] - plane;
+					const float cost = halfArea(leftExtent) * leftCount[b] + halfArea(rightExtent) * rightCount;
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestAxis = axis;
+						bestPlane = plane;
+					}
+				}
+			}
+		}
+
+		vector<uint32_t> leftTriangles, rightTriangles;
+		if (bestAxis >= 0) {
+			// same inclusive overlap test as the clipping loop
+			for (uint32_t t : triangles) {
+				if (triMinPos[t][bestAxis] <= bestPlane) leftTriangles.push_back(t);
+				if (triMaxPos[t][bestAxis] >= bestPlane) rightTriangles.push_back(t);
+			}
+		}
+		if (bestAxis < 0 || std::max(leftTriangles.size(), rightTriangles.size()) >= triangles.size()) {
+			partitionNodes[nodeIdx].cellIdx = numLeaves++;
+			return;
+		}
+		triangles = vector<uint32_t>();
+
+		const uint32_t children = static_cast<uint32_t>(partitionNodes.size());
+		partitionNodes[nodeIdx].children = children;
+		PartitionNode left{ boxMin, boxMax }, right{ boxMin, boxMax };
+		left.boxMax[bestAxis] = bestPlane;
+		right.boxMin[bestAxis] = bestPlane;
+		partitionNodes.push_back(left);
+		partitionNodes.push_back(right);
+		splitNode(children, leftTriangles, depth + 1);
+		splitNode(children + 1, rightTriangles, depth + 1);
+	};
+
+	vector<uint32_t> triangles(numTriangles);
+	std::iota(triangles.begin(), triangles.end(), 0u);
+	splitNode(0, triangles, 0);
+	return numLeaves;
+}
+
+bool SplitBLAS::checkClipping(const vector<float>& hostVertices, const vector<uint32_t>& hostIndices, uint32_t cellsPerLongestAxis, int repeats) {
+	/* triangle/cell pairs of the uniform grid, the cells overlapping the triangle bounds */
+	glm::vec3 sceneMin = glm::vec3(FLT_MAX);
+	glm::vec3 sceneMax = glm::vec3(-FLT_MAX);
+	for (size_t i = 0; i + 2 < hostVertices.size(); i += 3) {
+		const glm::vec3 vertex(hostVertices[i], hostVertices[i + 1], hostVertices[i + 2]);
+		sceneMin = glm::min(sceneMin, vertex);
+		sceneMax = glm::max(sceneMax, vertex);
+	}
+	sceneMin -= SCENE_EPSILON;
+	sceneMax += SCENE_EPSILON;
+	const int cellsPerAxis = static_cast<int>(std::max(cellsPerLongestAxis, 1u));
+	const glm::vec3 sceneSize = sceneMax - sceneMin;
+	const float gridSize = glm::max(glm::max(sceneSize.x, sceneSize.y), sceneSize.z) / cellsPerAxis;
+	const glm::ivec3 maxCell = glm::ivec3(glm::ceil(sceneSize / gridSize)) - 1;
+
+	const size_t numTriangles = hostIndices.size() / 3;
+	vector<glm::vec3> triangles(numTriangles * 3);
+	vector<size_t> pairStart(numTriangles + 1, 0);
+	vector<AABB_Triangle_Clipping::_AABB> cells;
+	for (size_t t = 0; t < numTriangles; t++) {
+		for (int v = 0; v < 3; v++) {
+			const uint32_t idx = hostIndices[t * 3 + v];
+			triangles[t * 3 + v] = glm::vec3(hostVertices[idx * 3], hostVertices[idx * 3 + 1], hostVertices[idx * 3 + 2]);
+		}
+		const glm::vec3 triMin = glm::min(glm::min(triangles[t * 3], triangles[t * 3 + 1]), triangles[t * 3 + 2]);
+		const glm::vec3 triMax = glm::max(glm::max(triangles[t * 3], triangles[t * 3 + 1]), triangles[t * 3 + 2]);
+		const glm::ivec3 cellMin = glm::clamp(glm::ivec3(glm::floor((triMin - sceneMin) / gridSize)), glm::ivec3(0), maxCell);
+		const glm::ivec3 cellMax = glm::clamp(glm::ivec3(glm::floor((triMax - sceneMin) / gridSize)), glm::ivec3(0), maxCell);
+		for (int k = cellMin.z; k <= cellMax.z; ++k)
+			for (int j = cellMin.y; j <= cellMax.y; ++j)
+				for (int i = cellMin.x; i <= cellMax.x; ++i)
+					cells.push_back({
+						sceneMin.x + i * gridSize, sceneMin.y + j * gridSize, sceneMin.z + k * gridSize,
+						sceneMin.x + (i + 1) * gridSize, sceneMin.y + (j + 1) * gridSize, sceneMin.z + (k + 1) * gridSize
+					});
+		pairStart[t + 1] = cells.size();
+	}
+	cout << numTriangles << " triangles, " << cells.size() << " triangle/cell pairs, " << cellsPerAxis << " cells per longest axis\n";
+
+	/* the SIMD separating axis test must agree exactly with the clipper: an outside pair clips to nothing,
+	   an inside pair clips to the unchanged triangle */
+	AABB_Triangle_Clipping::_Polygon polygon;
+	AABB_Triangle_Clipping::_AABBBatch batch;
+	uint8_t overlap[AABB_Triangle_Clipping::_AABB_BATCH_SIZE];
+	size_t numOutside = 0, numInside = 0, numMismatches = 0;
+	for (size_t t = 0; t < numTriangles; t++) {
+		const glm::vec3* tri = &triangles[t * 3];
+		const AABB_Triangle_Clipping::_SATTriangle satTri(tri);
+		for (size_t first = pairStart[t]; first < pairStart[t + 1]; first += AABB_Triangle_Clipping::_AABB_BATCH_SIZE) {
+			batch.size = 0;
+			for (size_t c = first; c < std::min(pairStart[t + 1], first + AABB_Triangle_Clipping::_AABB_BATCH_SIZE); c++) batch.push_back(cells[c]);
+			AABB_Triangle_Clipping::_classify_triangle_against_AABBs(satTri, batch, overlap);
+			for (int lane = 0; lane < batch.size; lane++) {
+				if (overlap[lane] == AABB_Triangle_Clipping::_CROSSES) continue;
+				AABB_Triangle_Clipping::_clip_triangle_against_AABB(tri, cells[first + lane], polygon);
+				bool mismatch;
+				if (overlap[lane] == AABB_Triangle_Clipping::_OUTSIDE) {
+					numOutside++;
+					mismatch = polygon.size >= 3;
+				}
+				else {
+					numInside++;
+					mismatch = polygon.size != 3 || polygon.v[0] != tri[0] || polygon.v[1] != tri[1] || polygon.v[2] != tri[2];
+				}
+				if (mismatch && numMismatches++ < 10) {
+					cout << "Mismatch: triangle " << t << ", cell " << (first + lane - pairStart[t]) << " classified "
+						<< (overlap[lane] == AABB_Triangle_Clipping::_OUTSIDE ? "outside" : "inside") << ", clipped to " << polygon.size << " vertices\n";
+				}
+			}
+		}
+	}
+	cout << numOutside << " outside, " << numInside << " inside, " << numMismatches << " mismatches\n";
+
+	/* the scalar clip of every pair against the classification of the split loop */
+	for (int repeat = 0; repeat < repeats; repeat++) {
+		size_t scalarVertices = 0, batchedVertices = 0;
+		auto scalarStartTime = std::chrono::high_resolution_clock::now();
+		for (size_t t = 0; t < numTriangles; t++) {
+			for (size_t c = pairStart[t]; c < pairStart[t + 1]; c++) {
+				AABB_Triangle_Clipping::_clip_triangle_against_AABB(&triangles[t * 3], cells[c], polygon);
+				scalarVertices += polygon.size;
+			}
+		}
+		auto batchedStartTime = std::chrono::high_resolution_clock::now();
+		for (size_t t = 0; t < numTriangles; t++) {
+			const AABB_Triangle_Clipping::_SATTriangle satTri(&triangles[t * 3]);
+			for (size_t first = pairStart[t]; first < pairStart[t + 1]; first += AABB_Triangle_Clipping::_AABB_BATCH_SIZE) {
+				batch.size = 0;
+				for (size_t c = first; c < std::min(pairStart[t + 1], first + AABB_Triangle_Clipping::_AABB_BATCH_SIZE); c++) batch.push_back(cells[c]);
+				AABB_Triangle_Clipping::_classify_triangle_against_AABBs(satTri, batch, overlap);
+				for (int lane = 0; lane < batch.size; lane++) {
+					if (overlap[lane] == AABB_Triangle_Clipping::_OUTSIDE) continue;
+					if (overlap[lane] == AABB_Triangle_Clipping::_INSIDE) {
+						batchedVertices += 3;
+						continue;
+					}
+					AABB_Triangle_Clipping::_clip_triangle_against_AABB(&triangles[t * 3], cells[first + lane], polygon);
+					batchedVertices += polygon.size;
+				}
+			}
+		}
+		auto endTime = std::chrono::high_resolution_clock::now();
+		cout << "scalar clip " << std::chrono::duration<double, std::milli>(batchedStartTime - scalarStartTime).count() << "ms, "
+			<< "separating axis batches + clip " << std::chrono::duration<double, std::milli>(endTime - batchedStartTime).count() << "ms ("
+			<< scalarVertices << " / " << batchedVertices << " polygon vertices)\n";
+	}
+	return numMismatches == 0;
+}
+
 void SplitBLAS::copyToDevice(VkQueue& queue) {
 	struct StagingBuffer {
 		VkBuffer buffer;
@@ -199,6 +615,8 @@ void SplitBLAS::copyToDevice(VkQueue& queue) {
 	int totalIndexSize = 0;
 	int totalPrimitiveId = 0;
 	int totalPrimitiveIdSize = 0;
+	blasBoundsMin.clear();
+	blasBoundsMax.clear();
 	for (int i = 0; i < numCellsTotal; i++) {
 		size_t vertexBufferSize = h_splittedVertFP[i].size() * sizeof(float);
 		size_t indexBufferSize = h_splittedIdx[i].size() * sizeof(uint32_t);
@@ -286,6 +704,14 @@ void SplitBLAS::copyToDevice(VkQueue& queue) {
 		d_splittedIndices.push_back(cellIndices);
 		d_splittedPrimitiveIds.push_back(cellPrimitiveIds);
 
+		glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+		for (const glm::vec3& vertex : h_splittedVert[i]) {
+			boundsMin = glm::min(boundsMin, vertex);
+			boundsMax = glm::max(boundsMax, vertex);
+		}
+		blasBoundsMin.push_back(boundsMin);
+		blasBoundsMax.push_back(boundsMax);
+
 		vulkanDevice->flushCommandBuffer(copyCmd, queue, true);
 
 		vkDestroyBuffer(vulkanDevice->logicalDevice, vertexStaging.buffer, nullptr);
@@ -444,6 +870,7 @@ void SplitBLAS::createBLAS(int cellIdx, VkQueue& queue) {
 	accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
 	accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
 	accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	if (compaction) accelerationStructureBuildGeometryInfo.flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
 	accelerationStructureBuildGeometryInfo.geometryCount = 1;
 	accelerationStructureBuildGeometryInfo.pGeometries = &geometry;
 
@@ -507,44 +934,249 @@ void SplitBLAS::createBLASes(VkQueue& queue) {
 		&tMat));
 
 	splittedBLAS.resize(d_splittedIndices.size());
+	blasSize = 0;
+	if (batchedBuild) {
+		createBLASesBatched(queue);
+		return;
+	}
+	blasBuildBatches = static_cast<uint32_t>(d_splittedIndices.size());
 	for (int cellIdx = 0; cellIdx < d_splittedIndices.size(); cellIdx++) {
 		createBLAS(cellIdx, queue);
 	}
 }
 
+/*
+* All BLASes recorded in one command buffer with a single wait. Build sizes are queried up front and the scratch
+* memory is suballocated from one pool: the builds whose scratch fits in the pool go into the same
+* vkCmdBuildAccelerationStructuresKHR call, the next batch reuses the pool after a barrier.
+* The timestamp pair of the first cell of a batch brackets the whole batch, the other pairs of the batch are written
+* back to back so that printASBuildInfo still adds up to the BLAS build time.
+*/
+void SplitBLAS::createBLASesBatched(VkQueue& queue) {
+	const size_t numBLAS = d_splittedIndices.size();
+	auto alignUp = [this](VkDeviceSize value) { return (value + scratchOffsetAlignment - 1) / scratchOffsetAlignment * scratchOffsetAlignment; };
+
+	vector<VkAccelerationStructureGeometryKHR> geometries(numBLAS);
+	vector<VkAccelerationStructureBuildGeometryInfoKHR> buildGeometryInfos(numBLAS);
+	vector<VkAccelerationStructureBuildRangeInfoKHR> buildRangeInfos(numBLAS);
+	vector<VkDeviceSize> scratchSizes(numBLAS);
+	VkDeviceOrHostAddressConstKHR transformBufferDeviceAddress{};
+	transformBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(tMatBuffer.buffer);
+	VkDeviceSize totalScratchSize = 0, maxScratchSize = 0;
+
+	for (size_t cellIdx = 0; cellIdx < numBLAS; cellIdx++) {
+		VkAccelerationStructureGeometryKHR& geometry = geometries[cellIdx];
+		geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+		geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+		geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+		geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+		geometry.geometry.triangles.vertexData.deviceAddress = getBufferDeviceAddress(d_splittedVertices[cellIdx].buffer.buffer);
+		geometry.geometry.triangles.maxVertex = d_splittedVertices[cellIdx].count;
+		geometry.geometry.triangles.vertexStride = sizeof(float) * 3;
+		geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
+		geometry.geometry.triangles.indexData.deviceAddress = getBufferDeviceAddress(d_splittedIndices[cellIdx].buffer.buffer);
+		geometry.geometry.triangles.transformData = transformBufferDeviceAddress;
+
+		VkAccelerationStructureBuildRangeInfoKHR& buildRangeInfo = buildRangeInfos[cellIdx];
+		buildRangeInfo.firstVertex = 0;
+		buildRangeInfo.primitiveOffset = 0;
+		buildRangeInfo.primitiveCount = d_splittedIndices[cellIdx].count / 3;
+		buildRangeInfo.transformOffset = 0;
+
+		VkAccelerationStructureBuildGeometryInfoKHR& buildGeometryInfo = buildGeometryInfos[cellIdx];
+		buildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+		buildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+		buildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+		if (compaction) buildGeometryInfo.flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+		buildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+		buildGeometryInfo.geometryCount = 1;
+		buildGeometryInfo.pGeometries = &geometry;
+
+		VkAccelerationStructureBuildSizesInfoKHR buildSizesInfo{};
+		buildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+		vkGetAccelerationStructureBuildSizesKHR(
+			vulkanDevice->logicalDevice,
+			VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+			&buildGeometryInfo,
+			&buildRangeInfo.primitiveCount,
+			&buildSizesInfo);
+
+		createAccelerationStructureBuffer(splittedBLAS[cellIdx], buildSizesInfo);
+
+		VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo{};
+		accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+		accelerationStructureCreateInfo.buffer = splittedBLAS[cellIdx].buffer;
+		accelerationStructureCreateInfo.size = buildSizesInfo.accelerationStructureSize;
+		accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+		vkCreateAccelerationStructureKHR(vulkanDevice->logicalDevice, &accelerationStructureCreateInfo, nullptr, &splittedBLAS[cellIdx].handle);
+		buildGeometryInfo.dstAccelerationStructure = splittedBLAS[cellIdx].handle;
+
+		// BLAS Size
+		blasSize += buildSizesInfo.accelerationStructureSize;
+		scratchSizes[cellIdx] = alignUp(buildSizesInfo.buildScratchSize);
+		totalScratchSize += scratchSizes[cellIdx];
+		maxScratchSize = std::max(maxScratchSize, scratchSizes[cellIdx]);
+	}
+
+	// the pool holds at least the largest build, extra alignment for the base address of the buffer
+	const VkDeviceSize poolSize = std::max(maxScratchSize, std::min(totalScratchSize, scratchPoolBudget));
+	ScratchBuffer scratchPool = createScratchBuffer(poolSize + scratchOffsetAlignment);
+	const uint64_t scratchBase = alignUp(scratchPool.deviceAddress);
+
+	VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	vector<const VkAccelerationStructureBuildRangeInfoKHR*> pBuildRangeInfos(numBLAS);
+	blasBuildBatches = 0;
+	for (size_t first = 0; first < numBLAS;) {
+		size_t last = first;
+		VkDeviceSize scratchOffset = 0;
+		for (; last < numBLAS && scratchOffset + scratchSizes[last] <= poolSize; last++) {
+			buildGeometryInfos[last].scratchData.deviceAddress = scratchBase + scratchOffset;
+			pBuildRangeInfos[last] = &buildRangeInfos[last];
+			scratchOffset += scratchSizes[last];
+		}
+
+		if (first > 0) {
+			// the previous batch is done with the scratch pool
+			VkMemoryBarrier barrier{};
+			barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+			barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+				0, 1, &barrier, 0, nullptr, 0, nullptr);
+		}
+
+		// Timestamp: BLAS build start
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, ASBuildTimeStampQueryPool, static_cast<uint32_t>(2 * first));
+		vkCmdBuildAccelerationStructuresKHR(
+			commandBuffer,
+			static_cast<uint32_t>(last - first),
+			&buildGeometryInfos[first],
+			&pBuildRangeInfos[first]);
+		// Timestamp: BLAS build end
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, ASBuildTimeStampQueryPool, static_cast<uint32_t>(2 * first + 1));
+		for (size_t cellIdx = first + 1; cellIdx < last; cellIdx++) {
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, ASBuildTimeStampQueryPool, static_cast<uint32_t>(2 * cellIdx));
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, ASBuildTimeStampQueryPool, static_cast<uint32_t>(2 * cellIdx + 1));
+		}
+		blasBuildBatches++;
+		first = last;
+	}
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+	for (size_t cellIdx = 0; cellIdx < numBLAS; cellIdx++) {
+		VkAccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo{};
+		accelerationDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+		accelerationDeviceAddressInfo.accelerationStructure = splittedBLAS[cellIdx].handle;
+		splittedBLAS[cellIdx].deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(vulkanDevice->logicalDevice, &accelerationDeviceAddressInfo);
+	}
+	deleteScratchBuffer(scratchPool);
+
+	std::cout << "Built " << numBLAS << " BLASes in " << blasBuildBatches << " batched build(s), scratch pool " << (poolSize >> 20) << " MB (" << (totalScratchSize >> 20) << " MB unpooled)\n";
+}
+
+/*
+* Compacted sizes of all BLASes are queried together, then every BLAS is copied into a buffer of that size with
+* one submission and the build-sized buffers are freed. blasSize reports the compacted total afterwards
+*/
+void SplitBLAS::compactBLASes(VkQueue& queue) {
+	const uint32_t numBLAS = static_cast<uint32_t>(splittedBLAS.size());
+	if (numBLAS == 0) return;
+
+	vector<VkAccelerationStructureKHR> handles(numBLAS);
+	for (uint32_t i = 0; i < numBLAS; i++) handles[i] = splittedBLAS[i].handle;
+
+	VkQueryPool compactedSizeQueryPool;
+	VkQueryPoolCreateInfo queryPoolInfo{};
+	queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryPoolInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+	queryPoolInfo.queryCount = numBLAS;
+	VK_CHECK_RESULT(vkCreateQueryPool(vulkanDevice->logicalDevice, &queryPoolInfo, nullptr, &compactedSizeQueryPool));
+
+	VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	vkCmdResetQueryPool(commandBuffer, compactedSizeQueryPool, 0, numBLAS);
+	vkCmdWriteAccelerationStructuresPropertiesKHR(commandBuffer, numBLAS, handles.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, compactedSizeQueryPool, 0);
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+	vector<VkDeviceSize> compactedSizes(numBLAS);
+	VK_CHECK_RESULT(vkGetQueryPoolResults(vulkanDevice->logicalDevice, compactedSizeQueryPool, 0, numBLAS, numBLAS * sizeof(VkDeviceSize), compactedSizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+	vkDestroyQueryPool(vulkanDevice->logicalDevice, compactedSizeQueryPool, nullptr);
+
+	vector<AccelerationStructure> compactedBLAS(numBLAS);
+	commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	for (uint32_t i = 0; i < numBLAS; i++) {
+		VkAccelerationStructureBuildSizesInfoKHR compactedSizeInfo{};
+		compactedSizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+		compactedSizeInfo.accelerationStructureSize = compactedSizes[i];
+		createAccelerationStructureBuffer(compactedBLAS[i], compactedSizeInfo);
+
+		VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo{};
+		accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+		accelerationStructureCreateInfo.buffer = compactedBLAS[i].buffer;
+		accelerationStructureCreateInfo.size = compactedSizes[i];
+		accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+		VK_CHECK_RESULT(vkCreateAccelerationStructureKHR(vulkanDevice->logicalDevice, &accelerationStructureCreateInfo, nullptr, &compactedBLAS[i].handle));
+
+		VkCopyAccelerationStructureInfoKHR copyInfo{};
+		copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+		copyInfo.src = splittedBLAS[i].handle;
+		copyInfo.dst = compactedBLAS[i].handle;
+		copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+		vkCmdCopyAccelerationStructureKHR(commandBuffer, &copyInfo);
+	}
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+	blasBuildSize = blasSize;
+	blasSize = 0;
+	for (uint32_t i = 0; i < numBLAS; i++) {
+		vkDestroyAccelerationStructureKHR(vulkanDevice->logicalDevice, splittedBLAS[i].handle, nullptr);
+		splittedBLAS[i].destroy(vulkanDevice->logicalDevice);
+		splittedBLAS[i] = compactedBLAS[i];
+
+		VkAccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo{};
+		accelerationDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+		accelerationDeviceAddressInfo.accelerationStructure = splittedBLAS[i].handle;
+		splittedBLAS[i].deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(vulkanDevice->logicalDevice, &accelerationDeviceAddressInfo);
+		blasSize += compactedSizes[i];
+	}
+}
+
+VkAccelerationStructureGeometryKHR SplitBLAS::tlasGeometry(uint64_t instancesAddress) const {
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry{};
+	accelerationStructureGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+	accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+	accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+	accelerationStructureGeometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+	accelerationStructureGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
+	accelerationStructureGeometry.geometry.instances.data.deviceAddress = instancesAddress;
+	return accelerationStructureGeometry;
+}
+
 void SplitBLAS::createTLAS(VkQueue& queue) {
-	vector<VkAccelerationStructureInstanceKHR> instances;
+	// the custom index is the BLAS index (primitive ids of anyhit.rahit), it stays valid when cullCells leaves instances out
+	tlasInstances.clear();
 	for (int i = 0; i < d_splittedIndices.size(); i++) {
 		VkAccelerationStructureInstanceKHR instance{};
 		instance.transform = tMat;
-		instance.instanceCustomIndex = instances.size();
+		instance.instanceCustomIndex = tlasInstances.size();
 		instance.mask = 0xFF;
 		instance.instanceShaderBindingTableRecordOffset = 0;
 		instance.flags = VK_FLAGS_NONE;
 		//instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
 		instance.accelerationStructureReference = splittedBLAS[i].deviceAddress;
-		instances.push_back(instance);
+		tlasInstances.push_back(instance);
 	}
+	visibleBLASes.resize(tlasInstances.size());
+	for (uint32_t i = 0; i < visibleBLASes.size(); i++) visibleBLASes[i] = i;
 
-	vks::Buffer instancesBuffer;
 	VK_CHECK_RESULT(vulkanDevice->createBuffer(
 		VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		&instancesBuffer,
-		instances.size() * sizeof(VkAccelerationStructureInstanceKHR),
-		instances.data())
+		&tlasInstancesBuffer,
+		std::max<size_t>(1, tlasInstances.size()) * sizeof(VkAccelerationStructureInstanceKHR),
+		tlasInstances.data())
 	);
 
-	VkDeviceOrHostAddressConstKHR instanceDataDeviceAddress{};
-	instanceDataDeviceAddress.deviceAddress = getBufferDeviceAddress(instancesBuffer.buffer);
-
-	VkAccelerationStructureGeometryKHR accelerationStructureGeometry{};
-	accelerationStructureGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-	accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-	accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-	accelerationStructureGeometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
-	accelerationStructureGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
-	accelerationStructureGeometry.geometry.instances.data = instanceDataDeviceAddress;
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = tlasGeometry(getBufferDeviceAddress(tlasInstancesBuffer.buffer));
 
 	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo{};
 	accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
@@ -553,7 +1185,8 @@ void SplitBLAS::createTLAS(VkQueue& queue) {
 	accelerationStructureBuildGeometryInfo.geometryCount = 1;
 	accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
 
-	uint32_t primitive_count = instances.size();
+	// sized for every instance, the culled builds have fewer
+	uint32_t primitive_count = tlasInstances.size();
 	VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo{};
 	accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
 	vkGetAccelerationStructureBuildSizesKHR(
@@ -572,7 +1205,7 @@ void SplitBLAS::createTLAS(VkQueue& queue) {
 	accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
 	vkCreateAccelerationStructureKHR(vulkanDevice->logicalDevice, &accelerationStructureCreateInfo, nullptr, &splittedTLAS.handle);
 
-	ScratchBuffer scratchBuffer = createScratchBuffer(accelerationStructureBuildSizesInfo.buildScratchSize);
+	tlasScratchBuffer = createScratchBuffer(accelerationStructureBuildSizesInfo.buildScratchSize);
 
 	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo{};
 	accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
@@ -582,7 +1215,7 @@ void SplitBLAS::createTLAS(VkQueue& queue) {
 	accelerationBuildGeometryInfo.dstAccelerationStructure = splittedTLAS.handle;
 	accelerationBuildGeometryInfo.geometryCount = 1;
 	accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-	accelerationBuildGeometryInfo.scratchData.deviceAddress = scratchBuffer.deviceAddress;
+	accelerationBuildGeometryInfo.scratchData.deviceAddress = tlasScratchBuffer.deviceAddress;
 
 	VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo{};
 	accelerationStructureBuildRangeInfo.primitiveCount = primitive_count;
@@ -606,12 +1239,44 @@ void SplitBLAS::createTLAS(VkQueue& queue) {
 	// Timestamp: TLAS build end
 	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, ASBuildTimeStampQueryPool, ASBuildTimeStamps.size() - 1);
 	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+}
 
-	VkAccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo{};
-	accelerationDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-	accelerationDeviceAddressInfo.accelerationStructure = splittedTLAS.handle;
-	deleteScratchBuffer(scratchBuffer);
-	instancesBuffer.destroy();
+bool SplitBLAS::cullCells(vks::Frustum& frustum, VkAccelerationStructureInstanceKHR* instances) {
+	auto startTime = std::chrono::high_resolution_clock::now();
+	// side and near planes, the far plane does not clip the rays
+	vector<uint32_t> visible;
+	visible.reserve(tlasInstances.size());
+	for (uint32_t i = 0; i < tlasInstances.size(); i++) {
+		if (frustum.checkBox(blasBoundsMin[i], blasBoundsMax[i], 5)) visible.push_back(i);
+	}
+	culledCells = static_cast<uint32_t>(tlasInstances.size() - visible.size());
+	if (visible == visibleBLASes) {
+		return false;
+	}
+	visibleBLASes.swap(visible);
+	for (size_t i = 0; i < visibleBLASes.size(); i++) {
+		instances[i] = tlasInstances[visibleBLASes[i]];
+	}
+	cullTimeMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+	return true;
+}
+
+void SplitBLAS::cmdBuildCulledTLAS(VkCommandBuffer commandBuffer, uint64_t instancesAddress) {
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = tlasGeometry(instancesAddress);
+	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo{};
+	accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+	accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+	accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+	accelerationBuildGeometryInfo.dstAccelerationStructure = splittedTLAS.handle;
+	accelerationBuildGeometryInfo.geometryCount = 1;
+	accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
+	accelerationBuildGeometryInfo.scratchData.deviceAddress = tlasScratchBuffer.deviceAddress;
+
+	VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo{};
+	accelerationStructureBuildRangeInfo.primitiveCount = static_cast<uint32_t>(visibleBLASes.size());
+	const VkAccelerationStructureBuildRangeInfoKHR* pBuildRangeInfo = &accelerationStructureBuildRangeInfo;
+	vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &accelerationBuildGeometryInfo, &pBuildRangeInfo);
 }
 
 void SplitBLAS::destroyAS() {
@@ -629,15 +1294,22 @@ void SplitBLAS::destroyAS() {
 	d_splittedPrimitiveIds.clear();
 	d_splittedPrimitiveIdsDeviceAddress.destroy();
 	for (int i = 0; i < splittedBLAS.size(); i++) {
+		vkDestroyAccelerationStructureKHR(vulkanDevice->logicalDevice, splittedBLAS[i].handle, nullptr);
 		splittedBLAS[i].destroy(vulkanDevice->logicalDevice);
 	}
 	splittedBLAS.clear();
+	vkDestroyAccelerationStructureKHR(vulkanDevice->logicalDevice, splittedTLAS.handle, nullptr);
 	splittedTLAS.destroy(vulkanDevice->logicalDevice);
+	splittedTLAS = {};
+	tlasInstancesBuffer.destroy();
+	tlasInstancesBuffer = {};
+	deleteScratchBuffer(tlasScratchBuffer);
+	tlasScratchBuffer = {};
+	tlasInstances.clear();
+	visibleBLASes.clear();
 	tMatBuffer.destroy();
 }
 
-uint32_t cellsPerLongestAxis;
-
 vector<Attribute> d_splittedVertices;
 vector<Attribute> d_splittedIndices;
 vector<Attribute> d_splittedPrimitiveIds;
@@ -660,6 +1332,8 @@ SplitBLAS::~SplitBLAS() {
 		splittedBLAS[i].destroy(vulkanDevice->logicalDevice);
 	}
 	splittedTLAS.destroy(vulkanDevice->logicalDevice);
+	tlasInstancesBuffer.destroy();
+	deleteScratchBuffer(tlasScratchBuffer);
 	tMatBuffer.destroy();
 }
 
@@ -668,38 +1342,212 @@ void SplitBLAS::init(vks::VulkanDevice* device) {
 	this->gaussianCnt = gaussianCnt;
 	vkGetBufferDeviceAddressKHR = reinterpret_cast<PFN_vkGetBufferDeviceAddressKHR>(vkGetDeviceProcAddr(device->logicalDevice, "vkGetBufferDeviceAddressKHR"));
 	vkCmdBuildAccelerationStructuresKHR = reinterpret_cast<PFN_vkCmdBuildAccelerationStructuresKHR>(vkGetDeviceProcAddr(device->logicalDevice, "vkCmdBuildAccelerationStructuresKHR"));
+	vkCmdWriteAccelerationStructuresPropertiesKHR = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(vkGetDeviceProcAddr(device->logicalDevice, "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+	vkCmdCopyAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureKHR>(vkGetDeviceProcAddr(device->logicalDevice, "vkCmdCopyAccelerationStructureKHR"));
 	vkBuildAccelerationStructuresKHR = reinterpret_cast<PFN_vkBuildAccelerationStructuresKHR>(vkGetDeviceProcAddr(device->logicalDevice, "vkBuildAccelerationStructuresKHR"));
 	vkCreateAccelerationStructureKHR = reinterpret_cast<PFN_vkCreateAccelerationStructureKHR>(vkGetDeviceProcAddr(device->logicalDevice, "vkCreateAccelerationStructureKHR"));
 	vkDestroyAccelerationStructureKHR = reinterpret_cast<PFN_vkDestroyAccelerationStructureKHR>(vkGetDeviceProcAddr(device->logicalDevice, "vkDestroyAccelerationStructureKHR"));
 	vkGetAccelerationStructureBuildSizesKHR = reinterpret_cast<PFN_vkGetAccelerationStructureBuildSizesKHR>(vkGetDeviceProcAddr(device->logicalDevice, "vkGetAccelerationStructureBuildSizesKHR"));
 	vkGetAccelerationStructureDeviceAddressKHR = reinterpret_cast<PFN_vkGetAccelerationStructureDeviceAddressKHR>(vkGetDeviceProcAddr(device->logicalDevice, "vkGetAccelerationStructureDeviceAddressKHR"));
+
+	VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties{};
+	accelerationStructureProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+	VkPhysicalDeviceProperties2 deviceProperties2{};
+	deviceProperties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+	deviceProperties2.pNext = &accelerationStructureProperties;
+	vkGetPhysicalDeviceProperties2(device->physicalDevice, &deviceProperties2);
+	scratchOffsetAlignment = std::max<VkDeviceSize>(1, accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment);
 }
 
 void SplitBLAS::splitBlas(vks::Buffer& vertexBuffer, vks::Buffer& indexBuffer, VkQueue& queue) {
 	copyDeviceToHost(vertexBuffer, indexBuffer, queue);
+	splitHostGeometry(queue);
+}
 
+void SplitBLAS::splitBlas(const vector<float>& hostVertices, const vector<uint32_t>& hostIndices, VkQueue& queue) {
+	// geometry built on the host (vk3DGRT::enclosing), no read back
+	vertices = hostVertices;
+	indices = hostIndices;
+	vertCnt = (uint32_t)vertices.size();
+	idxCnt = (uint32_t)indices.size();
+	splitHostGeometry(queue);
+}
+
+void SplitBLAS::splitHostGeometry(VkQueue& queue) {
 	assert(vertices.size() % 3 == 0);
-	vector<glm::vec3> verticesVec3;
-	for (int i = 0; i < vertices.size(); i += 3) {
-		verticesVec3.push_back(glm::vec3(vertices[i], vertices[i + 1], vertices[i + 2]));
+	auto cacheStartTime = std::chrono::high_resolution_clock::now();
+	const uint64_t cacheKey = cacheFile.empty() ? 0 : splitCacheKey();
+	if (!cacheFile.empty() && loadSplitCache(cacheKey)) {
+		splitStats.cacheTimeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - cacheStartTime).count();
+		cout << "Loaded " << splitStats.numCellsUsed << " split cells (" << splitStats.numClippedTriangles << " triangles) from " << cacheFile << " in " << splitStats.cacheTimeMs << "ms\n";
+	}
+	else {
+		const double keyTimeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - cacheStartTime).count();
+		vector<glm::vec3> verticesVec3;
+		verticesVec3.reserve(vertices.size() / 3);
+		for (int i = 0; i < vertices.size(); i += 3) {
+			verticesVec3.push_back(glm::vec3(vertices[i], vertices[i + 1], vertices[i + 2]));
+		}
+		saveGeometries_SBLAS(verticesVec3, indices);
+		splitStats.fromCache = false;
+		splitStats.cacheTimeMs = 0.0;
+		if (!cacheFile.empty()) {
+			auto writeStartTime = std::chrono::high_resolution_clock::now();
+			writeSplitCache(cacheKey);
+			splitStats.cacheTimeMs = keyTimeMs + std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - writeStartTime).count();
+		}
 	}
-	saveGeometries_SBLAS(verticesVec3, indices);
 
-	h_splittedVertFP.resize(numCellsTotal);
+	h_splittedVertFP.assign(numCellsTotal, {});
 	for (int i = 0; i < h_splittedVert.size(); i++) {
-		for (int j = 0; j < h_splittedVert[i].size(); j++) {
-			h_splittedVertFP[i].push_back(h_splittedVert[i][j].x);
-			h_splittedVertFP[i].push_back(h_splittedVert[i][j].y);
-			h_splittedVertFP[i].push_back(h_splittedVert[i][j].z);
-		}
+		const float* cellVertices = reinterpret_cast<const float*>(h_splittedVert[i].data());
+		h_splittedVertFP[i].assign(cellVertices, cellVertices + h_splittedVert[i].size() * 3);
 	}
 
 	copyToDevice(queue);
 	createSplittedPrimitiveIdsBuffer(queue);
 }
 
+/*
+* Split cache: a header, the vertex, index and primitive id counts of every cell, then the data of the cells in order.
+* The key covers the input geometry, which already depends on the model and the kernel parameters, and the split
+* settings, so a file left by another model or setting is split again and overwritten
+*/
+namespace {
+	const char splitCacheMagic[8] = { 'S', 'P', 'L', 'I', 'T', 'B', 'L', 'S' };
+}
+
+bool SplitBLAS::loadSplitCache(uint64_t key) {
+#if defined(__ANDROID__)
+	return false;
+#else
+	vks::MappedFile file;
+	if (!file.open(cacheFile.c_str())) {
+		return false;
+	}
+	CacheHeader header;
+	if (file.size < sizeof(CacheHeader)) {
+		cout << "Split cache " << cacheFile << " is truncated, splitting again\n";
+		return false;
+	}
+	memcpy(&header, file.data, sizeof(CacheHeader));
+	if (memcmp(header.magic, splitCacheMagic, sizeof(splitCacheMagic)) != 0 || header.version != splitCacheVersion) {
+		cout << "Split cache " << cacheFile << " has an unsupported format, splitting again\n";
+		return false;
+	}
+	if (header.key != key) {
+		cout << "Split cache " << cacheFile << " was written for another geometry or split setting, splitting again\n";
+		return false;
+	}
+
+	const uint64_t tableSize = uint64_t(header.numCellsTotal) * 3 * sizeof(uint32_t);
+	if (file.size < sizeof(CacheHeader) + tableSize) {
+		cout << "Split cache " << cacheFile << " is truncated, splitting again\n";
+		return false;
+	}
+	const uint32_t* table = reinterpret_cast<const uint32_t*>(file.data + sizeof(CacheHeader));
+	uint64_t dataSize = 0;
+	for (uint32_t cellIdx = 0; cellIdx < header.numCellsTotal; cellIdx++) {
+		dataSize += (uint64_t(table[cellIdx * 3]) * 3 + table[cellIdx * 3 + 1] + table[cellIdx * 3 + 2]) * sizeof(uint32_t);
+	}
+	if (file.size != sizeof(CacheHeader) + tableSize + dataSize) {
+		cout << "Split cache " << cacheFile << " is truncated, splitting again\n";
+		return false;
+	}
+
+	vector<uint64_t> checksums;
+	checksums.reserve(1 + size_t(header.numCellsTotal) * 3);
+	checksums.push_back(vk3DGRT::container::checksum(table, tableSize));
+	h_splittedVert.assign(header.numCellsTotal, {});
+	h_splittedIdx.assign(header.numCellsTotal, {});
+	h_splittedPrimitiveId.assign(header.numCellsTotal, {});
+	const char* cellData = file.data + sizeof(CacheHeader) + tableSize;
+	for (uint32_t cellIdx = 0; cellIdx < header.numCellsTotal; cellIdx++) {
+		const size_t vertexSize = size_t(table[cellIdx * 3]) * sizeof(glm::vec3);
+		const size_t indexSize = size_t(table[cellIdx * 3 + 1]) * sizeof(uint32_t);
+		const size_t primitiveIdSize = size_t(table[cellIdx * 3 + 2]) * sizeof(uint32_t);
+		checksums.push_back(vk3DGRT::container::checksum(cellData, vertexSize));
+		h_splittedVert[cellIdx].resize(table[cellIdx * 3]);
+		memcpy(h_splittedVert[cellIdx].data(), cellData, vertexSize);
+		cellData += vertexSize;
+		checksums.push_back(vk3DGRT::container::checksum(cellData, indexSize));
+		h_splittedIdx[cellIdx].assign(reinterpret_cast<const uint32_t*>(cellData), reinterpret_cast<const uint32_t*>(cellData + indexSize));
+		cellData += indexSize;
+		checksums.push_back(vk3DGRT::container::checksum(cellData, primitiveIdSize));
+		h_splittedPrimitiveId[cellIdx].assign(reinterpret_cast<const uint32_t*>(cellData), reinterpret_cast<const uint32_t*>(cellData + primitiveIdSize));
+		cellData += primitiveIdSize;
+	}
+	if (vk3DGRT::container::checksum(checksums.data(), checksums.size() * sizeof(uint64_t)) != header.payloadChecksum) {
+		cout << "Split cache " << cacheFile << " is corrupt, splitting again\n";
+		return false;
+	}
+
+	numCellsTotal = header.numCellsTotal;
+	minPos = glm::vec3(header.minPos[0], header.minPos[1], header.minPos[2]);
+	maxPos = glm::vec3(header.maxPos[0], header.maxPos[1], header.maxPos[2]);
+	partitionNodes.clear();
+
+	splitStats = SplitStats();
+	splitStats.fromCache = true;
+	splitStats.numTriangles = indices.size() / 3;
+	for (uint32_t cellIdx = 0; cellIdx < numCellsTotal; cellIdx++) {
+		const size_t count = h_splittedIdx[cellIdx].size() / 3;
+		if (count > 0) splitStats.numCellsUsed++;
+		splitStats.numClippedTriangles += count;
+		splitStats.maxCellTriangles = std::max(splitStats.maxCellTriangles, count);
+	}
+	return true;
+#endif
+}
+
+void SplitBLAS::writeSplitCache(uint64_t key) const {
+	CacheHeader header{};
+	memcpy(header.magic, splitCacheMagic, sizeof(splitCacheMagic));
+	header.version = splitCacheVersion;
+	header.numCellsTotal = numCellsTotal;
+	header.key = key;
+	for (int i = 0; i < 3; i++) {
+		header.minPos[i] = minPos[i];
+		header.maxPos[i] = maxPos[i];
+	}
+
+	vector<uint32_t> table(size_t(numCellsTotal) * 3);
+	for (uint32_t cellIdx = 0; cellIdx < numCellsTotal; cellIdx++) {
+		table[cellIdx * 3] = static_cast<uint32_t>(h_splittedVert[cellIdx].size());
+		table[cellIdx * 3 + 1] = static_cast<uint32_t>(h_splittedIdx[cellIdx].size());
+		table[cellIdx * 3 + 2] = static_cast<uint32_t>(h_splittedPrimitiveId[cellIdx].size());
+	}
+	vector<uint64_t> checksums;
+	checksums.reserve(1 + table.size());
+	checksums.push_back(vk3DGRT::container::checksum(table.data(), table.size() * sizeof(uint32_t)));
+	for (uint32_t cellIdx = 0; cellIdx < numCellsTotal; cellIdx++) {
+		checksums.push_back(vk3DGRT::container::checksum(h_splittedVert[cellIdx].data(), h_splittedVert[cellIdx].size() * sizeof(glm::vec3)));
+		checksums.push_back(vk3DGRT::container::checksum(h_splittedIdx[cellIdx].data(), h_splittedIdx[cellIdx].size() * sizeof(uint32_t)));
+		checksums.push_back(vk3DGRT::container::checksum(h_splittedPrimitiveId[cellIdx].data(), h_splittedPrimitiveId[cellIdx].size() * sizeof(uint32_t)));
+	}
+	header.payloadChecksum = vk3DGRT::container::checksum(checksums.data(), checksums.size() * sizeof(uint64_t));
+
+	std::ofstream out(cacheFile, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		std::cout << "Error: failed to create split cache file: " << cacheFile << std::endl;
+		return;
+	}
+	out.write((const char*)&header, sizeof(CacheHeader));
+	out.write((const char*)table.data(), table.size() * sizeof(uint32_t));
+	for (uint32_t cellIdx = 0; cellIdx < numCellsTotal; cellIdx++) {
+		out.write((const char*)h_splittedVert[cellIdx].data(), h_splittedVert[cellIdx].size() * sizeof(glm::vec3));
+		out.write((const char*)h_splittedIdx[cellIdx].data(), h_splittedIdx[cellIdx].size() * sizeof(uint32_t));
+		out.write((const char*)h_splittedPrimitiveId[cellIdx].data(), h_splittedPrimitiveId[cellIdx].size() * sizeof(uint32_t));
+	}
+	if (!out.good()) {
+		std::cout << "Error: failed to write split cache file: " << cacheFile << std::endl;
+	}
+}
+
 void SplitBLAS::createAS(VkQueue& queue) {
 	createBLASes(queue);
+	blasBuildSize = blasSize;
+	if (compaction) compactBLASes(queue);
 	createTLAS(queue);
 }
 
@@ -709,6 +1557,25 @@ void SplitBLAS::rebuild(vks::Buffer& vertexBuffer, vks::Buffer& indexBuffer, VkQ
 	createAS(queue);
 }
 
+void SplitBLAS::resplit(vks::Buffer& vertexBuffer, vks::Buffer& indexBuffer, VkQueue& queue) {
+	destroyAS();
+	if (vertices.empty()) {
+		// released by releaseHostGeometry, the device copy is the input
+		copyDeviceToHost(vertexBuffer, indexBuffer, queue);
+	}
+	splitHostGeometry(queue);
+	vkDestroyQueryPool(vulkanDevice->logicalDevice, ASBuildTimeStampQueryPool, nullptr);
+	initASBuildTimestamp(queue);
+	createAS(queue);
+}
+
+void SplitBLAS::releaseHostGeometry() {
+	vertices.clear();
+	vertices.shrink_to_fit();
+	indices.clear();
+	indices.shrink_to_fit();
+}
+
 void SplitBLAS::initASBuildTimestamp(VkQueue& queue)
 {
 	ASBuildTimeStamps.resize(d_splittedIndices.size() * 2 + 2);
@@ -734,11 +1601,15 @@ void SplitBLAS::printASBuildInfo(VkPhysicalDeviceProperties deviceProperties)
 		delta_in_ms_BLAS += float(ASBuildTimeStamps[i * 2 + 1] - ASBuildTimeStamps[i * 2]);
 	delta_in_ms_BLAS *= device_limits.timestampPeriod / 1000000.0f;
 	float delta_in_ms_TLAS = float(ASBuildTimeStamps[ASBuildTimeStamps.size() - 1] - ASBuildTimeStamps[ASBuildTimeStamps.size() - 2]) * device_limits.timestampPeriod / 1000000.0f;
+	blasBuildTimeMs = delta_in_ms_BLAS;
+	tlasBuildTimeMs = delta_in_ms_TLAS;
 #if defined(_WIN32)
 	std::cout << "\n*** AS Build Info BEGIN ***\n";
 	std::cout << "BLAS build time: " << delta_in_ms_BLAS << " (ms)\n";
 	std::cout << "TLAS build time: " << delta_in_ms_TLAS << " (ms)\n";
 	std::cout << "BLAS size: " << blasSize << " (Bytes)\n";
+	if (blasBuildSize != blasSize)
+		std::cout << "BLAS size before compaction: " << blasBuildSize << " (Bytes)\n";
 	std::cout << "TLAS size: " << tlasSize << " (Bytes)\n";
 	std::cout << "*** AS Build Info END ***\n";
 #elif defined(VK_USE_PLATFORM_ANDROID_KHR)
@@ -746,7 +1617,28 @@ void SplitBLAS::printASBuildInfo(VkPhysicalDeviceProperties deviceProperties)
 	LOGD("BLAS build time: %f (ms))\n", delta_in_ms_BLAS);
 	LOGD("TLAS build time: %f (ms))\n", delta_in_ms_TLAS);
 	LOGD("BLAS size: %llu (Bytes))\n", blasSize);
+	if (blasBuildSize != blasSize)
+		LOGD("BLAS size before compaction: %llu (Bytes))\n", blasBuildSize);
 	LOGD("TLAS size: %llu (Bytes))\n", tlasSize);
 	LOGD("*** AS Build Info END ***\n");
 #endif
-}
\ No newline at end of file
+}
+
+void SplitBLAS::writeBuildTimes(const std::string& fileName, const std::string& asset)
+{
+	std::ifstream existing(fileName);
+	const bool writeHeader = !existing.good() || existing.peek() == std::ifstream::traits_type::eof();
+	existing.close();
+
+	std::ofstream out(fileName, std::ios::app);
+	if (!out.is_open()) {
+		std::cout << "Error: failed to open " << fileName << std::endl;
+		return;
+	}
+	if (writeHeader) {
+		out << "asset,partition,cells,blases,triangles,clippedTriangles,maxBlasTriangles,threads,cellClips,partitionMs,clipMs,indexMs,blasBuildMs,tlasBuildMs,blasBuildBatches,blasBuildBytes,blasBytes\n";
+	}
+	out << asset << "," << (adaptivePartition ? "adaptive" : "uniform") << "," << numCellsTotal << "," << splitStats.numCellsUsed << "," << splitStats.numTriangles << ","
+		<< splitStats.numClippedTriangles << "," << splitStats.maxCellTriangles << "," << splitStats.numThreads << "," << splitStats.cellsClipped << ","
+		<< splitStats.partitionTimeMs << "," << splitStats.clipTimeMs << "," << splitStats.indexTimeMs << "," << blasBuildTimeMs << "," << tlasBuildTimeMs << "," << blasBuildBatches << "," << blasBuildSize << "," << blasSize << "\n";
+}
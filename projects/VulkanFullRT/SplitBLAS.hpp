@@ -8,6 +8,8 @@
 
 #include "VulkanUtils.h"
 #include "SimpleUtils.h"
+#include "frustum.hpp"
+#include "Vulkan3DGRTModel.h"
 
 #include <vector>
 
@@ -27,11 +29,22 @@ private:
 	uint32_t idxCnt;
 	
 	uint32_t numCellsTotal;
+	// Binary tree of the adaptive partition, the leaves are the cells (numbered depth first)
+	struct PartitionNode {
+		glm::vec3 boxMin;
+		glm::vec3 boxMax;
+		uint32_t children = 0;	// first of the two children, 0 for a leaf
+		uint32_t cellIdx = 0;
+	};
+	vector<PartitionNode> partitionNodes;
 	vector<vector<glm::vec3>> h_splittedVert;
 	vector<vector<float>> h_splittedVertFP;
 	vector<vector<uint32_t>> h_splittedIdx;
 	vector<vector<uint32_t>> h_splittedPrimitiveId;
 	vector<uint64_t> h_splittedPrimitiveIdsDeviceAddress;
+	// bounds of the clipped geometry of each BLAS, for the frustum culling of the TLAS instances
+	vector<glm::vec3> blasBoundsMin;
+	vector<glm::vec3> blasBoundsMax;
 
 	struct Attribute {
 		uint32_t count;
@@ -46,6 +59,8 @@ private:
 	PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddressKHR;
 	PFN_vkBuildAccelerationStructuresKHR vkBuildAccelerationStructuresKHR;
 	PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructuresKHR;
+	PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR;
+	PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR;
 
 	struct AccelerationStructure {
 		VkAccelerationStructureKHR handle;
@@ -72,10 +87,28 @@ private:
 		VkDeviceMemory memory = VK_NULL_HANDLE;
 	};
 
+	VkDeviceSize scratchOffsetAlignment = 256;	// minAccelerationStructureScratchOffsetAlignment
+
 	VkTransformMatrixKHR tMat{};
 	vks::Buffer tMatBuffer;
 	void copyDeviceToHost(vks::Buffer& vertexBuffer, vks::Buffer& indexBuffer, VkQueue& queue);
+	void splitHostGeometry(VkQueue& queue);
+	/* split cache */
+	static constexpr uint32_t splitCacheVersion = 1;	// of CacheHeader and the cell layout behind it
+	struct CacheHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t numCellsTotal;
+		uint64_t key;				// input geometry and split settings
+		uint64_t payloadChecksum;	// cell table and cell data
+		float minPos[3];
+		float maxPos[3];
+	};
+	uint64_t splitCacheKey() const { return splitCacheKey(vertices, indices, cellsPerLongestAxis, adaptivePartition, trianglesPerCell); }
+	bool loadSplitCache(uint64_t key);
+	void writeSplitCache(uint64_t key) const;
 	void saveGeometries_SBLAS(std::vector<glm::vec3>& vertexBuffer, std::vector<uint32_t>& indexBuffer);
+	uint32_t buildAdaptiveCells(const std::vector<glm::vec3>& vertexBuffer, const std::vector<uint32_t>& indexBuffer);
 	void copyToDevice(VkQueue& queue);
 	void createSplittedPrimitiveIdsBuffer(VkQueue queue);
 	/* create BLAS */
@@ -85,11 +118,25 @@ private:
 	void deleteScratchBuffer(ScratchBuffer& scratchBuffer);
 	void createBLAS(int cellIdx, VkQueue& queue);
 	void createBLASes(VkQueue& queue);
+	void createBLASesBatched(VkQueue& queue);
+	void compactBLASes(VkQueue& queue);
 	void createTLAS(VkQueue& queue);
+	VkAccelerationStructureGeometryKHR tlasGeometry(uint64_t instancesAddress) const;
+	/* frustum culling, the TLAS is built again over the instances of the visible BLASes */
+	vector<VkAccelerationStructureInstanceKHR> tlasInstances;	// every BLAS, the custom index is the BLAS index
+	vector<uint32_t> visibleBLASes;
+	vks::Buffer tlasInstancesBuffer;	// tlasInstances of the first build
+	ScratchBuffer tlasScratchBuffer;
 	void destroyAS();
 
 public:
-	uint32_t cellsPerLongestAxis;
+	uint32_t cellsPerLongestAxis = NUMBER_OF_CELLS_PER_LONGEST_AXIS;	// uniform grid resolution
+	bool adaptivePartition = SPLIT_BLAS_ADAPTIVE;				// binned SAH cells instead of the uniform grid
+	uint32_t trianglesPerCell = SPLIT_BLAS_TRIANGLES_PER_CELL;	// adaptive cells stop splitting below this
+	bool batchedBuild = SPLIT_BLAS_BATCHED_BUILD;				// one command buffer and scratch pool for all BLASes
+	VkDeviceSize scratchPoolBudget = VkDeviceSize(SPLIT_BLAS_SCRATCH_POOL_MB) << 20;
+	bool compaction = AS_COMPACTION;	// copy the BLASes into right-sized buffers before the TLAS build
+	std::string cacheFile;	// split cells of the last split, reused while the geometry and split settings match. Empty to always split
 
 	vector<Attribute> d_splittedVertices;
 	vector<Attribute> d_splittedIndices;
@@ -101,13 +148,72 @@ public:
 	VkQueryPool ASBuildTimeStampQueryPool;
 	std::vector<uint64_t> ASBuildTimeStamps;
 	VkDeviceSize blasSize = 0;
+	VkDeviceSize blasBuildSize = 0;	// before compaction
 	VkDeviceSize tlasSize = 0;
+	float blasBuildTimeMs = 0.0f;
+	float tlasBuildTimeMs = 0.0f;
+	uint32_t blasBuildBatches = 0;	// vkCmdBuildAccelerationStructuresKHR calls of the BLAS build
+
+	// host side split of the last splitBlas call
+	struct SplitStats {
+		size_t numTriangles = 0;
+		uint32_t numThreads = 0;
+		uint64_t cellsClipped = 0;	// triangle/cell pairs that went through the clipper
+		uint64_t cellsAccepted = 0;	// triangle/cell pairs inside the cell, copied without clipping
+		size_t numClippedTriangles = 0;	// triangles in all cells after clipping
+		uint32_t numCellsUsed = 0;		// cells with geometry, one BLAS each
+		size_t maxCellTriangles = 0;
+		uint32_t partitionDepth = 0;	// adaptive partition only
+		double partitionTimeMs = 0.0;
+		double clipTimeMs = 0.0;
+		double indexTimeMs = 0.0;	// vertex deduplication per cell
+		bool fromCache = false;		// cells loaded from cacheFile, the split timings are 0
+		double cacheTimeMs = 0.0;	// key, load or write of cacheFile
+	} splitStats;
 
 	~SplitBLAS();
 	void init(vks::VulkanDevice* device);
 	void splitBlas(vks::Buffer& vertexBuffer, vks::Buffer& indexBuffer, VkQueue& queue);
+	void splitBlas(const vector<float>& hostVertices, const vector<uint32_t>& hostIndices, VkQueue& queue);
 	void createAS(VkQueue& queue);
 	void rebuild(vks::Buffer& vertexBuffer, vks::Buffer& indexBuffer, VkQueue& queue);
+	// Splits the geometry of the last splitBlas call again with the current settings and rebuilds the acceleration structures.
+	// The geometry is read back from vertexBuffer and indexBuffer when releaseHostGeometry dropped the host copy
+	void resplit(vks::Buffer& vertexBuffer, vks::Buffer& indexBuffer, VkQueue& queue);
+	// Frees the host copy of the input geometry once the acceleration structures are built
+	void releaseHostGeometry();
+	// Checks the separating axis batches of the split against the scalar clipper on every triangle/cell pair of the uniform grid
+	// and times both, repeats times. Returns false when a pair classified outside or inside clips differently
+	static bool checkClipping(const vector<float>& hostVertices, const vector<uint32_t>& hostIndices, uint32_t cellsPerLongestAxis, int repeats = 3);
+	// Key of the split cache: the input geometry and the split settings the cells depend on, the settings the partition
+	// does not use (trianglesPerCell of the uniform grid, cellsPerLongestAxis of the adaptive one) left out
+	static uint64_t splitCacheKey(const vector<float>& vertices, const vector<uint32_t>& indices, uint32_t cellsPerLongestAxis, bool adaptivePartition, uint32_t trianglesPerCell) {
+		const float sceneEpsilon = SCENE_EPSILON;
+		uint32_t sceneEpsilonBits;
+		memcpy(&sceneEpsilonBits, &sceneEpsilon, sizeof(uint32_t));
+		const uint64_t keyData[] = {
+			splitCacheVersion,
+			vertices.size(),
+			indices.size(),
+			vk3DGRT::container::checksum(vertices.data(), vertices.size() * sizeof(float)),
+			vk3DGRT::container::checksum(indices.data(), indices.size() * sizeof(uint32_t)),
+			adaptivePartition ? 0u : cellsPerLongestAxis,
+			sceneEpsilonBits,
+			adaptivePartition ? 1u : 0u,
+			adaptivePartition ? trianglesPerCell : 0u
+		};
+		return vk3DGRT::container::checksum(keyData, sizeof(keyData));
+	}
 	void initASBuildTimestamp(VkQueue& queue);
 	void printASBuildInfo(VkPhysicalDeviceProperties deviceProperties);
+	// Appends one row of split/build timings (after printASBuildInfo) to a csv file, to compare assets and settings
+	void writeBuildTimes(const std::string& fileName, const std::string& asset);
+	// Writes the instances of the BLASes inside the side and near planes of the frustum to instances (numBLASes() of room),
+	// when the visible set changed. Returns whether it did, cmdBuildCulledTLAS then builds the TLAS from them
+	bool cullCells(vks::Frustum& frustum, VkAccelerationStructureInstanceKHR* instances);
+	// Records the TLAS build over the instances of the last cullCells, the caller orders it against the traces
+	void cmdBuildCulledTLAS(VkCommandBuffer commandBuffer, uint64_t instancesAddress);
+	uint32_t numBLASes() const { return static_cast<uint32_t>(tlasInstances.size()); }
+	uint32_t culledCells = 0;	// of the last cullCells
+	float cullTimeMs = 0.0f;	// host test and instance write of the last cullCells that changed the visible set
 };
\ No newline at end of file
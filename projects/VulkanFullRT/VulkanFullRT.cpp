@@ -16,6 +16,11 @@
 #include "VulkanUtils.h"
 #include "SimpleUtils.h"
 #include "Vulkan3DGRTModel.h"
+#include "Vulkan3DGRTEnclosing.h"
+#include "frustum.hpp"
+#include <map>
+#include <sstream>
+#include <fstream>
 
 #if SPLIT_BLAS && !RAY_QUERY
 #include "SplitBLAS.hpp"
@@ -37,15 +42,16 @@ public:
 		float density;
 		glm::vec4 quaternion;
 		glm::vec3 scale;
-		float padding;
+		float sphActiveDegree;	// vk3DGRT::enclosing::activeSphDegree
 	};
-	
+
 	struct ParticleSphCoefficient {
 		glm::vec3 featuresAlbedo;
-		float featuresSpecular[SPECULAR_DIMENSION];
+		float featuresSpecular[SPECULAR_DIMENSION];	// at degree MAX_N_FEATURES, see vk3DGRT::Model::sphCoefficientStride
 	};
 
-	vks::Buffer particleDensities;	//read only
+	vks::Buffer particleDensities;	//read only, freed after the enclosing pass with DensityLayoutPacked
+	vks::Buffer packedParticleDensities;	//read only, read by the hit shaders instead of particleDensities with DensityLayoutPacked
 	vks::Buffer particleSphCoefficients;	//read only
 
 	// For 3DGRT Model
@@ -54,10 +60,18 @@ public:
 
 #if SPLIT_BLAS && !RAY_QUERY
 	SplitBLAS splitBLAS;
+	std::vector<uint32_t> splitCellsSweep;	// --splittune candidates of SplitBLAS::cellsPerLongestAxis
 #endif
 
 	vks::Buffer transformBuffer3DGRT;
 
+	// cullAccelerationStructures
+	bool frustumCulling = FRUSTUM_CULLING;
+	vks::Frustum frustum;
+	glm::mat4 cullViewProjection{ 0.0f };	// camera of the last cull
+	uint32_t culledInstances = 0;
+	float cullTimeMs = 0.0f;
+
 #if !RAY_QUERY
 	std::vector<VkRayTracingShaderGroupCreateInfoKHR> shaderGroups{};
 	struct ShaderBindingTables {
@@ -67,6 +81,19 @@ public:
 	} shaderBindingTables;
 #endif
 
+	// k-buffer depth (MAX_HIT_PER_TRACE) of the particle rendering pass, one shader permutation per depth.
+	// pipeline and shaderBindingTables are the ones of kBufferSize, the others stay built for the runtime switch
+	const std::vector<uint32_t> kBufferSizes = { 4, 8, 16, 32 };
+	uint32_t kBufferSize = K_BUFFER_SIZE;
+	bool kBufferSweep = false;	// --kbuffersweep
+	struct KBufferPipeline {
+		VkPipeline pipeline{ VK_NULL_HANDLE };
+#if !RAY_QUERY
+		ShaderBindingTables shaderBindingTables;
+#endif
+	};
+	std::map<uint32_t, KBufferPipeline> kBufferPipelines;
+
 	vks::utils::UniformDataDynamic uniformDataDynamic;
 	vks::utils::UniformDataStatic uniformDataStatic;
 	vks::utils::GaussianEnclosingUniformData gaussianEnclosingUniformData;
@@ -78,6 +105,18 @@ public:
 		uint32_t staticLightOffset = STATIC_LIGHT_OFFSET;
 		uint32_t windowSizeX = 1;
 		uint32_t windowSizeY = 1;
+		uint32_t sphStorageMode = vk3DGRT::SphStorageFloat;
+		uint32_t sphDegree = MAX_N_FEATURES;
+		// switches of 3dgs.glsl, specialized from here instead of being rebuilt into the shaders
+		uint32_t blasMode = vk3DGRT::BlasModeIcosahedra;	// constant_id 9
+		VkBool32 hitCounts = ENABLE_HIT_COUNTS;				// constant_id 10
+		uint32_t workGroupSizeX = TB_SIZE_X;				// constant_id 11, particleRendering.comp
+		uint32_t workGroupSizeY = TB_SIZE_Y;				// constant_id 12, particleRendering.comp
+		uint32_t enclosingGroupSize = NUM_OF_GAUSSIANS;		// constant_id 13, particlePrimitives.comp
+		float sphDegreeEpsilon = SPH_ACTIVE_DEGREE_EPSILON;	// constant_id 14, particlePrimitives.comp
+		uint32_t densityLayout = PARTICLE_DENSITY_LAYOUT;	// constant_id 15
+		VkBool32 adaptiveTracing = ADAPTIVE_TRACING;		// constant_id 16, raygen.rgen
+		float alphaMinThreshold = ALPHA_MIN_THRESHOLD;		// constant_id 19, the activation and the hit shaders
 	} specializationData;
 
 	// for Particle Rendering pass
@@ -95,17 +134,37 @@ public:
 		vks::Buffer uniformBuffer;
 		vks::Buffer totalCounts;
 		VkCommandBuffer commandBuffer{ VK_NULL_HANDLE };
+
+		// built on the host when gModel.hostEnclosing is set, kept until the acceleration structures are built
+		std::vector<float> hostVertices;
+		std::vector<uint32_t> hostIndices;
+		// gModel.instancedBLAS: VkTransformMatrixKHR of every particle instance, for the TLAS build
+		std::vector<float> hostInstanceTransforms;
 	} gaussianEnclosing;
 
 	vk3DGRT::Model gModel;
 
 	struct FrameObject : public BaseFrameObject {
 		VkDescriptorSet descriptorSet{ VK_NULL_HANDLE };
-#if ENABLE_HIT_COUNTS && !RAY_QUERY
-		vks::Buffer hitCountsbuffer;
+#if !RAY_QUERY
+		vks::Buffer hitCountsbuffer;	// width * height hit counts then trace counts with specializationData.hitCounts, a single one bound otherwise
 #endif
+		// TLAS instances of the frustum cull, written once renderCompleteFence signals and built before the trace when cullBuildPending
+		vks::Buffer cullInstancesBuffer;
+		bool cullBuildPending = false;
 	};
 
+#if !RAY_QUERY
+	// result image of traceTimeMs, the timing runs never touch the swap chain images
+	struct TimingTarget {
+		VkImage image{ VK_NULL_HANDLE };
+		VkDeviceMemory memory{ VK_NULL_HANDLE };
+		VkImageView view{ VK_NULL_HANDLE };
+		uint32_t width = 0;
+		uint32_t height = 0;
+	} timingTarget;
+#endif
+
 	std::vector<FrameObject> frameObjects;
 	std::vector<BaseFrameObject*> pBaseFrameObjects;
 
@@ -121,6 +180,26 @@ public:
 	std::vector<uint64_t> ASBuildTimeStamps;
 	VkDeviceSize blasSize;
 	VkDeviceSize tlasSize;
+	bool compactAS = AS_COMPACTION;
+	VkDeviceSize blasBuildSize = 0;	// before compaction
+	// refitAccelerationStructure3DGRT
+	bool updatableAS = AS_UPDATE;
+	uint32_t animatedParticles = 0;		// --animateparticles, the first ones circle around their position (animateParticles)
+	glm::vec3 animationOffset{ 0.0f };
+	float refitRebuildFraction = AS_REFIT_REBUILD_FRACTION;
+	uint32_t refitMaxUpdates = AS_REFIT_MAX_UPDATES;
+	uint32_t refitsSinceBuild = 0;
+	double lastRefitTimeMs = 0.0;
+	VkDeviceSize blasUpdateScratchSize = 0;
+	VkDeviceSize tlasUpdateScratchSize = 0;
+	ScratchBuffer refitScratchBuffer{};
+	vks::Buffer tlasInstancesBuffer3DGRT;
+	// frustum culling of the instanced BLAS, the TLAS is built again over the visible particles
+	std::vector<VkAccelerationStructureInstanceKHR> tlasInstances3DGRT;
+	std::vector<glm::vec4> instanceSpheres3DGRT;	// bounding sphere of each instance (center, radius)
+	std::vector<uint32_t> visibleInstances3DGRT;
+	VkDeviceSize tlasBuildScratchSize = 0;
+	ScratchBuffer cullScratchBuffer{};
 #endif
 
 #if LOAD_GLTF
@@ -201,6 +280,192 @@ public:
 	{
 		title = "Abura Soba - Vulkan Full Ray Tracing";
 
+		if (commandLineParser.isSet("sphstorage")) {
+			std::string value = commandLineParser.getValueAsString("sphstorage", "float");
+			if (value == "fp16") {
+				gModel.sphStorage = vk3DGRT::SphStorageHalf;
+			}
+			else if (value == "unorm8") {
+				gModel.sphStorage = vk3DGRT::SphStorageUnorm8;
+			}
+			else if (value != "float") {
+				std::cerr << "SH storage must be one of 'float', 'fp16' or 'unorm8'\n";
+			}
+		}
+		specializationData.sphStorageMode = gModel.sphStorage;
+		gModel.mortonOrder = commandLineParser.isSet("mortonorder");
+		if (commandLineParser.isSet("hostenclosing")) {
+			gModel.hostEnclosing = true;
+		}
+		if (commandLineParser.isSet("hostresidency")) {
+			std::string value = commandLineParser.getValueAsString("hostresidency", "mapped");
+			if (value == "keep") {
+				gModel.hostResidency = vk3DGRT::HostResidencyKeep;
+			}
+			else if (value == "mapped") {
+				gModel.hostResidency = vk3DGRT::HostResidencyMapped;
+			}
+			else if (value == "release") {
+				gModel.hostResidency = vk3DGRT::HostResidencyRelease;
+			}
+			else {
+				std::cerr << "Host residency must be one of 'keep', 'mapped' or 'release'\n";
+			}
+		}
+		if (commandLineParser.isSet("shdegree")) {
+			int sphDegree = commandLineParser.getValueAsInt("shdegree", MAX_N_FEATURES);
+			if (sphDegree < 0 || sphDegree > MAX_N_FEATURES) {
+				std::cerr << "SH degree must be between 0 and " << MAX_N_FEATURES << "\n";
+			}
+			gModel.sphDegree = (uint32_t)std::clamp(sphDegree, 0, MAX_N_FEATURES);
+		}
+		if (commandLineParser.isSet("shepsilon")) {
+			std::string value = commandLineParser.getValueAsString("shepsilon", "0.001");
+			float epsilon = gModel.sphDegreeEpsilon;
+			try {
+				epsilon = std::stof(value);
+			}
+			catch (const std::exception&) {
+				std::cerr << "Ignoring SH active degree epsilon '" << value << "'\n";
+			}
+			if (epsilon < 0.0f) {
+				std::cerr << "SH active degree epsilon must not be negative\n";
+			}
+			gModel.sphDegreeEpsilon = std::max(epsilon, 0.0f);
+		}
+		specializationData.sphDegreeEpsilon = gModel.sphDegreeEpsilon;
+		if (commandLineParser.isSet("densitylayout")) {
+			std::string value = commandLineParser.getValueAsString("densitylayout", "float");
+			if (value == "packed") {
+				gModel.densityLayout = vk3DGRT::DensityLayoutPacked;
+			}
+			else if (value == "float") {
+				gModel.densityLayout = vk3DGRT::DensityLayoutFloat;
+			}
+			else {
+				std::cerr << "Density layout must be one of 'float' or 'packed'\n";
+			}
+		}
+		specializationData.densityLayout = gModel.densityLayout;
+		if (commandLineParser.isSet("frustumculling")) {
+			frustumCulling = true;
+		}
+		if (commandLineParser.isSet("nofrustumculling")) {
+			frustumCulling = false;
+		}
+		if (commandLineParser.isSet("blasmode")) {
+			std::string value = commandLineParser.getValueAsString("blasmode", "icosahedra");
+#if SPLIT_BLAS && !RAY_QUERY
+			std::cerr << "The BLAS mode is split, SPLIT_BLAS is set\n";
+#else
+			if (value == "icosahedra" || value == "instanced" || value == "procedural") {
+				gModel.instancedBLAS = value == "instanced";
+				gModel.proceduralPrimitives = value == "procedural";
+			}
+			else {
+				std::cerr << "BLAS mode must be one of 'icosahedra', 'instanced' or 'procedural'\n";
+			}
+#endif
+		}
+		specializationData.blasMode = blasMode();
+		if (commandLineParser.isSet("animateparticles")) {
+#if SPLIT_BLAS
+			std::cerr << "Animated particles are refitted in the 3DGRT acceleration structures, SPLIT_BLAS is set\n";
+#else
+			if (gModel.instancedBLAS || gModel.proceduralPrimitives) {
+				std::cerr << "Animated particles are refitted in the enclosing icosahedron BLAS, the BLAS mode is not icosahedra\n";
+			}
+			else {
+				animatedParticles = static_cast<uint32_t>(std::max(commandLineParser.getValueAsInt("animateparticles", 0), 0));
+				updatableAS = updatableAS || animatedParticles > 0;
+			}
+#endif
+		}
+		if (commandLineParser.isSet("hitcounts")) {
+			specializationData.hitCounts = VK_TRUE;
+		}
+		if (commandLineParser.isSet("adaptivetracing")) {
+			specializationData.adaptiveTracing = VK_TRUE;
+		}
+#if RAY_QUERY
+		if (specializationData.adaptiveTracing) {
+			std::cerr << "Adaptive tracing is only implemented in the ray tracing pipeline\n";
+		}
+#endif
+		if (commandLineParser.isSet("tbsize")) {
+			uint32_t x = 0, y = 0;
+			if (sscanf(commandLineParser.getValueAsString("tbsize", "").c_str(), "%u,%u", &x, &y) != 2 || x == 0 || y == 0) {
+				std::cerr << "Thread block size must be given as x,y\n";
+			}
+			else {
+				specializationData.workGroupSizeX = x;
+				specializationData.workGroupSizeY = y;
+			}
+		}
+		if (commandLineParser.isSet("kbuffer")) {
+			int k = commandLineParser.getValueAsInt("kbuffer", K_BUFFER_SIZE);
+			if (std::find(kBufferSizes.begin(), kBufferSizes.end(), (uint32_t)k) == kBufferSizes.end()) {
+				std::cerr << "k-buffer size must be one of 4, 8, 16 or 32\n";
+			}
+			else {
+				kBufferSize = (uint32_t)k;
+			}
+		}
+		kBufferSweep = commandLineParser.isSet("kbuffersweep");
+
+#if SPLIT_BLAS && !RAY_QUERY
+		if (commandLineParser.isSet("splitcells")) {
+			int cells = commandLineParser.getValueAsInt("splitcells", NUMBER_OF_CELLS_PER_LONGEST_AXIS);
+			if (cells < 1) {
+				std::cerr << "Split cells per longest axis must be at least 1\n";
+			}
+			splitBLAS.cellsPerLongestAxis = (uint32_t)std::max(cells, 1);
+		}
+		if (commandLineParser.isSet("splittune")) {
+			std::stringstream candidates(commandLineParser.getValueAsString("splittune", ""));
+			std::string candidate;
+			while (std::getline(candidates, candidate, ',')) {
+				int cells = std::atoi(candidate.c_str());
+				if (cells < 1) {
+					std::cerr << "Ignoring split tuning candidate '" << candidate << "'\n";
+					continue;
+				}
+				splitCellsSweep.push_back((uint32_t)cells);
+			}
+		}
+#endif
+
+		// Offline conversion of a .ply model to the .3dgrt container, no device needed
+		if (commandLineParser.isSet("convert")) {
+			std::string plyFile = commandLineParser.getValueAsString("convert", "");
+			std::string containerFile = plyFile.substr(0, plyFile.find_last_of(".")) + ".3dgrt";
+			vk3DGRT::PLYLoader plyLoader;
+			vk3DGRT::SplatSet splatSet;
+			bool converted = plyLoader.loadPLYModel(plyFile.c_str(), splatSet, gModel.sphDegree);
+			if (converted && gModel.mortonOrder) {
+				vk3DGRT::reorderSplatSetMorton(splatSet);
+			}
+			converted = converted && vk3DGRT::container::write(containerFile.c_str(), splatSet);
+			exit(converted ? 0 : -1);
+		}
+
+#if SPLIT_BLAS && !RAY_QUERY
+		// Offline check and timing of the split BLAS clipping on the enclosing icosahedra of a .ply model, no device needed
+		if (commandLineParser.isSet("splitclipcheck")) {
+			vk3DGRT::PLYLoader plyLoader;
+			vk3DGRT::SplatSet splatSet;
+			if (!plyLoader.loadPLYModel(commandLineParser.getValueAsString("splitclipcheck", "").c_str(), splatSet, gModel.sphDegree)) {
+				exit(-1);
+			}
+			std::vector<float> densities, sphCoefficients, vertices;
+			std::vector<uint32_t> indices;
+			glm::vec3 aabbMin, aabbMax;
+			size_t numParticles = vk3DGRT::enclosing::activateParticles(splatSet, densities, sphCoefficients, aabbMin, aabbMax);
+			vk3DGRT::enclosing::buildIcosaHedra(densities.data(), numParticles, vk3DGRT::enclosing::Options(), vertices, indices);
+			exit(SplitBLAS::checkClipping(vertices, indices, splitBLAS.cellsPerLongestAxis) ? 0 : -1);
+		}
+#endif
+
 #if RAY_QUERY
 		rayQueryOnly = true;
 #endif
@@ -214,8 +479,15 @@ public:
 			vkDestroyPipelineLayout(device, gaussianEnclosing.pipelineLayout, nullptr);
 			vkDestroyDescriptorSetLayout(device, gaussianEnclosing.descriptorSetLayout, nullptr);
 
-			// for Particle Rendering pass
-			vkDestroyPipeline(device, pipeline, nullptr);
+			// for Particle Rendering pass, pipeline is one of the k-buffer pipelines
+			for (auto& kBufferPipeline : kBufferPipelines) {
+				vkDestroyPipeline(device, kBufferPipeline.second.pipeline, nullptr);
+#if !RAY_QUERY
+				kBufferPipeline.second.shaderBindingTables.raygen.destroy();
+				kBufferPipeline.second.shaderBindingTables.miss.destroy();
+				kBufferPipeline.second.shaderBindingTables.hit.destroy();
+#endif
+			}
 			vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
 			vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 
@@ -223,11 +495,19 @@ public:
 			{
 				frame.uniformBuffer.destroy();
 				frame.uniformBufferStatic.destroy();
+#if !RAY_QUERY
+				frame.hitCountsbuffer.destroy();
+#endif
+				frame.cullInstancesBuffer.destroy();
 
 				vkDestroyQueryPool(device, frame.timeStampQueryPool, nullptr);
 			}
 
 			particleDensities.destroy();
+			packedParticleDensities.destroy();
+#if !RAY_QUERY
+			destroyTimingTarget();
+#endif
 			particleSphCoefficients.destroy();
 
 			gaussianEnclosing.uniformBuffer.destroy();
@@ -235,12 +515,16 @@ public:
 			deleteAccelerationStructure(bottomLevelAS3DGRT);
 			deleteAccelerationStructure(topLevelAS3DGRT);
 			transformBuffer3DGRT.destroy();
-		
-#if !RAY_QUERY
-			shaderBindingTables.raygen.destroy();
-			shaderBindingTables.miss.destroy();
-			shaderBindingTables.hit.destroy();
+#if !SPLIT_BLAS
+			tlasInstancesBuffer3DGRT.destroy();
+			if (refitScratchBuffer.handle != VK_NULL_HANDLE) {
+				deleteScratchBuffer(refitScratchBuffer);
+			}
+			if (cullScratchBuffer.handle != VK_NULL_HANDLE) {
+				deleteScratchBuffer(cullScratchBuffer);
+			}
 #endif
+		
 			destroyCommandBuffers();
 
 #if LOAD_GLTF
@@ -572,22 +856,13 @@ public:
 #endif
 
 #if !SPLIT_BLAS
-	void createBottomLevelAccelerationStructure3DGRT()
+	/*
+		Geometry and flags of the 3DGRT BLAS, shared by its build and its refits (which must describe the same geometry)
+	*/
+	VkAccelerationStructureGeometryKHR bottomLevelGeometry3DGRT(uint32_t& primitiveCount)
 	{
-		VkTransformMatrixKHR transformMatrix{};
-		auto m = glm::mat3x4(glm::mat4(1.0f));
-		memcpy(&transformMatrix, (void*)&m, sizeof(glm::mat3x4));
-
-		VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		&transformBuffer3DGRT, sizeof(VkTransformMatrixKHR), &transformMatrix));
-
-		// Build
 		VkAccelerationStructureGeometryKHR geometry{};
-		VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo;
-		VkAccelerationStructureBuildRangeInfoKHR* pBuildRangeInfo;
-
-		uint32_t primitiveCount = gModel.indices.count / 3;
+		primitiveCount = gModel.indices.count / 3;
 		VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress{};
 		VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress{};
 		VkDeviceOrHostAddressConstKHR transformBufferDeviceAddress{};
@@ -597,15 +872,59 @@ public:
 		transformBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(transformBuffer3DGRT.buffer);
 
 		geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-		geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-		geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
-		geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-		geometry.geometry.triangles.vertexData = vertexBufferDeviceAddress;
-		geometry.geometry.triangles.maxVertex = gModel.vertices.count;
-		geometry.geometry.triangles.vertexStride = sizeof(float) * 3;
-		geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
-		geometry.geometry.triangles.indexData = indexBufferDeviceAddress;
-		geometry.geometry.triangles.transformData = transformBufferDeviceAddress;
+		if (gModel.proceduralPrimitives) {
+			// one AABB per particle, hit by particleIntersection.rint. The k-buffer must see every particle once
+			primitiveCount = static_cast<uint32_t>(gModel.vertices.count / 6);
+			geometry.geometryType = VK_GEOMETRY_TYPE_AABBS_KHR;
+			geometry.flags = VK_GEOMETRY_NO_DUPLICATE_ANY_HIT_INVOCATION_BIT_KHR;
+			geometry.geometry.aabbs.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR;
+			geometry.geometry.aabbs.data = vertexBufferDeviceAddress;
+			geometry.geometry.aabbs.stride = sizeof(VkAabbPositionsKHR);
+		}
+		else {
+			geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+			geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+			geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+			geometry.geometry.triangles.vertexData = vertexBufferDeviceAddress;
+			geometry.geometry.triangles.maxVertex = gModel.vertices.count;
+			geometry.geometry.triangles.vertexStride = sizeof(float) * 3;
+			geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
+			geometry.geometry.triangles.indexData = indexBufferDeviceAddress;
+			geometry.geometry.triangles.transformData = transformBufferDeviceAddress;
+		}
+		return geometry;
+	}
+
+	VkBuildAccelerationStructureFlagsKHR bottomLevelBuildFlags3DGRT()
+	{
+		VkBuildAccelerationStructureFlagsKHR flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+		if (compactAS) {
+			flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+		}
+		if (updatableAS) {
+			flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+		}
+		return flags;
+	}
+
+	void createBottomLevelAccelerationStructure3DGRT()
+	{
+		if (transformBuffer3DGRT.buffer == VK_NULL_HANDLE) {
+			VkTransformMatrixKHR transformMatrix{};
+			auto m = glm::mat3x4(glm::mat4(1.0f));
+			memcpy(&transformMatrix, (void*)&m, sizeof(glm::mat3x4));
+
+			VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			&transformBuffer3DGRT, sizeof(VkTransformMatrixKHR), &transformMatrix));
+		}
+
+		// Build
+		VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo;
+		VkAccelerationStructureBuildRangeInfoKHR* pBuildRangeInfo;
+
+		uint32_t primitiveCount = 0;
+		VkAccelerationStructureGeometryKHR geometry = bottomLevelGeometry3DGRT(primitiveCount);
 
 		buildRangeInfo.firstVertex = 0;
 		buildRangeInfo.primitiveOffset = 0;
@@ -618,7 +937,7 @@ public:
 		VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo{};
 		accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
 		accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-		accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+		accelerationStructureBuildGeometryInfo.flags = bottomLevelBuildFlags3DGRT();
 		accelerationStructureBuildGeometryInfo.geometryCount = 1;
 		accelerationStructureBuildGeometryInfo.pGeometries = &geometry;
 
@@ -649,10 +968,25 @@ public:
 
 		// BLAS Size
 		blasSize = accelerationStructureBuildSizesInfo.accelerationStructureSize;
+		blasBuildSize = blasSize;
+		blasUpdateScratchSize = accelerationStructureBuildSizesInfo.updateScratchSize;
+
+		// The compacted size is queried in the build submission, so compaction only adds the copy
+		VkQueryPool compactedSizeQueryPool = VK_NULL_HANDLE;
+		if (compactAS) {
+			VkQueryPoolCreateInfo queryPoolInfo{};
+			queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+			queryPoolInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+			queryPoolInfo.queryCount = 1;
+			VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolInfo, nullptr, &compactedSizeQueryPool));
+		}
 
 		// Build the acceleration structure on the device via a one-time command buffer submission
 		// Some implementations may support acceleration structure building on the host (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands), but we prefer device builds
 		VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		if (compactAS) {
+			vkCmdResetQueryPool(commandBuffer, compactedSizeQueryPool, 0, 1);
+		}
 		// Timestamp 0: BLAS build start
 		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, ASBuildTimeStampQueryPool, 0);
 		vkCmdBuildAccelerationStructuresKHR(
@@ -663,6 +997,13 @@ public:
 
 		// Timestamp 1: BLAS build end
 		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, ASBuildTimeStampQueryPool, 1);
+		if (compactAS) {
+			VkMemoryBarrier barrier = vks::initializers::memoryBarrier();
+			barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+			barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+			vkCmdWriteAccelerationStructuresPropertiesKHR(commandBuffer, 1, &bottomLevelAS3DGRT.handle, VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, compactedSizeQueryPool, 0);
+		}
 		vulkanDevice->flushCommandBuffer(commandBuffer, graphicsQueue);
 
 		VkAccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo{};
@@ -671,6 +1012,53 @@ public:
 		bottomLevelAS3DGRT.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(device, &accelerationDeviceAddressInfo);
 
 		deleteScratchBuffer(scratchBuffer);
+
+		if (compactAS) {
+			compactBottomLevelAccelerationStructure3DGRT(compactedSizeQueryPool);
+		}
+	}
+
+	/*
+	Copy the BLAS into a buffer of its compacted size and free the build-sized one, before the TLAS references it.
+	The size was written to compactedSizeQueryPool by the build submission, the pool is destroyed here
+	*/
+	void compactBottomLevelAccelerationStructure3DGRT(VkQueryPool compactedSizeQueryPool)
+	{
+		VkDeviceSize compactedSize = 0;
+		VK_CHECK_RESULT(vkGetQueryPoolResults(device, compactedSizeQueryPool, 0, 1, sizeof(VkDeviceSize), &compactedSize, sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+		vkDestroyQueryPool(device, compactedSizeQueryPool, nullptr);
+
+		AccelerationStructure compactedAS{};
+		VkAccelerationStructureBuildSizesInfoKHR compactedSizeInfo{};
+		compactedSizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+		compactedSizeInfo.accelerationStructureSize = compactedSize;
+		createAccelerationStructureBuffer(compactedAS, compactedSizeInfo);
+
+		VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo{};
+		accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+		accelerationStructureCreateInfo.buffer = compactedAS.buffer;
+		accelerationStructureCreateInfo.size = compactedSize;
+		accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+		VK_CHECK_RESULT(vkCreateAccelerationStructureKHR(device, &accelerationStructureCreateInfo, nullptr, &compactedAS.handle));
+
+		VkCopyAccelerationStructureInfoKHR copyInfo{};
+		copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+		copyInfo.src = bottomLevelAS3DGRT.handle;
+		copyInfo.dst = compactedAS.handle;
+		copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+		VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		vkCmdCopyAccelerationStructureKHR(commandBuffer, &copyInfo);
+		vulkanDevice->flushCommandBuffer(commandBuffer, graphicsQueue);
+
+		deleteAccelerationStructure(bottomLevelAS3DGRT);
+		bottomLevelAS3DGRT = compactedAS;
+
+		VkAccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo{};
+		accelerationDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+		accelerationDeviceAddressInfo.accelerationStructure = bottomLevelAS3DGRT.handle;
+		bottomLevelAS3DGRT.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(device, &accelerationDeviceAddressInfo);
+
+		blasSize = compactedSize;
 	}
 
 	void createTopLevelAccelerationStructure3DGRT()
@@ -688,14 +1076,48 @@ public:
 		instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
 		instance.accelerationStructureReference = bottomLevelAS3DGRT.deviceAddress;
 
-		// Buffer for instance data
-		vks::Buffer instancesBuffer;
+		// Instanced BLAS: one instance of the unit icosahedron per particle, the custom index is the particle id
+		std::vector<VkAccelerationStructureInstanceKHR> instances(1, instance);
+		if (gModel.instancedBLAS) {
+			const size_t numInstances = gaussianEnclosing.hostInstanceTransforms.size() / 12;
+			if (numInstances >= (1u << 24)) {
+				vks::tools::exitFatal("Too many particles for INSTANCED_BLAS (24 bit instanceCustomIndex): " + std::to_string(numInstances), -1);
+			}
+			instances.resize(numInstances, instance);
+			for (size_t i = 0; i < numInstances; i++) {
+				memcpy(&instances[i].transform, &gaussianEnclosing.hostInstanceTransforms[i * 12], sizeof(VkTransformMatrixKHR));
+				instances[i].instanceCustomIndex = static_cast<uint32_t>(i);
+			}
+
+			if (frustumCulling) {
+				// circumradius of the unit icosahedron, scaled by the longest axis of each transform
+				float unitRadius = 0.0f;
+				for (size_t v = 0; v + 2 < gaussianEnclosing.hostVertices.size(); v += 3) {
+					unitRadius = std::max(unitRadius, glm::length(glm::make_vec3(&gaussianEnclosing.hostVertices[v])));
+				}
+				tlasInstances3DGRT = instances;
+				instanceSpheres3DGRT.resize(numInstances);
+				for (size_t i = 0; i < numInstances; i++) {
+					const float (*m)[4] = instances[i].transform.matrix;
+					float axisLength = 0.0f;
+					for (int c = 0; c < 3; c++) {
+						axisLength = std::max(axisLength, glm::length(glm::vec3(m[0][c], m[1][c], m[2][c])));
+					}
+					instanceSpheres3DGRT[i] = glm::vec4(m[0][3], m[1][3], m[2][3], unitRadius * axisLength);
+				}
+				visibleInstances3DGRT.resize(numInstances);
+				for (uint32_t i = 0; i < numInstances; i++) visibleInstances3DGRT[i] = i;
+			}
+		}
+
+		// Buffer for instance data, kept for the refits when updatableAS
+		vks::Buffer& instancesBuffer = tlasInstancesBuffer3DGRT;
 		VK_CHECK_RESULT(vulkanDevice->createBuffer(
 			VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
 			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 			&instancesBuffer,
-			sizeof(VkAccelerationStructureInstanceKHR),
-			&instance));
+			instances.size() * sizeof(VkAccelerationStructureInstanceKHR),
+			instances.data()));
 
 		VkDeviceOrHostAddressConstKHR instanceDataDeviceAddress{};
 		instanceDataDeviceAddress.deviceAddress = getBufferDeviceAddress(instancesBuffer.buffer);
@@ -716,10 +1138,13 @@ public:
 		accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
 		accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
 		accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+		if (updatableAS) {
+			accelerationStructureBuildGeometryInfo.flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+		}
 		accelerationStructureBuildGeometryInfo.geometryCount = 1;
 		accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
 
-		uint32_t primitive_count = 1;
+		uint32_t primitive_count = static_cast<uint32_t>(instances.size());
 
 		VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo{};
 		accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
@@ -745,7 +1170,7 @@ public:
 		VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo{};
 		accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
 		accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-		accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+		accelerationBuildGeometryInfo.flags = accelerationStructureBuildGeometryInfo.flags;
 		accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
 		accelerationBuildGeometryInfo.dstAccelerationStructure = topLevelAS3DGRT.handle;
 		accelerationBuildGeometryInfo.geometryCount = 1;
@@ -761,6 +1186,8 @@ public:
 
 		// TLAS size
 		tlasSize = accelerationStructureBuildSizesInfo.accelerationStructureSize;
+		tlasUpdateScratchSize = accelerationStructureBuildSizesInfo.updateScratchSize;
+		tlasBuildScratchSize = accelerationStructureBuildSizesInfo.buildScratchSize;
 
 		// Build the acceleration structure on the device via a one-time command buffer submission
 		// Some implementations may support acceleration structure building on the host (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands), but we prefer device builds
@@ -783,7 +1210,203 @@ public:
 		accelerationDeviceAddressInfo.accelerationStructure = topLevelAS3DGRT.handle;
 
 		deleteScratchBuffer(scratchBuffer);
-		instancesBuffer.destroy();
+		if (!updatableAS) {
+			instancesBuffer.destroy();
+			instancesBuffer = {};
+		}
+	}
+
+	// Writes the particle instances that intersect the frustum to instances when they changed, returns whether they did
+	bool cullInstances3DGRT(VkAccelerationStructureInstanceKHR* instances)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+		// side and near planes, the far plane does not clip the rays
+		std::vector<uint32_t> visible;
+		visible.reserve(tlasInstances3DGRT.size());
+		for (uint32_t i = 0; i < tlasInstances3DGRT.size(); i++) {
+			if (frustum.checkSphere(glm::vec3(instanceSpheres3DGRT[i]), instanceSpheres3DGRT[i].w, 5)) visible.push_back(i);
+		}
+		culledInstances = static_cast<uint32_t>(tlasInstances3DGRT.size() - visible.size());
+		if (visible == visibleInstances3DGRT) {
+			return false;
+		}
+		visibleInstances3DGRT.swap(visible);
+		for (size_t i = 0; i < visibleInstances3DGRT.size(); i++) {
+			instances[i] = tlasInstances3DGRT[visibleInstances3DGRT[i]];
+		}
+		cullTimeMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+		return true;
+	}
+
+	// Records the build of topLevelAS3DGRT over the visible particle instances at instancesAddress
+	void cmdBuildCulledTLAS3DGRT(VkCommandBuffer commandBuffer, VkDeviceAddress instancesAddress)
+	{
+		if (cullScratchBuffer.handle == VK_NULL_HANDLE) {
+			cullScratchBuffer = createScratchBuffer(tlasBuildScratchSize);
+		}
+		VkAccelerationStructureGeometryKHR instancesGeometry{};
+		instancesGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+		instancesGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+		instancesGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+		instancesGeometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+		instancesGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
+		instancesGeometry.geometry.instances.data.deviceAddress = instancesAddress;
+		VkAccelerationStructureBuildRangeInfoKHR instancesRangeInfo{};
+		instancesRangeInfo.primitiveCount = static_cast<uint32_t>(visibleInstances3DGRT.size());
+		const VkAccelerationStructureBuildRangeInfoKHR* pInstancesRangeInfo = &instancesRangeInfo;
+
+		VkAccelerationStructureBuildGeometryInfoKHR tlasBuildGeometryInfo{};
+		tlasBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+		tlasBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+		tlasBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+		if (updatableAS) {
+			tlasBuildGeometryInfo.flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+		}
+		tlasBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+		tlasBuildGeometryInfo.dstAccelerationStructure = topLevelAS3DGRT.handle;
+		tlasBuildGeometryInfo.geometryCount = 1;
+		tlasBuildGeometryInfo.pGeometries = &instancesGeometry;
+		tlasBuildGeometryInfo.scratchData.deviceAddress = cullScratchBuffer.deviceAddress;
+		vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &tlasBuildGeometryInfo, &pInstancesRangeInfo);
+	}
+
+	/*
+		Refit the 3DGRT acceleration structures after the activated particles [firstParticle, firstParticle + numParticles)
+		were edited in particleDensities. particlePrimitives.comp moves that range by translation (the edit made on the device)
+		and re-encloses it, then the BLAS and the TLAS are updated in place from the same command buffer. A refit keeps the
+		BVH topology of the last build, so past refitRebuildFraction dirty particles or refitMaxUpdates refits the BLAS is
+		rebuilt instead
+	*/
+	void refitAccelerationStructure3DGRT(uint32_t firstParticle, uint32_t numParticles, const glm::vec3& translation = glm::vec3(0.0f))
+	{
+		if (!updatableAS || gModel.instancedBLAS || gModel.proceduralPrimitives) {
+			vks::tools::exitFatal("Acceleration structure refits need AS_UPDATE and the enclosing icosahedron BLAS", -1);
+		}
+		if (firstParticle >= gModel.size()) {
+			return;
+		}
+		auto startTime = std::chrono::high_resolution_clock::now();
+		numParticles = std::min(numParticles, static_cast<uint32_t>(gModel.size()) - firstParticle);
+		const bool rebuild = numParticles > refitRebuildFraction * gModel.size() || refitsSinceBuild >= refitMaxUpdates;
+
+		// the frames in flight trace the structures being updated
+		VK_CHECK_RESULT(vkDeviceWaitIdle(device));
+
+		if (refitScratchBuffer.handle == VK_NULL_HANDLE) {
+			refitScratchBuffer = createScratchBuffer(std::max(blasUpdateScratchSize, tlasUpdateScratchSize));
+		}
+
+		// (1) re-enclose the dirty range, the particles are already activated in particleDensities
+		VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		vks::utils::GaussianEnclosingUniformData rangeUniformData = gaussianEnclosingUniformData;
+		rangeUniformData.firstGaussian = firstParticle;
+		rangeUniformData.numOfGaussians = firstParticle + numParticles;
+		rangeUniformData.opts |= vks::utils::MOGRenderPreActivatedParticles;
+		rangeUniformData.translation = glm::vec4(translation, 0.0f);
+		vkCmdUpdateBuffer(commandBuffer, gaussianEnclosing.uniformBuffer.buffer, 0, sizeof(rangeUniformData), &rangeUniformData);
+
+		VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+		memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		memoryBarrier.dstAccessMask = VK_ACCESS_UNIFORM_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, gaussianEnclosing.pipeline);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, gaussianEnclosing.pipelineLayout, 0, 1, &gaussianEnclosing.descriptorSet, 0, 0);
+		const uint32_t groupSize = specializationData.enclosingGroupSize;
+		vkCmdDispatch(commandBuffer, (numParticles + groupSize - 1) / groupSize, 1, 1);
+
+		// restore the whole model range for the next full enclosing pass
+		memoryBarrier.srcAccessMask = VK_ACCESS_UNIFORM_READ_BIT;
+		memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+		vkCmdUpdateBuffer(commandBuffer, gaussianEnclosing.uniformBuffer.buffer, 0, sizeof(gaussianEnclosingUniformData), &gaussianEnclosingUniformData);
+
+		memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+		// (2) BLAS: refit in place, or a full build into a new BLAS referenced by the instance
+		if (rebuild) {
+			vulkanDevice->flushCommandBuffer(commandBuffer, graphicsQueue);
+			deleteAccelerationStructure(bottomLevelAS3DGRT);
+			vkResetQueryPool(device, ASBuildTimeStampQueryPool, 0, 2);
+			createBottomLevelAccelerationStructure3DGRT();
+			refitsSinceBuild = 0;
+
+			VK_CHECK_RESULT(tlasInstancesBuffer3DGRT.map());
+			static_cast<VkAccelerationStructureInstanceKHR*>(tlasInstancesBuffer3DGRT.mapped)->accelerationStructureReference = bottomLevelAS3DGRT.deviceAddress;
+			tlasInstancesBuffer3DGRT.unmap();
+
+			commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		}
+		else {
+			uint32_t primitiveCount = 0;
+			VkAccelerationStructureGeometryKHR geometry = bottomLevelGeometry3DGRT(primitiveCount);
+			VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo{};
+			buildRangeInfo.primitiveCount = primitiveCount;
+			const VkAccelerationStructureBuildRangeInfoKHR* pBuildRangeInfo = &buildRangeInfo;
+
+			VkAccelerationStructureBuildGeometryInfoKHR buildGeometryInfo{};
+			buildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+			buildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+			buildGeometryInfo.flags = bottomLevelBuildFlags3DGRT();
+			buildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;
+			buildGeometryInfo.srcAccelerationStructure = bottomLevelAS3DGRT.handle;
+			buildGeometryInfo.dstAccelerationStructure = bottomLevelAS3DGRT.handle;
+			buildGeometryInfo.geometryCount = 1;
+			buildGeometryInfo.pGeometries = &geometry;
+			buildGeometryInfo.scratchData.deviceAddress = refitScratchBuffer.deviceAddress;
+			vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &buildGeometryInfo, &pBuildRangeInfo);
+			refitsSinceBuild++;
+
+			// the TLAS refit reads the BLAS bounds and reuses the scratch buffer
+			memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+			memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+		}
+
+		// (3) TLAS: refit in place, its handle stays valid in the descriptor sets
+		VkAccelerationStructureGeometryKHR instancesGeometry{};
+		instancesGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+		instancesGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+		instancesGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+		instancesGeometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+		instancesGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
+		instancesGeometry.geometry.instances.data.deviceAddress = getBufferDeviceAddress(tlasInstancesBuffer3DGRT.buffer);
+		VkAccelerationStructureBuildRangeInfoKHR instancesRangeInfo{};
+		instancesRangeInfo.primitiveCount = 1;
+		const VkAccelerationStructureBuildRangeInfoKHR* pInstancesRangeInfo = &instancesRangeInfo;
+
+		VkAccelerationStructureBuildGeometryInfoKHR tlasBuildGeometryInfo{};
+		tlasBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+		tlasBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+		tlasBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+		tlasBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;
+		tlasBuildGeometryInfo.srcAccelerationStructure = topLevelAS3DGRT.handle;
+		tlasBuildGeometryInfo.dstAccelerationStructure = topLevelAS3DGRT.handle;
+		tlasBuildGeometryInfo.geometryCount = 1;
+		tlasBuildGeometryInfo.pGeometries = &instancesGeometry;
+		tlasBuildGeometryInfo.scratchData.deviceAddress = refitScratchBuffer.deviceAddress;
+		vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &tlasBuildGeometryInfo, &pInstancesRangeInfo);
+		vulkanDevice->flushCommandBuffer(commandBuffer, graphicsQueue);
+
+		lastRefitTimeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+		if (rebuild) {
+			std::cout << "BLAS rebuilt for " << numParticles << " particles in " << lastRefitTimeMs << "ms" << std::endl;
+		}
+	}
+
+	/*
+		--animateparticles: moves the first animatedParticles particles along a circle of 2% of the model extent, one turn
+		per timer period, through a refit every frame
+	*/
+	void animateParticles()
+	{
+		const float radius = 0.02f * glm::length(gModel.aabbMax - gModel.aabbMin);
+		const float theta = glm::radians(timer * 360.0f);
+		const glm::vec3 offset = radius * glm::vec3(cos(theta) - 1.0f, sin(theta), 0.0f);
+		refitAccelerationStructure3DGRT(0, animatedParticles, offset - animationOffset);
+		animationOffset = offset;
 	}
 #endif
 
@@ -824,6 +1447,12 @@ public:
 	}
 #endif
 
+	// ParticleDensity buffer bound to the hit shaders, decoded by fetchParticleDensity according to densityLayout
+	vks::Buffer& hitParticleDensities()
+	{
+		return gModel.densityLayout == vk3DGRT::DensityLayoutPacked ? packedParticleDensities : particleDensities;
+	}
+
 	/*
 		Create out gaussianEnclosing pipeline
 	*/
@@ -832,8 +1461,19 @@ public:
 		VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = vks::initializers::pipelineLayoutCreateInfo(&gaussianEnclosing.descriptorSetLayout, 1);
 		VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &gaussianEnclosing.pipelineLayout));
 
+		// SH degree of the raw attribute buffers, the workgroup size, the SH active degree epsilon and the packed density output
+		std::vector<VkSpecializationMapEntry> specializationMapEntries = {
+			vks::initializers::specializationMapEntry(7, sizeof(uint32_t) * 7, sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(13, offsetof(SpecializationData, enclosingGroupSize), sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(14, offsetof(SpecializationData, sphDegreeEpsilon), sizeof(float)),
+			vks::initializers::specializationMapEntry(15, offsetof(SpecializationData, densityLayout), sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(19, offsetof(SpecializationData, alphaMinThreshold), sizeof(float)),
+		};
+		VkSpecializationInfo specializationInfo = vks::initializers::specializationInfo(static_cast<uint32_t>(specializationMapEntries.size()), specializationMapEntries.data(), sizeof(SpecializationData), &specializationData);
+
 		VkComputePipelineCreateInfo computePipelineCreateInfo = vks::initializers::computePipelineCreateInfo(gaussianEnclosing.pipelineLayout, 0);
 		computePipelineCreateInfo.stage = loadShader(getShadersPath() + DIR_PATH + "particlePrimitives.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+		computePipelineCreateInfo.stage.pSpecializationInfo = &specializationInfo;
 
 		VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &gaussianEnclosing.pipeline));
 	}
@@ -851,6 +1491,13 @@ public:
 			vks::initializers::specializationMapEntry(3, sizeof(uint32_t) * 3, sizeof(uint32_t)),
 			vks::initializers::specializationMapEntry(4, sizeof(uint32_t) * 4, sizeof(uint32_t)),
 			vks::initializers::specializationMapEntry(5, sizeof(uint32_t) * 5, sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(6, sizeof(uint32_t) * 6, sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(7, sizeof(uint32_t) * 7, sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(9, offsetof(SpecializationData, blasMode), sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(15, offsetof(SpecializationData, densityLayout), sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(11, offsetof(SpecializationData, workGroupSizeX), sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(12, offsetof(SpecializationData, workGroupSizeY), sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(19, offsetof(SpecializationData, alphaMinThreshold), sizeof(float)),
 		};
 		VkSpecializationInfo specializationInfo = vks::initializers::specializationInfo(static_cast<uint32_t>(specializationMapEntries.size()), specializationMapEntries.data(), sizeof(SpecializationData), &specializationData);
 
@@ -861,10 +1508,13 @@ public:
 		pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
 		pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
 
-		VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &pipelineLayout));
+		// shared by the pipelines of every k-buffer size
+		if (pipelineLayout == VK_NULL_HANDLE) {
+			VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &pipelineLayout));
+		}
 
 		VkComputePipelineCreateInfo computePipelineCreateInfo = vks::initializers::computePipelineCreateInfo(pipelineLayout, 0);
-		computePipelineCreateInfo.stage = loadShader(getShadersPath() + DIR_PATH + "particleRendering.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+		computePipelineCreateInfo.stage = loadShader(getShadersPath() + DIR_PATH + kBufferShaderName("particleRendering", ".comp.spv"), VK_SHADER_STAGE_COMPUTE_BIT);
 		computePipelineCreateInfo.stage.pSpecializationInfo = &specializationInfo;
 
 		VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &pipeline));
@@ -878,6 +1528,13 @@ public:
 			vks::initializers::specializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t)),
 			vks::initializers::specializationMapEntry(2, sizeof(uint32_t) * 2, sizeof(uint32_t)),
 			vks::initializers::specializationMapEntry(3, sizeof(uint32_t) * 3, sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(6, sizeof(uint32_t) * 6, sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(7, sizeof(uint32_t) * 7, sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(9, offsetof(SpecializationData, blasMode), sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(10, offsetof(SpecializationData, hitCounts), sizeof(VkBool32)),
+			vks::initializers::specializationMapEntry(15, offsetof(SpecializationData, densityLayout), sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(16, offsetof(SpecializationData, adaptiveTracing), sizeof(VkBool32)),
+			vks::initializers::specializationMapEntry(19, offsetof(SpecializationData, alphaMinThreshold), sizeof(float)),
 		};
 		VkSpecializationInfo specializationInfo = vks::initializers::specializationInfo(static_cast<uint32_t>(specializationMapEntries.size()), specializationMapEntries.data(), sizeof(SpecializationData), &specializationData);
 
@@ -888,15 +1545,19 @@ public:
 		pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
 		pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
 
-		VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &pipelineLayout));
+		// shared by the pipelines of every k-buffer size
+		if (pipelineLayout == VK_NULL_HANDLE) {
+			VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &pipelineLayout));
+		}
 		/*
 			Setup ray tracing shader groups
 		*/
 		std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
+		shaderGroups.clear();
 
 		// Ray generation group
 		{
-			shaderStages.push_back(loadShader(getShadersPath() + DIR_PATH + "raygen.rgen.spv", VK_SHADER_STAGE_RAYGEN_BIT_KHR));
+			shaderStages.push_back(loadShader(getShadersPath() + DIR_PATH + kBufferShaderName("raygen", ".rgen.spv"), VK_SHADER_STAGE_RAYGEN_BIT_KHR));
 			shaderStages[shaderStages.size() - 1].pSpecializationInfo = &specializationInfo;
 			VkRayTracingShaderGroupCreateInfoKHR shaderGroup{};
 			shaderGroup.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
@@ -929,8 +1590,8 @@ public:
 
 		// Closest hit group 0 : Basic
 		{
-			shaderStages.push_back(loadShader(getShadersPath() + DIR_PATH + "anyhit.rahit.spv", VK_SHADER_STAGE_ANY_HIT_BIT_KHR));
-			//shaderStages[shaderStages.size() - 1].pSpecializationInfo = &specializationInfo;
+			shaderStages.push_back(loadShader(getShadersPath() + DIR_PATH + kBufferShaderName("anyhit", ".rahit.spv"), VK_SHADER_STAGE_ANY_HIT_BIT_KHR));
+			shaderStages[shaderStages.size() - 1].pSpecializationInfo = &specializationInfo;
 			VkRayTracingShaderGroupCreateInfoKHR shaderGroup{};
 			shaderGroup.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
 			shaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
@@ -938,6 +1599,13 @@ public:
 			shaderGroup.closestHitShader = VK_SHADER_UNUSED_KHR;
 			shaderGroup.intersectionShader = VK_SHADER_UNUSED_KHR;
 			shaderGroup.anyHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
+			if (gModel.proceduralPrimitives) {
+				// the particle AABBs are hit by the analytic max response test
+				shaderStages.push_back(loadShader(getShadersPath() + DIR_PATH + "particleIntersection.rint.spv", VK_SHADER_STAGE_INTERSECTION_BIT_KHR));
+				shaderStages[shaderStages.size() - 1].pSpecializationInfo = &specializationInfo;
+				shaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_PROCEDURAL_HIT_GROUP_KHR;
+				shaderGroup.intersectionShader = static_cast<uint32_t>(shaderStages.size()) - 1;
+			}
 			shaderGroups.push_back(shaderGroup);
 		}
 		/*
@@ -955,6 +1623,78 @@ public:
 	}
 #endif
 
+	// BLAS_MODE_* of 3dgs.glsl for the acceleration structures this build and gModel create
+	vk3DGRT::BlasMode blasMode() const
+	{
+#if SPLIT_BLAS && !RAY_QUERY
+		return vk3DGRT::BlasModeSplit;
+#else
+		return gModel.instancedBLAS ? vk3DGRT::BlasModeInstanced : gModel.proceduralPrimitives ? vk3DGRT::BlasModeProcedural : vk3DGRT::BlasModeIcosahedra;
+#endif
+	}
+
+	// Shader of the kBufferSize permutation (VulkanFullRTCompile.bat), the default depth of 3dgs.glsl keeps the plain name
+	std::string kBufferShaderName(const std::string& name, const std::string& extension)
+	{
+		return name + (kBufferSize == 16 ? "" : "_k" + std::to_string(kBufferSize)) + extension;
+	}
+
+	/*
+		Builds the particle rendering pipeline (and its shader binding tables) of every k-buffer size ahead of time,
+		with K_BUFFER_PERMUTATIONS or a sweep. Otherwise only the one of kBufferSize. The other sizes whose shader
+		permutations were not compiled are skipped
+	*/
+	void createKBufferPipelines()
+	{
+		const uint32_t selected = kBufferSize;
+		const bool allSizes = K_BUFFER_PERMUTATIONS || kBufferSweep;
+		auto startTime = std::chrono::high_resolution_clock::now();
+		for (uint32_t k : kBufferSizes) {
+			if (!allSizes && k != selected) {
+				continue;
+			}
+			kBufferSize = k;
+#if RAY_QUERY
+			const std::string shaderFiles[] = { kBufferShaderName("particleRendering", ".comp.spv") };
+#else
+			const std::string shaderFiles[] = { kBufferShaderName("raygen", ".rgen.spv"), kBufferShaderName("anyhit", ".rahit.spv") };
+#endif
+			const auto missing = std::find_if(std::begin(shaderFiles), std::end(shaderFiles),
+				[&](const std::string& file) { return !vks::tools::fileExists(getShadersPath() + DIR_PATH + file); });
+			if (k != selected && missing != std::end(shaderFiles)) {
+				std::cerr << "Warning: " << *missing << " not found, no pipeline for a k-buffer size of " << k << "\n";
+				continue;
+			}
+			createParticleRenderingPipeline();
+			KBufferPipeline& kBufferPipeline = kBufferPipelines[k];
+			kBufferPipeline.pipeline = pipeline;
+#if !RAY_QUERY
+			createShaderBindingTables();
+			kBufferPipeline.shaderBindingTables = shaderBindingTables;
+#endif
+		}
+		auto endTime = std::chrono::high_resolution_clock::now();
+		std::cout << "Built " << kBufferPipelines.size() << " k-buffer pipeline(s) in "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count() << "ms" << std::endl;
+		selectKBufferSize(selected);
+	}
+
+	// Switches the particle rendering pass to a pipeline of createKBufferPipelines, the command buffers are recorded every frame
+	bool selectKBufferSize(uint32_t k)
+	{
+		auto it = kBufferPipelines.find(k);
+		if (it == kBufferPipelines.end()) {
+			std::cerr << "No pipeline was built for a k-buffer size of " << k << "\n";
+			return false;
+		}
+		kBufferSize = k;
+		pipeline = it->second.pipeline;
+#if !RAY_QUERY
+		shaderBindingTables = it->second.shaderBindingTables;
+#endif
+		return true;
+	}
+
 	void createDescriptorSets()
 	{
 		std::vector<VkDescriptorPoolSize> poolSizes = {
@@ -963,11 +1703,9 @@ public:
 			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 * swapChain.imageCount),
 			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 * swapChain.imageCount),
 			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 * swapChain.imageCount),
-#if SPLIT_BLAS && !RAY_QUERY
-			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 * swapChain.imageCount),
-#endif 
-#if ENABLE_HIT_COUNTS && !RAY_QUERY
-			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 * swapChain.imageCount),
+#if !RAY_QUERY
+			// primitive ids and hit counts
+			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 * swapChain.imageCount),
 #endif
 		};
 		VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, swapChain.imageCount); // gaussianEnclosing pipeline + ray tracing pipeline
@@ -997,19 +1735,15 @@ public:
 			// Binding 2: Uniform buffer Dynamic
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2),
 			// Binding 3: Uniform buffer Static
-			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 3),
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_INTERSECTION_BIT_KHR, 3),
 			// Binding 4: Storage buffer - Particle Densities
-			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 4),
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_INTERSECTION_BIT_KHR, 4),
 			// Binding 5: Storage buffer - Particle Sph Coefficients
-			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 5),
-#if SPLIT_BLAS && !RAY_QUERY
-			// Binding 6: Storage buffer - primitive Id
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_INTERSECTION_BIT_KHR, 5),
+			// Binding 6: Storage buffer - primitive Id, the anyhit shader holds it in every BLAS mode
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_ANY_HIT_BIT_KHR, 6),
-	#endif
-	#if ENABLE_HIT_COUNTS
 			// Binding 7: Storage buffer - Ray Hit Count for debugging
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 7),
-	#endif
 #endif
 		};
 
@@ -1051,12 +1785,15 @@ public:
 				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2, &frame.uniformBuffer.descriptor),
 				// Binding 3: Uniform data Static
 				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 3, &frame.uniformBufferStatic.descriptor),
-				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4, &particleDensities.descriptor),
+				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4, &hitParticleDensities().descriptor),
 				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5, &particleSphCoefficients.descriptor),
 #if SPLIT_BLAS && !RAY_QUERY
 				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6, &splitBLAS.d_splittedPrimitiveIdsDeviceAddress.descriptor),
+#elif !RAY_QUERY
+				// not read outside BLAS_MODE_SPLIT, any storage buffer fills the binding
+				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6, &hitParticleDensities().descriptor),
 #endif
-#if ENABLE_HIT_COUNTS && !RAY_QUERY
+#if !RAY_QUERY
 				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7, &frame.hitCountsbuffer.descriptor),
 #endif
 			};
@@ -1075,7 +1812,7 @@ public:
 			// gaussianEnclosing pipeline
 			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6),	// vertices, triangles, position, rotation, scale, density
 			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1),
-			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1),	// particle density
+			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2),	// particle density, packed particle density
 			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3),	// particle sph coefficient
 			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1)		// particle totalCount
 		};
@@ -1109,6 +1846,8 @@ public:
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 10),
 			// Binding 11: Particle Total Counts
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 11),
+			// Binding 12: Packed particle density
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 12),
 		};
 
 		VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCI = vks::initializers::descriptorSetLayoutCreateInfo(setLayoutBindings);
@@ -1143,6 +1882,8 @@ public:
 			vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10, &particleSphCoefficients.descriptor),
 			// Binding 11: Particle Total Counts
 			vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 11, &gaussianEnclosing.totalCounts.descriptor),
+			// Binding 12: Packed particle density, not written with DensityLayoutFloat so any storage buffer fills the binding
+			vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 12, &hitParticleDensities().descriptor),
 		};
 
 		vkUpdateDescriptorSets(device, static_cast<uint32_t>(computeWriteDescriptorSets.size()), computeWriteDescriptorSets.data(), 0, nullptr);
@@ -1173,8 +1914,8 @@ public:
 		vkCmdBindPipeline(gaussianEnclosing.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, gaussianEnclosing.pipeline);
 		vkCmdBindDescriptorSets(gaussianEnclosing.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, gaussianEnclosing.pipelineLayout, 0, 1, &gaussianEnclosing.descriptorSet, 0, 0);
 
-		uint32_t groupCountX = NUM_OF_GAUSSIANS;
-		vkCmdDispatch(gaussianEnclosing.commandBuffer, (gModel.splatSet.size() + groupCountX - 1)/ groupCountX, 1, 1);
+		uint32_t groupCountX = specializationData.enclosingGroupSize;
+		vkCmdDispatch(gaussianEnclosing.commandBuffer, (gModel.size() + groupCountX - 1)/ groupCountX, 1, 1);
 
 		VK_CHECK_RESULT(vkEndCommandBuffer(gaussianEnclosing.commandBuffer));
 	}
@@ -1196,6 +1937,7 @@ public:
 		VK_CHECK_RESULT(vkBeginCommandBuffer(frame.commandBuffer, &cmdBufInfo));
 
 		vkCmdResetQueryPool(frame.commandBuffer, frame.timeStampQueryPool, 0, static_cast<uint32_t>(frame.timeStamps.size()));
+		cmdBuildCulledTLAS(frame, frame.commandBuffer);
 
 #if RAY_QUERY
 		vkCmdBindPipeline(frame.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
@@ -1215,7 +1957,9 @@ public:
 			subresourceRange);
 
 #if RAY_QUERY
-		vkCmdDispatch(frame.commandBuffer, (width + TB_SIZE_X - 1) / TB_SIZE_X, (height + TB_SIZE_Y - 1) / TB_SIZE_Y, 1);
+		const uint32_t groupSizeX = specializationData.workGroupSizeX;
+		const uint32_t groupSizeY = specializationData.workGroupSizeY;
+		vkCmdDispatch(frame.commandBuffer, (width + groupSizeX - 1) / groupSizeX, (height + groupSizeY - 1) / groupSizeY, 1);
 #else
 		VkStridedDeviceAddressRegionKHR emptySbtEntry = {};
 		vkCmdTraceRaysKHR(
@@ -1350,9 +2094,11 @@ public:
 
 	void updateGaussianEnclosingUniformBuffer()
 	{
-		gaussianEnclosingUniformData.numOfGaussians = gModel.splatSet.size();
+		gaussianEnclosingUniformData.numOfGaussians = gModel.size();
 		gaussianEnclosingUniformData.kernelMinResponse = 0.0113f;	// these values should be managed as config val
 		gaussianEnclosingUniformData.opts = vks::utils::MOGRenderNone;
+		if (gModel.preActivated)
+			gaussianEnclosingUniformData.opts |= vks::utils::MOGRenderPreActivatedParticles;
 		gaussianEnclosingUniformData.degree = 4;
 
 		// mapping
@@ -1437,7 +2183,18 @@ public:
 #endif
 
 		//gModel.load3DGRTObject(getAssetPath() + "3DGRTModels/lego/ckpt_last.pt", vulkanDevice);
-		gModel.load3DGRTModel(getAssetPath() + ASSET_PATH + PLY_FILE, vulkanDevice);
+		std::string modelFile = getAssetPath() + ASSET_PATH + PLY_FILE;
+#if LOAD_3DGRT_CONTAINER
+		modelFile = modelFile.substr(0, modelFile.find_last_of(".")) + ".3dgrt";
+#endif
+		gModel.load3DGRTModel(modelFile, vulkanDevice);
+
+		// The buffers only hold the loaded bands
+		specializationData.sphDegree = gModel.sphDegree;
+		uniformDataStatic.sphEvalDegree = std::min(uniformDataStatic.sphEvalDegree, gModel.sphDegree);
+#if GAUSSIAN_LIGHT_FIELD
+		gaussianLightField.uniformDataStatic.sphEvalDegree = std::min(gaussianLightField.uniformDataStatic.sphEvalDegree, gModel.sphDegree);
+#endif
 	}
 
 	bool initVulkan() {
@@ -1487,13 +2244,18 @@ public:
 		std::cout << "BLAS build time: " << delta_in_ms_BLAS << " (ms)\n";
 		std::cout << "TLAS build time: " << delta_in_ms_TLAS << " (ms)\n";
 		std::cout << "BLAS size: " << blasSize << " (Bytes)\n";
+		if (blasBuildSize != blasSize)
+			std::cout << "BLAS size before compaction: " << blasBuildSize << " (Bytes)\n";
 		std::cout << "TLAS size: " << tlasSize << " (Bytes)\n";
+		std::cout << "Enclosing vertex/index size: " << sizeof(float) * (gModel.vertices.count + gModel.indices.count) << " (Bytes)" << (gModel.instancedBLAS ? ", instanced\n" : gModel.proceduralPrimitives ? ", procedural AABBs\n" : "\n");
 		std::cout << "*** AS Build Info END ***\n";
 #elif defined(VK_USE_PLATFORM_ANDROID_KHR)
 		LOGD("\n*** AS Build Info BEGIN ***\n");
 		LOGD("BLAS build time: %f (ms))\n", delta_in_ms_BLAS);
 		LOGD("TLAS build time: %f (ms))\n", delta_in_ms_TLAS);
 		LOGD("BLAS size: %llu (Bytes))\n", blasSize);
+		if (blasBuildSize != blasSize)
+			LOGD("BLAS size before compaction: %llu (Bytes))\n", blasBuildSize);
 		LOGD("TLAS size: %llu (Bytes))\n", tlasSize);
 		LOGD("*** AS Build Info END ***\n");
 #endif
@@ -1513,6 +2275,32 @@ public:
 		vkDeviceWaitIdle(device);
 	}
 
+	// Host version of the enclosing pass (vk3DGRT::enclosing), the particles were activated and packed at load time
+	void buildGaussianEnclosingIcosaHedronOnHost()
+	{
+		vk3DGRT::enclosing::Options options;
+		options.opts = gaussianEnclosingUniformData.opts;
+		options.kernelMinResponse = gaussianEnclosingUniformData.kernelMinResponse;
+		options.kernelDegree = gaussianEnclosingUniformData.degree;
+		if (gModel.proceduralPrimitives) {
+			// no enclosing geometry, the BLAS is built over the particle AABBs
+			vk3DGRT::enclosing::buildParticleAabbs((const float*)gModel.particleDensityData, gModel.size(), options, gaussianEnclosing.hostVertices);
+			vulkanDevice->copyBuffer(gaussianEnclosing.hostVertices.data(), &gModel.vertices.storageBuffer, graphicsQueue);
+			return;
+		}
+		if (gModel.instancedBLAS) {
+			// the particles only differ by their instance transform
+			vk3DGRT::enclosing::buildUnitIcosaHedron(gaussianEnclosing.hostVertices, gaussianEnclosing.hostIndices);
+			vk3DGRT::enclosing::buildInstanceTransforms((const float*)gModel.particleDensityData, gModel.size(), options, gaussianEnclosing.hostInstanceTransforms);
+		}
+		else {
+			vk3DGRT::enclosing::buildIcosaHedra((const float*)gModel.particleDensityData, gModel.size(), options, gaussianEnclosing.hostVertices, gaussianEnclosing.hostIndices);
+		}
+
+		vulkanDevice->copyBuffer(gaussianEnclosing.hostVertices.data(), &gModel.vertices.storageBuffer, graphicsQueue);
+		vulkanDevice->copyBuffer(gaussianEnclosing.hostIndices.data(), &gModel.indices.storageBuffer, graphicsQueue);
+	}
+
 #if GAUSSIAN_LIGHT_FIELD
 	//light field add
 	void calculateGaussianLightFieldSamples() {
@@ -1524,24 +2312,9 @@ public:
 
 		gaussianLightField.viewInverse.resize(cameraNum);
 		
-		float minX, minY, minZ, maxX, maxY, maxZ;
-		minX = minY = minZ = FLT_MAX;
-		maxX = maxY = maxZ = FLT_MIN;
-		
-		//calcuate max/min positions of gaussians
-		int iterMax = gModel.splatSet.size();
-		for (int i = 0; i < iterMax; i++) {
-			float x = gModel.splatSet.positions[i * 3];
-			float y = gModel.splatSet.positions[i * 3 + 1];
-			float z = gModel.splatSet.positions[i * 3 + 2];
-
-			if (x < minX) minX = x;
-			if (y < minY) minY = y;
-			if (z < minZ) minZ = z;
-			if (x > maxX) maxX = x;
-			if (y > maxY) maxY = y;
-			if (z > maxZ) maxZ = z;
-		}
+		//max/min positions of gaussians, gathered at load time
+		float minX = gModel.aabbMin.x, minY = gModel.aabbMin.y, minZ = gModel.aabbMin.z;
+		float maxX = gModel.aabbMax.x, maxY = gModel.aabbMax.y, maxZ = gModel.aabbMax.z;
 
 		// ̰   ڽ  ƴϸ 4d image plane  ...
 		// ϴ  ϴ° Ȯε, ̰ gpt õ  , github ã   ...
@@ -1678,14 +2451,10 @@ public:
 			// binding 3, 4 : viewInverseMatrix, rayDirs
 			// binding 5, g : buffer references(ParticleDensities, ParticleSphCoefficients)
 			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4),
-#if SPLIT_BLAS && !RAY_QUERY
-			// binding 6 : primitives id
+#if !RAY_QUERY
+			// binding 7 : primitives id
 			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1),
-#endif 
-//#if ENABLE_HIT_COUNTS && !RAY_QUERY
-//			// binding 7 : Ray Hit Count
-//			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1),
-//#endif
+#endif
 		};
 		VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, 1);
 
@@ -1714,23 +2483,17 @@ public:
 			// Binding 1: Ray tracing result image
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 1),
 			// Binding 2: Uniform buffer Static
-			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2),
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_INTERSECTION_BIT_KHR, 2),
 			// Binding 3: Camera Information - viewInverseMatrix
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 3),
 			// Binding 4 : rayDirs
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 4),
 			// Binding 5: Storage buffer - Particle Densities
-			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 5),
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_INTERSECTION_BIT_KHR, 5),
 			// Binding 6: Storage buffer - Particle Sph Coefficients
-			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 6),
-	#if SPLIT_BLAS && !RAY_QUERY
-			// Binding 7: Storage buffer - primitive Id
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_INTERSECTION_BIT_KHR, 6),
+			// Binding 7: Storage buffer - primitive Id, anyhitGaussianLightField.rahit holds it in every BLAS mode
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_ANY_HIT_BIT_KHR, 7),
-	#endif
-	//#if ENABLE_HIT_COUNTS
-	//		// Binding 7: Storage buffer - Ray Hit Count for debugging
-	//		vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 7),
-	//#endif
 #endif
 		};
 
@@ -1774,15 +2537,15 @@ public:
 				// Binding 4: rayDir
 				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4, &gaussianLightField.rayDirBuffer.descriptor),
 				// Binding 5: particle densities
-				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5, &particleDensities.descriptor),
+				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5, &hitParticleDensities().descriptor),
 				// Binding 6: particle Sph Coefficients
 				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6, &particleSphCoefficients.descriptor),
+				// Binding 7: primitive ids, not read outside BLAS_MODE_SPLIT where any storage buffer fills the binding
 #if SPLIT_BLAS && !RAY_QUERY
 				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7, &splitBLAS.d_splittedPrimitiveIdsDeviceAddress.descriptor),
+#elif !RAY_QUERY
+				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7, &hitParticleDensities().descriptor),
 #endif
-//#if ENABLE_HIT_COUNTS && !RAY_QUERY
-//				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7, &frame.hitCountsbuffer.descriptor),
-//#endif
 			};
 
 			vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, VK_NULL_HANDLE);
@@ -1798,6 +2561,11 @@ public:
 			vks::initializers::specializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t)),
 			vks::initializers::specializationMapEntry(2, sizeof(uint32_t) * 2, sizeof(uint32_t)),
 			vks::initializers::specializationMapEntry(3, sizeof(uint32_t) * 3, sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(6, sizeof(uint32_t) * 6, sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(7, sizeof(uint32_t) * 7, sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(9, offsetof(SpecializationData, blasMode), sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(15, offsetof(SpecializationData, densityLayout), sizeof(uint32_t)),
+			vks::initializers::specializationMapEntry(19, offsetof(SpecializationData, alphaMinThreshold), sizeof(float)),
 		};
 		VkSpecializationInfo specializationInfo = vks::initializers::specializationInfo(static_cast<uint32_t>(specializationMapEntries.size()), specializationMapEntries.data(), sizeof(SpecializationData), &specializationData);
 
@@ -1849,8 +2617,8 @@ public:
 
 		// Closest hit group 0 : Basic
 		{
-			shaderStages.push_back(loadShader(getShadersPath() + DIR_PATH + "anyhit.rahit.spv", VK_SHADER_STAGE_ANY_HIT_BIT_KHR));
-			//shaderStages[shaderStages.size() - 1].pSpecializationInfo = &specializationInfo;
+			shaderStages.push_back(loadShader(getShadersPath() + DIR_PATH + "anyhitGaussianLightField.rahit.spv", VK_SHADER_STAGE_ANY_HIT_BIT_KHR));
+			shaderStages[shaderStages.size() - 1].pSpecializationInfo = &specializationInfo;
 			VkRayTracingShaderGroupCreateInfoKHR shaderGroup{};
 			shaderGroup.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
 			shaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
@@ -1858,6 +2626,13 @@ public:
 			shaderGroup.closestHitShader = VK_SHADER_UNUSED_KHR;
 			shaderGroup.intersectionShader = VK_SHADER_UNUSED_KHR;
 			shaderGroup.anyHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
+			if (gModel.proceduralPrimitives) {
+				// the particle AABBs are hit by the analytic max response test
+				shaderStages.push_back(loadShader(getShadersPath() + DIR_PATH + "particleIntersectionGaussianLightField.rint.spv", VK_SHADER_STAGE_INTERSECTION_BIT_KHR));
+				shaderStages[shaderStages.size() - 1].pSpecializationInfo = &specializationInfo;
+				shaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_PROCEDURAL_HIT_GROUP_KHR;
+				shaderGroup.intersectionShader = static_cast<uint32_t>(shaderStages.size()) - 1;
+			}
 			gaussianLightField.shaderGroups.push_back(shaderGroup);
 		}
 		/*
@@ -1987,6 +2762,387 @@ public:
 	//light field end
 #endif
 
+#if !RAY_QUERY
+	void createTimingTarget()
+	{
+		VkImageCreateInfo imageInfo{};
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageInfo.extent.width = width;
+		imageInfo.extent.height = height;
+		imageInfo.extent.depth = 1;
+		imageInfo.mipLevels = 1;
+		imageInfo.arrayLayers = 1;
+		imageInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		VK_CHECK_RESULT(vkCreateImage(device, &imageInfo, nullptr, &timingTarget.image));
+
+		VkMemoryRequirements memReqs;
+		vkGetImageMemoryRequirements(device, timingTarget.image, &memReqs);
+		VkMemoryAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocInfo.allocationSize = memReqs.size;
+		allocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		VK_CHECK_RESULT(vkAllocateMemory(device, &allocInfo, nullptr, &timingTarget.memory));
+		VK_CHECK_RESULT(vkBindImageMemory(device, timingTarget.image, timingTarget.memory, 0));
+
+		VkImageViewCreateInfo viewInfo{};
+		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewInfo.image = timingTarget.image;
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.format = imageInfo.format;
+		viewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+		VK_CHECK_RESULT(vkCreateImageView(device, &viewInfo, nullptr, &timingTarget.view));
+		timingTarget.width = width;
+		timingTarget.height = height;
+	}
+
+	void destroyTimingTarget()
+	{
+		if (timingTarget.image == VK_NULL_HANDLE) {
+			return;
+		}
+		vkDestroyImageView(device, timingTarget.view, nullptr);
+		vkDestroyImage(device, timingTarget.image, nullptr);
+		vkFreeMemory(device, timingTarget.memory, nullptr);
+		timingTarget = TimingTarget{};
+	}
+
+	/*
+		GPU time of one trace of the current camera into timingTarget, an offscreen storage image of the window size.
+		The result image binding of the current frame points there until draw() writes the swap chain image back
+	*/
+	float traceTimeMs(VkQueryPool queryPool)
+	{
+		if (timingTarget.width != width || timingTarget.height != height) {
+			destroyTimingTarget();
+			createTimingTarget();
+		}
+		updateUniformBuffer();
+		FrameObject& frame = frameObjects[getCurrentFrameIndex()];
+		VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+		// the frames in flight may still read the descriptor set
+		VK_CHECK_RESULT(vkQueueWaitIdle(graphicsQueue));
+		VkDescriptorImageInfo storageImageDescriptor{ VK_NULL_HANDLE, timingTarget.view, VK_IMAGE_LAYOUT_GENERAL };
+		VkWriteDescriptorSet resultImageWrite = vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &storageImageDescriptor);
+		vkUpdateDescriptorSets(device, 1, &resultImageWrite, 0, VK_NULL_HANDLE);
+
+		VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		vkCmdResetQueryPool(commandBuffer, queryPool, 0, 2);
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayout, 0, 1, &frame.descriptorSet, 0, 0);
+		vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(pushConstants), &pushConstants);
+		vks::tools::setImageLayout(commandBuffer, timingTarget.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, subresourceRange);
+
+		VkStridedDeviceAddressRegionKHR emptySbtEntry = {};
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 0);
+		vkCmdTraceRaysKHR(
+			commandBuffer,
+			&shaderBindingTables.raygen.stridedDeviceAddressRegion,
+			&shaderBindingTables.miss.stridedDeviceAddressRegion,
+			&shaderBindingTables.hit.stridedDeviceAddressRegion,
+			&emptySbtEntry,
+			width,
+			height,
+			1);
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 1);
+		vulkanDevice->flushCommandBuffer(commandBuffer, graphicsQueue);
+
+		uint64_t timeStamps[2];
+		vkGetQueryPoolResults(device, queryPool, 0, 2, sizeof(timeStamps), timeStamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+		return float(timeStamps[1] - timeStamps[0]) * deviceProperties.limits.timestampPeriod / 1000000.0f;
+	}
+
+	uint32_t numDatasetCameras()
+	{
+#if QUATERNION_CAMERA
+		return quaternionCamera.getNumOfCams();
+#else
+		return static_cast<uint32_t>(camera.getCamNames().size());
+#endif
+	}
+
+	// Mean traceTimeMs over the dataset cameras (or the current camera without a dataset), after one warm up trace
+	float datasetTraceTimeMs(VkQueryPool queryPool)
+	{
+		const uint32_t numCameras = numDatasetCameras();
+		traceTimeMs(queryPool);
+		float traceMs = 0.0f;
+		for (uint32_t cameraIdx = 0; cameraIdx < std::max(numCameras, 1u); cameraIdx++) {
+			if (numCameras > 0) {
+#if QUATERNION_CAMERA
+				quaternionCamera.setDatasetCamera(quaternionCamera.dataType, cameraIdx, (float)width / height, false);
+#else
+				camera.setDatasetCamera(camera.dataType, cameraIdx, (float)width / height);
+#endif
+			}
+			traceMs += traceTimeMs(queryPool);
+		}
+		return traceMs / std::max(numCameras, 1u);
+	}
+
+	/*
+		--kbuffersweep: traces the dataset cameras with every k-buffer size and appends one csv row per size.
+		Exits with the fastest trace time as the pick
+	*/
+	void tuneKBufferSize()
+	{
+		const std::string fileName = "../results/texts/kBufferSweep.csv";
+		std::ifstream existing(fileName);
+		const bool writeHeader = !existing.good() || existing.peek() == std::ifstream::traits_type::eof();
+		existing.close();
+		std::ofstream out(fileName, std::ios::app);
+		if (!out.is_open()) {
+			std::cout << "Error: failed to open " << fileName << std::endl;
+		}
+		else if (writeHeader) {
+			out << "asset,kBufferSize,cameras,traceMs\n";
+		}
+
+		VkQueryPool queryPool;
+		VkQueryPoolCreateInfo queryPoolInfo{};
+		queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		queryPoolInfo.queryCount = 2;
+		VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolInfo, nullptr, &queryPool));
+
+		std::cout << "*** k-buffer sweep BEGIN ***\n";
+		uint32_t bestK = kBufferSize;
+		float bestTraceMs = FLT_MAX;
+		for (uint32_t k : kBufferSizes) {
+			if (!selectKBufferSize(k)) {
+				continue;
+			}
+			const float traceMs = datasetTraceTimeMs(queryPool);
+			std::cout << "k-buffer size " << k << ": trace " << traceMs << "ms\n";
+			if (out.is_open()) {
+				out << PLY_FILE << "," << k << "," << std::max(numDatasetCameras(), 1u) << "," << traceMs << "\n";
+			}
+			if (traceMs < bestTraceMs) {
+				bestTraceMs = traceMs;
+				bestK = k;
+			}
+		}
+		vkDestroyQueryPool(device, queryPool, nullptr);
+		std::cout << "Fastest trace with a k-buffer size of " << bestK << " (" << bestTraceMs << "ms), run with --kbuffer " << bestK << "\n";
+		std::cout << "*** k-buffer sweep END ***\n";
+	}
+#endif
+
+	/*
+		Frustum culling of the TLAS instances, the split cells (SPLIT_BLAS) or the particles of the instanced BLAS.
+		The instances outside the side and near planes of the camera frustum are left out of a new TLAS build, only when
+		the camera moved and the visible set changed. The visible instances go to the instance buffer of the frame, free
+		once its renderCompleteFence signalled, and cmdBuildCulledTLAS builds them at the start of its command buffer.
+		The single BLAS of the other modes (the icosahedra mode is one instance) has nothing to cull
+	*/
+	void cullAccelerationStructures(FrameObject& frame)
+	{
+		if (!frustumCulling || numCullableInstances() == 0) {
+			return;
+		}
+		const glm::mat4 viewProjection = glm::inverse(uniformDataDynamic.projInverse) * glm::inverse(uniformDataDynamic.viewInverse);
+		if (viewProjection == cullViewProjection) {
+			return;
+		}
+		cullViewProjection = viewProjection;
+		frustum.update(viewProjection);
+		// the rays start at the eye, before the near plane: move it to the eye
+		const glm::vec3 eye = glm::vec3(uniformDataDynamic.viewInverse[3]);
+		frustum.planes[vks::Frustum::BACK].w = -glm::dot(glm::vec3(frustum.planes[vks::Frustum::BACK]), eye);
+		if (frame.cullInstancesBuffer.buffer == VK_NULL_HANDLE) {
+			VK_CHECK_RESULT(vulkanDevice->createBuffer(
+				VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+				&frame.cullInstancesBuffer,
+				numCullableInstances() * sizeof(VkAccelerationStructureInstanceKHR)));
+			VK_CHECK_RESULT(frame.cullInstancesBuffer.map());
+		}
+		VkAccelerationStructureInstanceKHR* instances = static_cast<VkAccelerationStructureInstanceKHR*>(frame.cullInstancesBuffer.mapped);
+#if SPLIT_BLAS && !RAY_QUERY
+		frame.cullBuildPending = splitBLAS.cullCells(frustum, instances);
+		culledInstances = splitBLAS.culledCells;
+		cullTimeMs = splitBLAS.cullTimeMs;
+#elif !SPLIT_BLAS
+		frame.cullBuildPending = cullInstances3DGRT(instances);
+#endif
+	}
+
+	// Records the TLAS build of the last cull of the frame between the traces of the frames before and the trace of this one
+	void cmdBuildCulledTLAS(FrameObject& frame, VkCommandBuffer commandBuffer)
+	{
+		if (!frame.cullBuildPending) {
+			return;
+		}
+		frame.cullBuildPending = false;
+#if RAY_QUERY
+		const VkPipelineStageFlags traceStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+#else
+		const VkPipelineStageFlags traceStage = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+#endif
+		// the frames submitted before still trace the TLAS, and their cull builds share the scratch buffer
+		VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+		memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+		memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+		vkCmdPipelineBarrier(commandBuffer, traceStage | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+			0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+#if SPLIT_BLAS && !RAY_QUERY
+		splitBLAS.cmdBuildCulledTLAS(commandBuffer, getBufferDeviceAddress(frame.cullInstancesBuffer.buffer));
+#elif !SPLIT_BLAS
+		cmdBuildCulledTLAS3DGRT(commandBuffer, getBufferDeviceAddress(frame.cullInstancesBuffer.buffer));
+#endif
+		memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+		memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, traceStage, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+	}
+
+	uint32_t numCullableInstances()
+	{
+#if SPLIT_BLAS && !RAY_QUERY
+		return splitBLAS.numBLASes();
+#elif !SPLIT_BLAS
+		return static_cast<uint32_t>(tlasInstances3DGRT.size());
+#else
+		return 0;
+#endif
+	}
+
+#if !RAY_QUERY
+	// Culled count, TLAS build time and trace time of the start camera without and with frustum culling
+	void reportFrustumCulling()
+	{
+		VkQueryPoolCreateInfo queryPoolInfo{};
+		queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		queryPoolInfo.queryCount = 2;
+		VkQueryPool queryPool;
+		VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolInfo, nullptr, &queryPool));
+
+		traceTimeMs(queryPool);	// warm up
+		const float fullTraceMs = traceTimeMs(queryPool);
+
+		// traceTimeMs waited for the queue, the instance buffer of the frame is free
+		FrameObject& frame = frameObjects[getCurrentFrameIndex()];
+		cullAccelerationStructures(frame);
+		VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		vkCmdResetQueryPool(commandBuffer, queryPool, 0, 2);
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 0);
+		cmdBuildCulledTLAS(frame, commandBuffer);
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 1);
+		vulkanDevice->flushCommandBuffer(commandBuffer, graphicsQueue);
+		uint64_t timeStamps[2];
+		vkGetQueryPoolResults(device, queryPool, 0, 2, sizeof(timeStamps), timeStamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+		const float buildMs = float(timeStamps[1] - timeStamps[0]) * deviceProperties.limits.timestampPeriod / 1000000.0f;
+
+		const float culledTraceMs = traceTimeMs(queryPool);
+		vkDestroyQueryPool(device, queryPool, nullptr);
+
+		std::cout << "Frustum culling: " << culledInstances << " of " << numCullableInstances() << " TLAS instances culled, host " << cullTimeMs << "ms, TLAS build "
+			<< buildMs << "ms, trace " << fullTraceMs << "ms -> " << culledTraceMs << "ms" << std::endl;
+	}
+#endif
+
+#if SPLIT_BLAS && !RAY_QUERY
+	// The split TLAS and primitive id buffer are new objects after SplitBLAS::resplit
+	void updateSplitBLASDescriptorSets()
+	{
+		// the new TLAS holds every cell, the next frame culls again into instance buffers of the new cell count
+		cullViewProjection = glm::mat4(0.0f);
+		for (auto& frame : frameObjects)
+		{
+			frame.cullInstancesBuffer.destroy();
+			frame.cullInstancesBuffer = {};
+			frame.cullBuildPending = false;
+
+			VkWriteDescriptorSetAccelerationStructureKHR descriptorAccelerationStructureInfo = vks::initializers::writeDescriptorSetAccelerationStructureKHR();
+			descriptorAccelerationStructureInfo.accelerationStructureCount = 1;
+			descriptorAccelerationStructureInfo.pAccelerationStructures = &splitBLAS.splittedTLAS.handle;
+
+			VkWriteDescriptorSet accelerationStructureWrite{};
+			accelerationStructureWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			accelerationStructureWrite.pNext = &descriptorAccelerationStructureInfo;
+			accelerationStructureWrite.dstSet = frame.descriptorSet;
+			accelerationStructureWrite.dstBinding = 0;
+			accelerationStructureWrite.descriptorCount = 1;
+			accelerationStructureWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+
+			std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+				accelerationStructureWrite,
+				vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6, &splitBLAS.d_splittedPrimitiveIdsDeviceAddress.descriptor),
+			};
+			vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, VK_NULL_HANDLE);
+		}
+	}
+
+	/*
+		--splittune: splits and builds the acceleration structures again for every candidate cell count, traces the dataset
+		cameras (or the start camera) and appends one csv row per candidate. Exits with the fastest trace time as the pick
+	*/
+	void tuneSplitCells()
+	{
+		if (splitBLAS.adaptivePartition) {
+			std::cerr << "The split tuning sweeps the uniform grid, SPLIT_BLAS_ADAPTIVE is set\n";
+			return;
+		}
+		const std::string fileName = "../results/texts/splitBLASTuning.csv";
+		std::ifstream existing(fileName);
+		const bool writeHeader = !existing.good() || existing.peek() == std::ifstream::traits_type::eof();
+		existing.close();
+		std::ofstream out(fileName, std::ios::app);
+		if (!out.is_open()) {
+			std::cout << "Error: failed to open " << fileName << std::endl;
+		}
+		else if (writeHeader) {
+			out << "asset,cellsPerLongestAxis,blases,clippedTriangles,splitMs,blasBuildMs,tlasBuildMs,blasBytes,tlasBytes,cameras,traceMs\n";
+		}
+
+		VkQueryPool queryPool;
+		VkQueryPoolCreateInfo queryPoolInfo{};
+		queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		queryPoolInfo.queryCount = 2;
+		VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolInfo, nullptr, &queryPool));
+
+		// every candidate is split from scratch, the cache would only keep the last one
+		splitBLAS.cacheFile.clear();
+		std::cout << "*** Split tuning BEGIN ***\n";
+		uint32_t bestCells = splitBLAS.cellsPerLongestAxis;
+		float bestTraceMs = FLT_MAX;
+		for (uint32_t cells : splitCellsSweep) {
+			vkDeviceWaitIdle(device);
+			splitBLAS.cellsPerLongestAxis = cells;
+			splitBLAS.resplit(gModel.vertices.storageBuffer, gModel.indices.storageBuffer, graphicsQueue);
+			splitBLAS.printASBuildInfo(deviceProperties);
+			updateSplitBLASDescriptorSets();
+
+			// the warm up trace of datasetTraceTimeMs fills the caches of the new acceleration structures
+			const float traceMs = datasetTraceTimeMs(queryPool);
+
+			const SplitBLAS::SplitStats& stats = splitBLAS.splitStats;
+			const double splitMs = stats.partitionTimeMs + stats.clipTimeMs + stats.indexTimeMs;
+			std::cout << cells << " cells per longest axis: " << stats.numCellsUsed << " BLASes, split " << splitMs << "ms, build "
+				<< splitBLAS.blasBuildTimeMs + splitBLAS.tlasBuildTimeMs << "ms, " << splitBLAS.blasSize / (1024 * 1024) << "MB BLAS, trace " << traceMs << "ms\n";
+			if (out.is_open()) {
+				out << PLY_FILE << "," << cells << "," << stats.numCellsUsed << "," << stats.numClippedTriangles << "," << splitMs << ","
+					<< splitBLAS.blasBuildTimeMs << "," << splitBLAS.tlasBuildTimeMs << "," << splitBLAS.blasSize << "," << splitBLAS.tlasSize << ","
+					<< std::max(numDatasetCameras(), 1u) << "," << traceMs << "\n";
+			}
+			if (traceMs < bestTraceMs) {
+				bestTraceMs = traceMs;
+				bestCells = cells;
+			}
+		}
+		vkDestroyQueryPool(device, queryPool, nullptr);
+		std::cout << "Fastest trace with " << bestCells << " cells per longest axis (" << bestTraceMs << "ms), run with --splitcells " << bestCells << "\n";
+		std::cout << "*** Split tuning END ***\n";
+	}
+#endif
+
 	void prepare()
 	{
 		VulkanRTCommon::prepare();
@@ -2016,8 +3172,9 @@ public:
 			vulkanDevice->createAndCopyToDeviceBuffer(&uniformDataStatic, frame.uniformBufferStatic, sizeof(vks::utils::UniformDataStatic), graphicsQueue, usageFlags, memoryFlags);
 
 			// For debugging, write hit counts
-#if ENABLE_HIT_COUNTS && !RAY_QUERY
-			VK_CHECK_RESULT(vulkanDevice->createAndMapBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.hitCountsbuffer, sizeof(unsigned int) * width * height, nullptr));
+#if !RAY_QUERY
+			const VkDeviceSize hitCountsSize = sizeof(unsigned int) * (specializationData.hitCounts ? 2 * width * height : 1);
+			VK_CHECK_RESULT(vulkanDevice->createAndMapBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.hitCountsbuffer, hitCountsSize, nullptr));
 #endif
 
 			// Time Stamp for measuring performance.
@@ -2028,17 +3185,46 @@ public:
 		VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &gaussianEnclosing.totalCounts, sizeof(unsigned int), 0));
 		updateGaussianEnclosingUniformBuffer();
 
-		// allocate device memory for vertex/index buffer
-		gModel.allocateAttributeBuffers(vulkanDevice, graphicsQueue);
+		// allocate device memory for vertex/index buffer. A streamed .ply is parsed and uploaded on a thread from here on,
+		// nothing is submitted to graphicsQueue until waitForAttributes
+		gModel.allocateAttributeBuffers(vulkanDevice, graphicsQueue, transferQueue);
 		// particle density
-		VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &particleDensities, sizeof(ParticleDensity) * gModel.splatSet.size(), nullptr));
+		VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &particleDensities, sizeof(ParticleDensity) * gModel.size(), nullptr));
 		// particle sph coefficient
-		VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &particleSphCoefficients, sizeof(ParticleSphCoefficient) * gModel.splatSet.size(), nullptr));
+		VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &particleSphCoefficients, gModel.sphCoefficientStride() * gModel.size(), nullptr));
+		// packed particle density, read by the hit shaders instead
+		if (gModel.densityLayout == vk3DGRT::DensityLayoutPacked) {
+			VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &packedParticleDensities, sizeof(vk3DGRT::PackedParticleDensity) * gModel.size(), nullptr));
+		}
+		// the enclosing pipeline is built while the attributes stream in
+		const bool enclosingOnHost = gModel.hostEnclosing || gModel.instancedBLAS || gModel.proceduralPrimitives;
+		if (!enclosingOnHost) {
+			createGaussianEnclosingDescriptorSets();
+			createGaussianEnclosingPipeline();
+		}
+		gModel.waitForAttributes(vulkanDevice, graphicsQueue);
+		std::cout << "Model on the device " << gModel.loadTimeMs << "ms after the load started" << std::endl;
+
+		if (gModel.preActivated) {
+			gModel.uploadPreActivatedParticles(particleDensities, particleSphCoefficients, vulkanDevice, graphicsQueue);
+			if (gModel.densityLayout == vk3DGRT::DensityLayoutPacked)
+				gModel.uploadPackedParticleDensities(packedParticleDensities, vulkanDevice, graphicsQueue);
+		}
 
 		// (1) Gaussian Enclosing pass
-		createGaussianEnclosingDescriptorSets();
-		createGaussianEnclosingPipeline();
-		computeGaussianEnclosingIcosaHedron();
+		if (enclosingOnHost) {
+			buildGaussianEnclosingIcosaHedronOnHost();
+#if !SPLIT_BLAS
+			if (updatableAS) {
+				// the refits re-enclose their dirty range with particlePrimitives.comp
+				createGaussianEnclosingDescriptorSets();
+				createGaussianEnclosingPipeline();
+			}
+#endif
+		}
+		else {
+			computeGaussianEnclosingIcosaHedron();
+		}
 
 		// Create the acceleration structures used to render the ray traced scene
 #if LOAD_GLTF
@@ -2050,7 +3236,17 @@ public:
 		std::cout << "*** Split BLAS BEGIN ***\n";
 		auto startTime = std::chrono::high_resolution_clock::now();
 		splitBLAS.init(vulkanDevice);
-		splitBLAS.splitBlas(gModel.vertices.storageBuffer, gModel.indices.storageBuffer, graphicsQueue);
+#if SPLIT_BLAS_CACHE
+		std::string splitCacheFile = getAssetPath() + ASSET_PATH + PLY_FILE;
+		splitBLAS.cacheFile = splitCacheFile.substr(0, splitCacheFile.find_last_of(".")) + ".splitblas";
+#endif
+		if (gModel.hostEnclosing) {
+			// the enclosing geometry is still on the host, no read back
+			splitBLAS.splitBlas(gaussianEnclosing.hostVertices, gaussianEnclosing.hostIndices, graphicsQueue);
+		}
+		else {
+			splitBLAS.splitBlas(gModel.vertices.storageBuffer, gModel.indices.storageBuffer, graphicsQueue);
+		}
 		splitBLAS.initASBuildTimestamp(graphicsQueue);
 		splitBLAS.createAS(graphicsQueue);
 		auto      endTime = std::chrono::high_resolution_clock::now();
@@ -2058,12 +3254,34 @@ public:
 		std::cout << "Time spent for Split BLAS " << loadTime << "ms" << std::endl;
 		std::cout << "*** Split BLAS END ***\n";
 		splitBLAS.printASBuildInfo(deviceProperties);
+		splitBLAS.writeBuildTimes("../results/texts/splitBLASBuildTimes.csv", PLY_FILE);
+		// resplit reads the enclosing geometry back from the device
+		if (gModel.hostResidency != vk3DGRT::HostResidencyKeep) {
+			splitBLAS.releaseHostGeometry();
+		}
 #else
 		initASBuildTimestamp();
 		createBottomLevelAccelerationStructure3DGRT();
 		createTopLevelAccelerationStructure3DGRT();
 		printASBuildInfo();
 #endif
+		gaussianEnclosing.hostVertices.clear();
+		gaussianEnclosing.hostVertices.shrink_to_fit();
+		gaussianEnclosing.hostIndices.clear();
+		gaussianEnclosing.hostIndices.shrink_to_fit();
+		gaussianEnclosing.hostInstanceTransforms.clear();
+		gaussianEnclosing.hostInstanceTransforms.shrink_to_fit();
+		// the particles are on the device and enclosed, only the model summaries are read from here on
+		gModel.releaseHostParticles();
+		// the enclosing pass was the last reader of the float densities (unless it refits), the hit shaders read the packed ones
+#if SPLIT_BLAS
+		if (gModel.densityLayout == vk3DGRT::DensityLayoutPacked) {
+#else
+		if (gModel.densityLayout == vk3DGRT::DensityLayoutPacked && !updatableAS) {
+#endif
+			particleDensities.destroy();
+			particleDensities = {};
+		}
 
 		//gaussian light field add
 #if GAUSSIAN_LIGHT_FIELD
@@ -2104,19 +3322,54 @@ public:
 
 		// (2) Particle Rendering pass
 		createDescriptorSets();
-		createParticleRenderingPipeline();
+		createKBufferPipelines();
+
+#if SPLIT_BLAS && !RAY_QUERY
+		if (!splitCellsSweep.empty()) {
+			tuneSplitCells();
+			vkDeviceWaitIdle(device);
+			exit(0);
+		}
+#endif
+		if (kBufferSweep) {
+#if !RAY_QUERY
+			tuneKBufferSize();
+			vkDeviceWaitIdle(device);
+			exit(0);
+#else
+			std::cerr << "The k-buffer sweep times the ray tracing pipeline, RAY_QUERY is set\n";
+#endif
+		}
 #if !RAY_QUERY
-		createShaderBindingTables();
+		if (frustumCulling && numCullableInstances() > 0) {
+			reportFrustumCulling();
+		}
 #endif
 
 		prepared = true;
 	}
 
+	virtual void keyPressed(uint32_t keyCode)
+	{
+		// next k-buffer size that has a pipeline (K_BUFFER_PERMUTATIONS)
+		if (keyCode == KEY_KPADD && kBufferPipelines.size() > 1) {
+			auto next = kBufferPipelines.upper_bound(kBufferSize);
+			selectKBufferSize(next != kBufferPipelines.end() ? next->first : kBufferPipelines.begin()->first);
+			std::cout << "k-buffer size " << kBufferSize << "\n";
+		}
+	}
+
 	void draw()
 	{
-		FrameObject currentFrame = frameObjects[getCurrentFrameIndex()];
+		FrameObject& currentFrame = frameObjects[getCurrentFrameIndex()];
 		VulkanRTBase::prepareFrame(currentFrame);
 		updateUniformBuffer();
+#if !SPLIT_BLAS
+		if (animatedParticles > 0) {
+			animateParticles();
+		}
+#endif
+		cullAccelerationStructures(currentFrame);
 		VkDescriptorImageInfo storageImageDescriptor{ VK_NULL_HANDLE, swapChain.buffers[currentFrame.imageIndex].view, VK_IMAGE_LAYOUT_GENERAL };
 		VkWriteDescriptorSet resultImageWrite = vks::initializers::writeDescriptorSet(currentFrame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &storageImageDescriptor);
 		vkUpdateDescriptorSets(device, 1, &resultImageWrite, 0, VK_NULL_HANDLE);
@@ -2139,7 +3392,9 @@ public:
 			VK_CHECK_RESULT(vkMapMemory(device, currentFrameImg.memory, 0, currentFrameImg.size, 0, &currentFrameImg.mapped));
 
 			int stride = width * 4;
-			std::string fileName = "../results/evaluations/output/r_" + std::to_string(evalCameraIdx) + ".png";
+			// captures of each SH storage mode go to their own folder so that eval_quality.py can compare them
+			const char* sphStorageSuffix[] = { "", "_fp16", "_unorm8" };
+			std::string fileName = "../results/evaluations/output" + std::string(sphStorageSuffix[gModel.sphStorage]) + "/r_" + std::to_string(evalCameraIdx) + ".png";
 			stbi_write_png(fileName.c_str(), width, height, 4, currentFrameImg.mapped, stride);
 
 			std::cout << "\t- Camera index " << evalCameraIdx << " is completed.\n";
@@ -2161,10 +3416,10 @@ public:
 		}
 #endif
 
-#if ENABLE_HIT_COUNTS && !RAY_QUERY
+#if !RAY_QUERY
 		static unsigned int frame = 0;
 		static bool flag = true;
-		if (frame == 100 && flag) {
+		if (specializationData.hitCounts && frame == 100 && flag) {
 			vkQueueWaitIdle(graphicsQueue);
 			printRayHitCounts(currentFrame);
 
@@ -2177,20 +3432,31 @@ public:
 #endif
 	}
 
-#if ENABLE_HIT_COUNTS && !RAY_QUERY
-	// Print the ray hit count of each pixel of last frame to the txt file.
+#if !RAY_QUERY
+	// Print the ray hit count and the trace count of each pixel of last frame to the txt files.
 	void printRayHitCounts(FrameObject currentFrame) {
 		uint32_t* uintData = static_cast<uint32_t*>(currentFrame.hitCountsbuffer.mapped);
 
-		FILE* fp = fopen("../results/texts/rayHitCountsOutput.txt", "w");
-		if (fp) {
+		const char* fileNames[] = { "../results/texts/rayHitCountsOutput.txt", "../results/texts/rayTraceCountsOutput.txt" };
+		for (size_t n = 0; n < 2; ++n) {
+			const uint32_t* counts = uintData + n * width * height;
+			uint64_t total = 0;
+			FILE* fp = fopen(fileNames[n], "w");
 			for (size_t i = 0; i < height; ++i) {
 				for (size_t j = 0; j < width; ++j) {
-					fprintf(fp, "%u ", uintData[i * width + j]);
+					if (fp) {
+						fprintf(fp, "%u ", counts[i * width + j]);
+					}
+					total += counts[i * width + j];
+				}
+				if (fp) {
+					fprintf(fp, "\n");
 				}
-				fprintf(fp, "\n");
 			}
-			fclose(fp);
+			if (fp) {
+				fclose(fp);
+			}
+			std::cout << (n == 0 ? "Hits" : "Traces") << " per pixel: " << static_cast<double>(total) / (width * height) << "\n";
 		}
 	}
 #endif
@@ -1,10 +1,11 @@
 import os
+import sys
 import cv2
 import numpy as np
 from skimage.metrics import structural_similarity as ssim
 
 gt_dir = 'ground_truth'
-test_dirs = ['3dgvrt', 'vk3dgs', '3dgrt']
+test_dirs = sys.argv[1:] if len(sys.argv) > 1 else ['3dgvrt', 'vk3dgs', '3dgrt']
 
 def calculate_psnr(img1, img2):
     mse = np.mean((img1.astype(np.float32) - img2.astype(np.float32)) ** 2)
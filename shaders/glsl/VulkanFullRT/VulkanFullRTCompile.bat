@@ -1,7 +1,20 @@
-C:\VulkanSDK\1.4.313.0\Bin\glslc.exe --target-env=vulkan1.4 raygen.rgen -o raygen.rgen.spv
-C:\VulkanSDK\1.4.313.0\Bin\glslc.exe --target-env=vulkan1.4 raygenGaussianLightField.rgen -o raygenGaussianLightField.rgen.spv
-C:\VulkanSDK\1.4.313.0\Bin\glslc.exe --target-env=vulkan1.4 anyhit.rahit -o anyhit.rahit.spv
-C:\VulkanSDK\1.4.313.0\Bin\glslc.exe --target-env=vulkan1.4 miss.rmiss -o miss.rmiss.spv
-C:\VulkanSDK\1.4.313.0\Bin\glslc.exe --target-env=vulkan1.4 particlePrimitives.comp -o particlePrimitives.comp.spv
-C:\VulkanSDK\1.4.313.0\Bin\glslc.exe --target-env=vulkan1.4 particleRendering.comp -o particleRendering.comp.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 raygen.rgen -o raygen.rgen.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 raygenGaussianLightField.rgen -o raygenGaussianLightField.rgen.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 anyhit.rahit -o anyhit.rahit.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DGAUSSIAN_LIGHT_FIELD_LAYOUT anyhit.rahit -o anyhitGaussianLightField.rahit.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 particleIntersection.rint -o particleIntersection.rint.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DGAUSSIAN_LIGHT_FIELD_LAYOUT particleIntersection.rint -o particleIntersectionGaussianLightField.rint.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 miss.rmiss -o miss.rmiss.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 shadow.rmiss -o shadow.rmiss.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 particlePrimitives.comp -o particlePrimitives.comp.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 particleRendering.comp -o particleRendering.comp.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DMAX_HIT_PER_TRACE=4 raygen.rgen -o raygen_k4.rgen.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DMAX_HIT_PER_TRACE=4 anyhit.rahit -o anyhit_k4.rahit.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DMAX_HIT_PER_TRACE=4 particleRendering.comp -o particleRendering_k4.comp.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DMAX_HIT_PER_TRACE=8 raygen.rgen -o raygen_k8.rgen.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DMAX_HIT_PER_TRACE=8 anyhit.rahit -o anyhit_k8.rahit.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DMAX_HIT_PER_TRACE=8 particleRendering.comp -o particleRendering_k8.comp.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DMAX_HIT_PER_TRACE=32 raygen.rgen -o raygen_k32.rgen.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DMAX_HIT_PER_TRACE=32 anyhit.rahit -o anyhit_k32.rahit.spv
+"%VULKAN_SDK%\Bin\glslc.exe" --target-env=vulkan1.4 -DMAX_HIT_PER_TRACE=32 particleRendering.comp -o particleRendering_k32.comp.spv
 pause
\ No newline at end of file
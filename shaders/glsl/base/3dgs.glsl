@@ -5,20 +5,45 @@
  *
  */
 
-#define NUM_OF_GAUSSIANS 1024 // This macro should be managed with Define.h
-
-#define SPLIT_BLAS 0 // This macro should be managed with Define.h
+/*
+	Switches selected by the application at pipeline creation (VulkanFullRT::SpecializationData), no shader rebuild:
+	constant_id 9		blasMode, one of BLAS_MODE_* (SPLIT_BLAS, INSTANCED_BLAS, PROCEDURAL_PRIMITIVES of Define.h)
+	constant_id 10		hitCounts, writes the per pixel hit counts to binding 7 (ENABLE_HIT_COUNTS)
+	constant_id 11, 12	local_size_x_id / local_size_y_id of particleRendering.comp (TB_SIZE_X, TB_SIZE_Y)
+	constant_id 13		local_size_x_id of particlePrimitives.comp (NUM_OF_GAUSSIANS)
+	constant_id 14		sphDegreeEpsilon of particlePrimitives.comp (SPH_ACTIVE_DEGREE_EPSILON)
+	constant_id 15		densityLayout, one of DENSITY_LAYOUT_* (PARTICLE_DENSITY_LAYOUT)
+	constant_id 16		adaptiveTracing of raygen.rgen (ADAPTIVE_TRACING)
+	constant_id 19		alphaMinThreshold, density cutoff of the alpha test (ALPHA_MIN_THRESHOLD)
+*/
+#define BLAS_MODE_ICOSAHEDRA 0	// one BLAS of the enclosing icosahedra, 20 triangles per particle
+#define BLAS_MODE_SPLIT 1		// icosahedra split into a BLAS per cell, primitive ids remapped through binding 6
+#define BLAS_MODE_INSTANCED 2	// unit icosahedron BLAS, one instance per particle
+#define BLAS_MODE_PROCEDURAL 3	// one AABB per particle, particleIntersection.rint
 
 /* 3dgrt parameters */
 #define EPS_T 1e-9
 #define SPECULAR_DIMENSION 45
-#define MAX_HIT_PER_TRACE 16	//do not change
-#define ALPHA_MIN_THRESHOLD 0.0039215686275 // "threedgrt_tracer/optixTracer.cpp" search "alphaMinThreshold" : 1.0f / 255.0f
+// k-buffer depth. Compiled for 4, 8, 16 and 32 with -DMAX_HIT_PER_TRACE (VulkanFullRTCompile.bat), raygen and anyhit must match.
+// The application selects the permutation with K_BUFFER_SIZE / --kbuffer
+#ifndef MAX_HIT_PER_TRACE
+#define MAX_HIT_PER_TRACE 16
+#endif
+#define ALPHA_MIN_THRESHOLD 0.0039215686275 // "threedgrt_tracer/optixTracer.cpp" search "alphaMinThreshold" : 1.0f / 255.0f. Default of the alphaMinThreshold specialization constant
 
 #define MAX_SPH_DEGREE 3 // "configs/render/3dgrt.yaml - particle_radiance_sph_degree"
 #define SPH_MAX_NUM_COEFFS 16	// x = MAX_SPH_DEGREE (x+1) * (x+1)
 #define ENABLE_NORMALS false	// just for training
-#define ENABLE_HIT_COUNTS 0		// Should be managed with Define.h
+/* particle sph coefficient storage, selected with the sphStorageMode specialization constant (vk3DGRT::SphStorageMode) */
+#define SPH_STORAGE_FLOAT 0		// 48 floats per particle at degree 3
+#define SPH_STORAGE_HALF 1		// 48 halfs per particle at degree 3, 24 words
+#define SPH_STORAGE_UNORM8 2	// half albedo + per particle specular min/max + 45 unorm8 codes, 16 words at degree 3
+/* particle density layout read by the hit shaders, selected with the densityLayout specialization constant (vk3DGRT::DensityLayout) */
+#define DENSITY_LAYOUT_FLOAT 0	// ParticleDensity, 3 uvec4 per particle (48 bytes)
+#define DENSITY_LAYOUT_PACKED 1	// fp32 position, unorm16 density | sphActiveDegree << 16, fp16 quaternion and scale, 2 uvec4 per particle (32 bytes)
+/* coefficient counts of a SH degree, the stored degree is selected with the sphDegree specialization constant */
+#define SPH_NUM_COEFFS(degree) (((degree) + 1) * ((degree) + 1))
+#define SPH_SPECULAR_DIMENSION(degree) (3 * (SPH_NUM_COEFFS(degree) - 1))
 #define PARTICLE_KERNEL_DEGREE 4 // "configs/render/3dgrt.yaml - particle_kernel_degree" : 4
 #define SURFEL_PRIMITIVE false // "configs/render/3dgrt.yaml - primitive_type" : instances -> false
 
@@ -58,7 +83,7 @@ struct ParticleDensity {
 	float density;
 	vec4 quaternion;
 	vec3 scale;
-	float padding;
+	float sphActiveDegree;	// highest SH band above SPH_ACTIVE_DEGREE_EPSILON, the bands past it are neither fetched nor evaluated
 };
 
 struct RayHit {
@@ -68,6 +93,7 @@ struct RayHit {
 
 struct RayPayload {
 	RayHit hits[MAX_HIT_PER_TRACE];
+	uint k;	// k-buffer depth of the trace, only the first k hits are gathered (raygen.rgen adaptiveTracing)
 };
 
 #if BUFFER_REFERENCE
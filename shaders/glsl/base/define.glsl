@@ -7,9 +7,6 @@
  *
  */
 
-#define TB_SIZE_X 1	// Should be managed with define.glsl
-#define TB_SIZE_Y 2	// Should be managed with define.glsl
-
 #define RAY_TMIN 0.1f
 #define SHADOW_RAY_ORIGIN_MOVEMENT_EPSILON 0.1f	
 
@@ -63,21 +63,24 @@ void fetchParticleDensity(
     out vec3 particlePosition,
     out vec3 particleScale,
     out mat3 particleRotation,
-    out float particleDensity) {
+    out float particleDensity,
+    out uint particleSphDegree) {
     const ParticleDensity particleData = Densities[nonuniformEXT(densityBufferDeviceAddress)].d[nonuniformEXT(particleIdx)];
 
     particlePosition = particleData.position;
     particleScale = particleData.scale;
     particleRotation = quaternionWXYZToMatrix(particleData.quaternion);
     particleDensity = particleData.density;
+    particleSphDegree = uint(particleData.sphActiveDegree);
 }
 
 void fetchParticleSphCoefficients(
     const uint particleIdx,
     //const float sphCoefficientBufferDeviceAddress,
+    const uint fetchDegree,
     out vec3 sphCoefficients[]) {
     const uint particleOffset = particleIdx * SPH_MAX_NUM_COEFFS * 3;
-    for (unsigned int i = 0; i < SPH_MAX_NUM_COEFFS; i++) {
+    for (unsigned int i = 0; i < SPH_NUM_COEFFS(fetchDegree); i++) {
         const int offset = i * 3;
         sphCoefficients[i] = vec3(
             particlesSphCoefficients[nonuniformEXT(particleOffset + offset + 0)],
@@ -91,26 +94,75 @@ void fetchParticleDensity(
     out vec3 particlePosition,
     out vec3 particleScale,
     out mat3 particleRotation,
-    out float particleDensity) {
-    const ParticleDensity particleData = particleDensities.d[nonuniformEXT(particleIdx)];
-
-    particlePosition = particleData.position;
-    particleScale = particleData.scale;
-    particleRotation = quaternionWXYZToMatrix(particleData.quaternion);
-    particleDensity = particleData.density;
+    out float particleDensity,
+    out uint particleSphDegree) {
+    vec4 quaternion;
+    if (densityLayout == DENSITY_LAYOUT_PACKED) {
+        // two 16 byte loads instead of three
+        const uvec4 positionDensity = particleDensities.d[nonuniformEXT(particleIdx * 2)];
+        const uvec4 quaternionScale = particleDensities.d[nonuniformEXT(particleIdx * 2 + 1)];
+        particlePosition = uintBitsToFloat(positionDensity.xyz);
+        particleDensity = unpackUnorm2x16(positionDensity.w).x;
+        particleSphDegree = positionDensity.w >> 16;
+        quaternion = vec4(unpackHalf2x16(quaternionScale.x), unpackHalf2x16(quaternionScale.y));
+        particleScale = vec3(unpackHalf2x16(quaternionScale.z), unpackHalf2x16(quaternionScale.w).x);
+    }
+    else {
+        // ParticleDensity
+        const uvec4 positionDensity = particleDensities.d[nonuniformEXT(particleIdx * 3)];
+        quaternion = uintBitsToFloat(particleDensities.d[nonuniformEXT(particleIdx * 3 + 1)]);
+        const vec4 scaleSphDegree = uintBitsToFloat(particleDensities.d[nonuniformEXT(particleIdx * 3 + 2)]);
+        particlePosition = uintBitsToFloat(positionDensity.xyz);
+        particleDensity = uintBitsToFloat(positionDensity.w);
+        particleScale = scaleSphDegree.xyz;
+        particleSphDegree = uint(scaleSphDegree.w);
+    }
+    particleRotation = quaternionWXYZToMatrix(quaternion);
 }
 
 // load spherical harmonics coefficient
+// only the sphDegree bands are stored, of which the fetchDegree ones are read (min of sphEvalDegree and the particle sphActiveDegree)
 void fetchParticleSphCoefficients(
     const uint particleIdx,
+    const uint fetchDegree,
     out vec3 sphCoefficients[SPH_MAX_NUM_COEFFS]) {
-    const uint particleOffset = particleIdx * SPH_MAX_NUM_COEFFS * 3;	// each has 3 elements
-    for (uint i = 0; i < SPH_MAX_NUM_COEFFS; i++) {
-        uint offset = i * 3;	// each has 3 elements
-        sphCoefficients[i] = vec3(
-            particleSphCoefficients.c[nonuniformEXT(particleOffset + offset + 0)],
-            particleSphCoefficients.c[nonuniformEXT(particleOffset + offset + 1)],
-            particleSphCoefficients.c[nonuniformEXT(particleOffset + offset + 2)]);
+    const uint numCoeffs = SPH_NUM_COEFFS(sphDegree);
+    const uint specularDimension = SPH_SPECULAR_DIMENSION(sphDegree);
+    const uint numFetched = SPH_NUM_COEFFS(fetchDegree) * 3;	// floats
+    if (sphStorageMode == SPH_STORAGE_HALF) {
+        const uint particleOffset = particleIdx * ((numCoeffs * 3 + 1) / 2);	// two halfs per word
+        for (uint i = 0; i < (numFetched + 1) / 2; i++) {
+            const vec2 coefficients = unpackHalf2x16(particleSphCoefficients.c[nonuniformEXT(particleOffset + i)]);
+            sphCoefficients[(i * 2) / 3][(i * 2) % 3] = coefficients.x;
+            if (i * 2 + 1 < numFetched) {
+                sphCoefficients[(i * 2 + 1) / 3][(i * 2 + 1) % 3] = coefficients.y;
+            }
+        }
+    }
+    else if (sphStorageMode == SPH_STORAGE_UNORM8) {
+        const uint particleOffset = particleIdx * ((3 + (specularDimension + 3) / 4 + 3) / 4 * 4);	// padded to 16 bytes
+        const vec2 albedoRG = unpackHalf2x16(particleSphCoefficients.c[nonuniformEXT(particleOffset + 0)]);
+        const vec2 albedoBSpecularMin = unpackHalf2x16(particleSphCoefficients.c[nonuniformEXT(particleOffset + 1)]);
+        const float specularMax = unpackHalf2x16(particleSphCoefficients.c[nonuniformEXT(particleOffset + 2)]).x;
+        const float specularMin = albedoBSpecularMin.y;
+        sphCoefficients[0] = vec3(albedoRG, albedoBSpecularMin.x);
+        const uint fetchedSpecular = numFetched - 3;
+        for (uint i = 0; i < (fetchedSpecular + 3) / 4; i++) {
+            const vec4 coefficients = specularMin + (specularMax - specularMin) * unpackUnorm4x8(particleSphCoefficients.c[nonuniformEXT(particleOffset + 3 + i)]);
+            for (uint j = 0; j < 4 && i * 4 + j < fetchedSpecular; j++) {
+                sphCoefficients[1 + (i * 4 + j) / 3][(i * 4 + j) % 3] = coefficients[j];
+            }
+        }
+    }
+    else {
+        const uint particleOffset = particleIdx * numCoeffs * 3;	// each has 3 elements
+        for (uint i = 0; i < numFetched / 3; i++) {
+            uint offset = i * 3;	// each has 3 elements
+            sphCoefficients[i] = vec3(
+                uintBitsToFloat(particleSphCoefficients.c[nonuniformEXT(particleOffset + offset + 0)]),
+                uintBitsToFloat(particleSphCoefficients.c[nonuniformEXT(particleOffset + offset + 1)]),
+                uintBitsToFloat(particleSphCoefficients.c[nonuniformEXT(particleOffset + offset + 2)]));
+        }
     }
 }
 #endif
@@ -150,6 +202,69 @@ vec3 radianceFromSpH(uint deg, const vec3 sphCoefficients[SPH_MAX_NUM_COEFFS], c
     return clamped ? max(rad, vec3(0.0f)) : rad;
 }
 
+// Max response of a particle along the ray: its kernel response at the squared canonical distance grayDist of the ray,
+// and the ray parameter hitT of that point. gro and grd are the canonical ray origin and (normalized) direction
+float particleMaxResponse(
+	vec3 rayOrigin,
+	vec3 rayDirection,
+	vec3 particlePosition,
+	vec3 particleScale,
+	mat3 particleRotation,
+	out float hitT,
+	out vec3 gro,
+	out vec3 grd,
+	out float grayDist) {
+	const vec3 giscl = vec3(1 / particleScale.x, 1 / particleScale.y, 1 / particleScale.z);
+	gro              = giscl * (particleRotation * (rayOrigin - particlePosition));
+	const vec3 grdu  = giscl * (particleRotation * rayDirection);
+	grd              = safeNormalize(grdu);
+
+	const float gcrodT = SURFEL_PRIMITIVE ? -gro.z / grd.z : dot(grd, -1 * gro);
+	const vec3 gcrod = SURFEL_PRIMITIVE ? gro + grd * gcrodT : cross(grd, gro);
+	grayDist = dot(gcrod, gcrod);
+
+	// the canonical space distance maps back to the ray parameter by the length of the canonical ray direction
+	hitT = gcrodT / length(grdu);
+
+	return particleResponse(grayDist);
+}
+
+// Analytic hit of a procedural particle primitive (PROCEDURAL_PRIMITIVES): distance along the ray of the
+// particle max response, rejected like processHit when the response or its alpha stays under the thresholds
+bool particleMaxResponseHit(
+	vec3 rayOrigin,
+	vec3 rayDirection,
+	uint particleIdx,
+#if BUFFER_REFERENCE
+	const uint64_t densityBufferDeviceAddress,
+#endif
+	float minParticleKernelDensity,
+	float minParticleAlpha,
+	out float hitT) {
+	vec3 particlePosition;
+	vec3 particleScale;
+	mat3 particleRotation;
+	float particleDensity;
+	uint particleSphDegree;
+
+	fetchParticleDensity(
+		particleIdx,
+#if BUFFER_REFERENCE
+		densityBufferDeviceAddress,
+#endif
+		particlePosition,
+		particleScale,
+		particleRotation,
+		particleDensity,
+		particleSphDegree);
+
+	vec3 gro, grd;
+	float grayDist;
+	const float gres = particleMaxResponse(rayOrigin, rayDirection, particlePosition, particleScale, particleRotation, hitT, gro, grd, grayDist);
+
+	return (gres > minParticleKernelDensity) && (min(0.99f, gres * particleDensity) > minParticleAlpha);
+}
+
 bool processHit(
 	vec3 rayOrigin,
 	vec3 rayDirection,
@@ -172,6 +287,7 @@ bool processHit(
 	vec3 particleScale;
 	mat3 particleRotation;
 	float particleDensity;
+	uint particleSphDegree;
 	
 	fetchParticleDensity(
         particleIdx,
@@ -181,20 +297,13 @@ bool processHit(
         particlePosition,
         particleScale,
         particleRotation,
-        particleDensity);
-
-	const vec3 giscl   = vec3(1 / particleScale.x, 1 / particleScale.y, 1 / particleScale.z);
-    const vec3 gposc   = (rayOrigin - particlePosition);
-    const vec3 gposcr  = (particleRotation * gposc);
-    const vec3 gro     = giscl * gposcr;
-    const vec3 rayDirR = particleRotation * rayDirection;
-    const vec3 grdu    = giscl * rayDirR;
-    const vec3 grd     = safeNormalize(grdu);
+        particleDensity,
+        particleSphDegree);
 
-	const vec3 gcrod = SURFEL_PRIMITIVE ? gro + grd * -gro.z / grd.z : cross(grd, gro);
-	const float grayDist = dot(gcrod, gcrod);
-
-	const float gres = particleResponse(grayDist);
+	vec3 gro, grd;
+	float grayDist;
+	float hitT;
+	const float gres = particleMaxResponse(rayOrigin, rayDirection, particlePosition, particleScale, particleRotation, hitT, gro, grd, grayDist);
 	const float galpha = min(0.99f, gres * particleDensity);
 
 	const bool acceptHit = (gres > minParticleKernelDensity) && (galpha > minParticleAlpha);
@@ -202,17 +311,17 @@ bool processHit(
 	if (acceptHit) {
         const float weight = galpha * (transmittance);
 
-		const vec3 grds = particleScale * grd * (SURFEL_PRIMITIVE ? -gro.z / grd.z : dot(grd, -1 * gro));
-		const float hitT = sqrt(dot(grds, grds));
-
+		// the bands above the particle active degree are all zero, neither fetched nor evaluated
+		const uint evalDegree = min(sphEvalDegree, particleSphDegree);
 		vec3 sphCoefficients[SPH_MAX_NUM_COEFFS];
 		fetchParticleSphCoefficients(
 			particleIdx,
 //#if BUFFER_REFERENCE
 //			sphCoefficientBufferDeviceAddress,
 //#endif
+			evalDegree,
 			sphCoefficients);
-		const vec3 grad = radianceFromSpH(sphEvalDegree, sphCoefficients, rayDirection, true);
+		const vec3 grad = radianceFromSpH(evalDegree, sphCoefficients, rayDirection, true);
 
 		radiance += vec4(grad * weight, 1.0f);
 		transmittance *= (1 - galpha);
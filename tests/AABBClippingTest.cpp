@@ -0,0 +1,109 @@
+/*
+ * Abura Soba, 2025
+ *
+ * The separating axis classification of AABB_Clipping.h against the scalar clipper: a triangle classified outside
+ * a cell clips to nothing, one classified inside clips to the unchanged triangle
+ */
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "AABB_Clipping.h"
+
+using namespace AABB_Triangle_Clipping;
+
+namespace {
+	struct Counts {
+		size_t outside = 0, crosses = 0, inside = 0, mismatches = 0;
+	};
+
+	// Classifies the triangle against the cells in batches and clips every pair the separating axis test decided
+	void checkTriangle(const glm::vec3* triangle, const std::vector<_AABB>& cells, Counts& counts) {
+		const _SATTriangle satTri(triangle);
+		_AABBBatch batch;
+		uint8_t overlap[_AABB_BATCH_SIZE];
+		_Polygon polygon;
+		for (size_t first = 0; first < cells.size(); first += _AABB_BATCH_SIZE) {
+			batch.size = 0;
+			for (size_t c = first; c < std::min(cells.size(), first + _AABB_BATCH_SIZE); c++) batch.push_back(cells[c]);
+			_classify_triangle_against_AABBs(satTri, batch, overlap);
+			for (int lane = 0; lane < batch.size; lane++) {
+				if (overlap[lane] == _CROSSES) {
+					counts.crosses++;
+					continue;
+				}
+				_clip_triangle_against_AABB(triangle, cells[first + lane], polygon);
+				bool mismatch;
+				if (overlap[lane] == _OUTSIDE) {
+					counts.outside++;
+					mismatch = polygon.size >= 3;
+				}
+				else {
+					counts.inside++;
+					mismatch = polygon.size != 3 || polygon.v[0] != triangle[0] || polygon.v[1] != triangle[1] || polygon.v[2] != triangle[2];
+				}
+				if (mismatch && counts.mismatches++ < 10) {
+					printf("Mismatch: triangle (%g %g %g) (%g %g %g) (%g %g %g), cell (%g %g %g) - (%g %g %g) classified %s, clipped to %d vertices\n",
+						triangle[0].x, triangle[0].y, triangle[0].z, triangle[1].x, triangle[1].y, triangle[1].z, triangle[2].x, triangle[2].y, triangle[2].z,
+						cells[first + lane].xmin, cells[first + lane].ymin, cells[first + lane].zmin, cells[first + lane].xmax, cells[first + lane].ymax, cells[first + lane].zmax,
+						overlap[lane] == _OUTSIDE ? "outside" : "inside", polygon.size);
+				}
+			}
+		}
+	}
+}
+
+int main() {
+	// a uniform grid of unit cells around the origin, offset so the cell bounds are not all exact in binary
+	const int cellsPerAxis = 6;
+	const float gridSize = 0.37f;
+	const glm::vec3 gridMin(-1.1f, -0.9f, -1.3f);
+	std::vector<_AABB> cells;
+	for (int k = 0; k < cellsPerAxis; k++)
+		for (int j = 0; j < cellsPerAxis; j++)
+			for (int i = 0; i < cellsPerAxis; i++)
+				cells.push_back({
+					gridMin.x + i * gridSize, gridMin.y + j * gridSize, gridMin.z + k * gridSize,
+					gridMin.x + (i + 1) * gridSize, gridMin.y + (j + 1) * gridSize, gridMin.z + (k + 1) * gridSize
+				});
+	const glm::vec3 gridMax = gridMin + glm::vec3(cellsPerAxis * gridSize);
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> position(0.0f, 1.0f);
+	auto randomPoint = [&]() { return gridMin + glm::vec3(position(rng), position(rng), position(rng)) * (gridMax - gridMin); };
+	auto cellCorner = [&]() {
+		std::uniform_int_distribution<int> corner(0, cellsPerAxis);
+		return gridMin + glm::vec3(corner(rng), corner(rng), corner(rng)) * gridSize;
+	};
+
+	Counts counts;
+	glm::vec3 triangle[3];
+	for (int t = 0; t < 20000; t++) {
+		const glm::vec3 center = randomPoint();
+		switch (t % 5) {
+		case 0:	// small, mostly inside one cell
+			for (int v = 0; v < 3; v++) triangle[v] = center + (glm::vec3(position(rng), position(rng), position(rng)) - 0.5f) * gridSize * 0.5f;
+			break;
+		case 1:	// large, spanning many cells
+			for (int v = 0; v < 3; v++) triangle[v] = randomPoint();
+			break;
+		case 2:	// sliver, nearly degenerate
+			triangle[0] = randomPoint();
+			triangle[1] = randomPoint();
+			triangle[2] = glm::mix(triangle[0], triangle[1], position(rng)) + glm::vec3(1e-6f);
+			break;
+		case 3:	// in a cell face plane
+			triangle[0] = cellCorner();
+			for (int v = 1; v < 3; v++) triangle[v] = glm::vec3(triangle[0].x, randomPoint().y, randomPoint().z);
+			break;
+		default:	// on the cell corners, touching the bounds exactly
+			for (int v = 0; v < 3; v++) triangle[v] = cellCorner();
+			break;
+		}
+		checkTriangle(triangle, cells, counts);
+	}
+
+	printf("%zu outside, %zu crosses, %zu inside, %zu mismatches\n", counts.outside, counts.crosses, counts.inside, counts.mismatches);
+	return counts.mismatches == 0 && counts.outside > 0 && counts.inside > 0 ? 0 : 1;
+}
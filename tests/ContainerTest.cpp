@@ -0,0 +1,124 @@
+/*
+ * Abura Soba, 2025
+ *
+ * The .3dgrt container written by container::write against container::read: a written container passes the layout
+ * and checksum checks of the loader, a flipped byte in any section, a truncated file or another version fails them
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <vector>
+
+#include "Vulkan3DGRTModel.h"
+
+using namespace vk3DGRT;
+
+namespace {
+	// Plausible trained splats: opaque enough to pass the alpha filter, small, with random SH coefficients
+	SplatSet randomSplatSet(size_t count, uint32_t sphDegree, std::mt19937& rng) {
+		std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+		SplatSet splatSet;
+		splatSet.sphDegree = sphDegree;
+		for (size_t i = 0; i < count; i++) {
+			for (int c = 0; c < 3; c++) {
+				splatSet.positions.push_back(unit(rng) * 10.0f);
+				splatSet.scale.push_back(-4.0f + unit(rng));	// log scale
+				splatSet.f_dc.push_back(unit(rng) * 0.5f);
+			}
+			glm::vec4 rotation = glm::normalize(glm::vec4(unit(rng), unit(rng), unit(rng), unit(rng)) + glm::vec4(0.0f, 0.0f, 0.0f, 1.5f));
+			for (int c = 0; c < 4; c++) splatSet.rotation.push_back(rotation[c]);
+			splatSet.opacity.push_back(1.0f + unit(rng));	// logit
+			for (size_t c = 0; c < splatSet.specularDimension(); c++) splatSet.f_rest.push_back(unit(rng) * 0.1f);
+		}
+		return splatSet;
+	}
+
+	// 8 byte aligned like a mapping, container::read casts the start to the header
+	std::vector<uint64_t> readFile(const std::filesystem::path& path, size_t& size) {
+		std::ifstream in(path, std::ios::binary | std::ios::ate);
+		size = in ? (size_t)in.tellg() : 0;
+		std::vector<uint64_t> data((size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+		in.seekg(0);
+		in.read((char*)data.data(), size);
+		return data;
+	}
+
+	bool readable(const std::vector<uint64_t>& data, size_t size) {
+		const void* sectionData[container::SectionCount];
+		return container::read((const char*)data.data(), size, "ContainerTest", sectionData) != nullptr;
+	}
+}
+
+int main() {
+	size_t failures = 0;
+	auto check = [&](bool condition, const char* what) {
+		if (!condition) {
+			printf("Failed: %s\n", what);
+			failures++;
+		}
+	};
+
+	// FNV-1a: the offset basis for no data, every byte of an unaligned tail counts
+	check(container::checksum(nullptr, 0) == 0xcbf29ce484222325ull, "checksum of no data is the FNV-1a offset basis");
+	const char text[] = "3dgrt container checksum";
+	char changed[sizeof(text)];
+	for (size_t i = 0; i < sizeof(text) - 1; i++) {
+		memcpy(changed, text, sizeof(text));
+		changed[i] ^= 1;
+		if (container::checksum(changed, sizeof(text) - 1) == container::checksum(text, sizeof(text) - 1)) {
+			printf("Failed: flipping byte %zu does not change the checksum\n", i);
+			failures++;
+		}
+	}
+
+	std::mt19937 rng(1234);
+	const std::filesystem::path path = std::filesystem::temp_directory_path() / "ContainerTest.3dgrt";
+	for (uint32_t sphDegree = 0; sphDegree <= MAX_N_FEATURES; sphDegree++) {
+		const SplatSet splatSet = randomSplatSet(1000, sphDegree, rng);
+		check(container::write(path.string().c_str(), splatSet), "container written");
+
+		size_t size;
+		std::vector<uint64_t> data = readFile(path, size);
+		const void* sectionData[container::SectionCount];
+		const container::Header* header = container::read((const char*)data.data(), size, "ContainerTest", sectionData);
+		check(header != nullptr, "written container reads back");
+		if (!header) continue;
+		check(header->numParticles > 0 && header->numParticles <= splatSet.size(), "kept particles");
+		check(header->specularDimension == splatSet.specularDimension(), "specular dimension");
+
+		// the particles reload as they were packed
+		std::vector<float> densities, sphCoefficients;
+		glm::vec3 aabbMin, aabbMax;
+		container::pack(splatSet, densities, sphCoefficients, aabbMin, aabbMax);
+		check(densities.size() * sizeof(float) == header->sections[container::SectionParticleDensity].size &&
+			memcmp(densities.data(), sectionData[container::SectionParticleDensity], densities.size() * sizeof(float)) == 0, "density section");
+		check(sphCoefficients.size() * sizeof(float) == header->sections[container::SectionParticleSphCoefficient].size &&
+			memcmp(sphCoefficients.data(), sectionData[container::SectionParticleSphCoefficient], sphCoefficients.size() * sizeof(float)) == 0, "SH section");
+
+		// a byte flipped anywhere in a section fails its checksum
+		const container::Header headerCopy = *header;
+		std::uniform_int_distribution<size_t> byteOf(0, SIZE_MAX);
+		for (uint32_t i = 0; i < container::SectionCount; i++) {
+			for (int trial = 0; trial < 16; trial++) {
+				const size_t offset = headerCopy.sections[i].offset + byteOf(rng) % headerCopy.sections[i].size;
+				((char*)data.data())[offset] ^= 0x10;
+				if (readable(data, size)) {
+					printf("Failed: byte %zu of section %u flipped and the container still reads\n", offset, i);
+					failures++;
+				}
+				((char*)data.data())[offset] ^= 0x10;
+			}
+		}
+		check(readable(data, size), "container reads again once restored");
+		check(!readable(data, size - 1), "truncated container is rejected");
+		((container::Header*)data.data())->version = container::version + 1;
+		check(!readable(data, size), "container of another version is rejected");
+	}
+	std::filesystem::remove(path);
+
+	printf("%zu failures\n", failures);
+	return failures == 0 ? 0 : 1;
+}
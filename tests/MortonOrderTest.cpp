@@ -0,0 +1,121 @@
+/*
+ * Abura Soba, 2025
+ *
+ * reorderSplatSetMorton against a bit by bit Morton code: the splats come out sorted by the code of their quantized
+ * position, every splat exactly once and with all its attributes, ties in their original order
+ */
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "Vulkan3DGRTModel.h"
+#include "threadpool.hpp"
+
+using namespace vk3DGRT;
+
+namespace {
+	// Interleaves 21 bits per axis, x in the lowest bit
+	uint64_t mortonCode(glm::uvec3 code) {
+		uint64_t key = 0;
+		for (int bit = 0; bit < 21; bit++)
+			for (int axis = 0; axis < 3; axis++)
+				key |= uint64_t((code[axis] >> bit) & 1) << (3 * bit + axis);
+		return key;
+	}
+
+	// The splat index is written into every attribute so that the permutation can be traced back
+	SplatSet indexedSplatSet(size_t count, float extent, std::mt19937& rng) {
+		std::uniform_real_distribution<float> position(-extent, extent);
+		SplatSet splatSet;
+		splatSet.sphDegree = 1;
+		for (size_t i = 0; i < count; i++) {
+			// a few duplicated positions for the ties
+			const size_t source = (i % 7 == 6) ? i - 1 : i;
+			for (int c = 0; c < 3; c++) splatSet.positions.push_back(source == i ? position(rng) : splatSet.positions[source * 3 + c]);
+			for (int c = 0; c < 3; c++) splatSet.scale.push_back(float(i) + 0.1f * c);
+			for (int c = 0; c < 4; c++) splatSet.rotation.push_back(float(i) + 0.2f * c);
+			for (int c = 0; c < 3; c++) splatSet.f_dc.push_back(float(i) + 0.3f * c);
+			for (size_t c = 0; c < splatSet.specularDimension(); c++) splatSet.f_rest.push_back(float(i) + 0.01f * c);
+			splatSet.opacity.push_back(float(i));
+		}
+		return splatSet;
+	}
+
+	size_t checkOrder(const SplatSet& original, const SplatSet& sorted) {
+		size_t mismatches = 0;
+		auto mismatch = [&](const char* what, size_t i) {
+			if (mismatches++ < 10) printf("Mismatch: %s of sorted splat %zu\n", what, i);
+		};
+		const size_t count = original.size();
+		if (sorted.size() != count || sorted.f_rest.size() != original.f_rest.size()) {
+			printf("Mismatch: %zu splats sorted out of %zu\n", sorted.size(), count);
+			return 1;
+		}
+
+		glm::vec3 aabbMin(FLT_MAX), aabbMax(-FLT_MAX);
+		for (size_t i = 0; i < count; i++) {
+			aabbMin = glm::min(aabbMin, glm::make_vec3(&original.positions[i * 3]));
+			aabbMax = glm::max(aabbMax, glm::make_vec3(&original.positions[i * 3]));
+		}
+		const glm::vec3 extent = glm::max(aabbMax - aabbMin, glm::vec3(FLT_MIN));
+
+		std::vector<bool> seen(count, false);
+		uint64_t lastKey = 0;
+		size_t lastIndex = 0;
+		for (size_t i = 0; i < count; i++) {
+			const size_t index = (size_t)sorted.opacity[i];
+			if (index >= count || seen[index]) {
+				mismatch("index", i);
+				continue;
+			}
+			seen[index] = true;
+
+			for (int c = 0; c < 3; c++) {
+				if (sorted.positions[i * 3 + c] != original.positions[index * 3 + c]) mismatch("position", i);
+				if (sorted.scale[i * 3 + c] != original.scale[index * 3 + c]) mismatch("scale", i);
+				if (sorted.f_dc[i * 3 + c] != original.f_dc[index * 3 + c]) mismatch("f_dc", i);
+			}
+			for (int c = 0; c < 4; c++) {
+				if (sorted.rotation[i * 4 + c] != original.rotation[index * 4 + c]) mismatch("rotation", i);
+			}
+			const size_t stride = original.specularDimension();
+			for (size_t c = 0; c < stride; c++) {
+				if (sorted.f_rest[i * stride + c] != original.f_rest[index * stride + c]) mismatch("f_rest", i);
+			}
+
+			const glm::vec3 normalized = (glm::make_vec3(&sorted.positions[i * 3]) - aabbMin) / extent;
+			const uint64_t key = mortonCode(glm::uvec3(glm::clamp(normalized, 0.0f, 1.0f) * float((1 << 21) - 1)));
+			if (i > 0 && (key < lastKey || (key == lastKey && index < lastIndex))) mismatch("Morton order", i);
+			lastKey = key;
+			lastIndex = index;
+		}
+		return mismatches;
+	}
+}
+
+int main() {
+	std::mt19937 rng(1234);
+	vks::ThreadPool threadPool;
+	initLoadThreadPool(threadPool);
+
+	size_t mismatches = 0;
+	// empty and single splat sets, one range, then enough splats for a range per thread
+	for (size_t count : { size_t(0), size_t(1), size_t(1000), size_t(300000) }) {
+		for (float extent : { 1e-3f, 100.0f }) {
+			const SplatSet original = indexedSplatSet(count, extent, rng);
+			SplatSet sorted = original;
+			reorderSplatSetMorton(sorted, &threadPool);
+			mismatches += checkOrder(original, sorted);
+		}
+	}
+	// all the splats at the same position keep their order
+	SplatSet original = indexedSplatSet(5000, 1.0f, rng);
+	for (size_t i = 3; i < original.positions.size(); i++) original.positions[i] = original.positions[i % 3];
+	SplatSet sorted = original;
+	reorderSplatSetMorton(sorted);
+	mismatches += checkOrder(original, sorted);
+
+	printf("%zu mismatches\n", mismatches);
+	return mismatches == 0 ? 0 : 1;
+}
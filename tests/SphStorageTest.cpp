@@ -0,0 +1,115 @@
+/*
+ * Abura Soba, 2025
+ *
+ * The fp16 and unorm8 SH encoders of encodeSphCoefficients against a host copy of fetchParticleSphCoefficients
+ * (gaussianfunctions.glsl): every coefficient decodes within the rounding of its storage, and the encoder writes
+ * exactly the stride the shaders step over per particle
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "Vulkan3DGRTModel.h"
+
+using namespace vk3DGRT;
+
+namespace {
+	// fetchParticleSphCoefficients of a single particle at full degree, in the order of the encoder input
+	std::vector<float> decode(SphStorageMode mode, const uint32_t* src, size_t specularDimension) {
+		const size_t numFetched = 3 + specularDimension;
+		std::vector<float> decoded(numFetched);
+		if (mode == SphStorageHalf) {
+			for (size_t i = 0; i < (numFetched + 1) / 2; i++) {
+				const glm::vec2 coefficients = glm::unpackHalf2x16(src[i]);
+				decoded[i * 2] = coefficients.x;
+				if (i * 2 + 1 < numFetched) decoded[i * 2 + 1] = coefficients.y;
+			}
+		}
+		else {
+			const glm::vec2 albedoRG = glm::unpackHalf2x16(src[0]);
+			const glm::vec2 albedoBSpecularMin = glm::unpackHalf2x16(src[1]);
+			const float specularMax = glm::unpackHalf2x16(src[2]).x;
+			const float specularMin = albedoBSpecularMin.y;
+			decoded[0] = albedoRG.x;
+			decoded[1] = albedoRG.y;
+			decoded[2] = albedoBSpecularMin.x;
+			for (size_t i = 0; i < (specularDimension + 3) / 4; i++) {
+				const glm::vec4 coefficients = specularMin + (specularMax - specularMin) * glm::unpackUnorm4x8(src[3 + i]);
+				for (size_t j = 0; j < 4 && i * 4 + j < specularDimension; j++) decoded[3 + i * 4 + j] = coefficients[j];
+			}
+		}
+		return decoded;
+	}
+
+	// round to nearest fp16: half an ulp of the 11 bit significand, the subnormal step below 2^-14
+	float halfError(float x) {
+		return std::max(std::abs(x) * std::exp2(-11.0f), std::exp2(-25.0f));
+	}
+
+	const uint32_t guard = 0xdeadbeef;
+}
+
+int main() {
+	std::mt19937 rng(1234);
+	std::normal_distribution<float> coefficient(0.0f, 0.3f);
+	size_t mismatches = 0;
+	auto mismatch = [&](const char* mode, uint32_t sphDegree, size_t particle, const char* what) {
+		if (mismatches++ < 10) printf("Mismatch: %s SH degree %u particle %zu: %s\n", mode, sphDegree, particle, what);
+	};
+
+	for (SphStorageMode mode : { SphStorageHalf, SphStorageUnorm8 }) {
+		const char* modeName = mode == SphStorageHalf ? "fp16" : "unorm8";
+		for (uint32_t sphDegree = 0; sphDegree <= MAX_N_FEATURES; sphDegree++) {
+			const size_t specularDimension = sphSpecularDimension(sphDegree);
+			const size_t sphStride = 3 + specularDimension;
+			const size_t numCoeffs = (sphDegree + 1) * (sphDegree + 1);
+
+			// particleOffset of fetchParticleSphCoefficients
+			const size_t shaderStride = mode == SphStorageHalf ? (numCoeffs * 3 + 1) / 2 : (3 + (specularDimension + 3) / 4 + 3) / 4 * 4;
+			const size_t encodedStride = sphCoefficientStride(mode, specularDimension) / sizeof(uint32_t);
+			if (encodedStride != shaderStride) mismatch(modeName, sphDegree, 0, "stride differs from the shaders");
+
+			for (size_t particle = 0; particle < 2000; particle++) {
+				std::vector<float> src(sphStride);
+				const float scale = particle % 4 == 0 ? 100.0f : (particle % 4 == 1 ? 1e-3f : 1.0f);
+				for (float& value : src) value = coefficient(rng) * scale;
+				if (particle % 10 == 9) {
+					for (size_t j = 3; j < sphStride; j++) src[j] = src[3];	// no specular range
+				}
+
+				std::vector<uint32_t> encoded(encodedStride + 1, 0u);
+				encoded[encodedStride] = guard;
+				const double squaredError = encodeSphCoefficients(mode, src.data(), specularDimension, encoded.data());
+				if (encoded[encodedStride] != guard) mismatch(modeName, sphDegree, particle, "written past the stride");
+				if (mode == SphStorageHalf && sphStride % 2 == 1 && (encoded[sphStride / 2] >> 16) != 0) mismatch(modeName, sphDegree, particle, "padding half not zero");
+
+				const std::vector<float> decoded = decode(mode, encoded.data(), specularDimension);
+				double decodedSquaredError = 0.0;
+				for (size_t j = 0; j < sphStride; j++) decodedSquaredError += (decoded[j] - src[j]) * (decoded[j] - src[j]);
+				// the encoder decodes the codes in another float order than the shaders
+				if (std::abs(decodedSquaredError - squaredError) > 1e-3 * squaredError + 1e-12) mismatch(modeName, sphDegree, particle, "reported error differs from the decoded one");
+
+				for (size_t j = 0; j < sphStride; j++) {
+					float bound = halfError(src[j]);
+					if (mode == SphStorageUnorm8 && j >= 3) {
+						// half a code of the range between the fp16 min and max, plus their own rounding
+						float specularMin = src[3], specularMax = src[3];
+						for (size_t k = 3; k < sphStride; k++) {
+							specularMin = std::min(specularMin, src[k]);
+							specularMax = std::max(specularMax, src[k]);
+						}
+						bound = 0.5f * (specularMax - specularMin) / 255.0f * 1.001f + halfError(specularMin) + halfError(specularMax);
+					}
+					if (!(std::abs(decoded[j] - src[j]) <= bound)) {
+						if (mismatches++ < 10) printf("Mismatch: %s SH degree %u particle %zu coefficient %zu: %g decoded as %g\n", modeName, sphDegree, particle, j, src[j], decoded[j]);
+					}
+				}
+			}
+		}
+	}
+
+	printf("%zu mismatches\n", mismatches);
+	return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+/*
+ * Abura Soba, 2025
+ *
+ * SplitBLAS::splitCacheKey: a cache written for one geometry or split setting is never reused for another one,
+ * while the settings the selected partition does not read leave the key, and the cache, as they are
+ */
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "SplitBLAS.hpp"
+
+namespace {
+	struct Setting {
+		uint32_t cellsPerLongestAxis;
+		bool adaptivePartition;
+		uint32_t trianglesPerCell;
+	};
+
+	uint64_t key(const vector<float>& vertices, const vector<uint32_t>& indices, const Setting& setting) {
+		return SplitBLAS::splitCacheKey(vertices, indices, setting.cellsPerLongestAxis, setting.adaptivePartition, setting.trianglesPerCell);
+	}
+}
+
+int main() {
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+	vector<float> vertices(3 * 1200);
+	for (float& v : vertices) v = position(rng);
+	vector<uint32_t> indices(3 * 2000);
+	for (uint32_t& i : indices) i = rng() % (vertices.size() / 3);
+
+	size_t failures = 0;
+	auto check = [&](bool condition, const char* what) {
+		if (!condition) {
+			printf("Failed: %s\n", what);
+			failures++;
+		}
+	};
+
+	const Setting grid{ 8, false, 1024 };
+	const Setting adaptive{ 8, true, 1024 };
+	const uint64_t gridKey = key(vertices, indices, grid);
+	const uint64_t adaptiveKey = key(vertices, indices, adaptive);
+
+	check(gridKey == key(vertices, indices, grid), "same geometry and setting give the same key");
+	check(gridKey != adaptiveKey, "uniform grid and adaptive partition keys differ");
+
+	// the settings the partition reads
+	check(gridKey != key(vertices, indices, { 9, false, 1024 }), "cellsPerLongestAxis changes the uniform grid key");
+	check(adaptiveKey != key(vertices, indices, { 8, true, 512 }), "trianglesPerCell changes the adaptive key");
+	// and the ones it does not
+	check(gridKey == key(vertices, indices, { 8, false, 512 }), "trianglesPerCell leaves the uniform grid key");
+	check(adaptiveKey == key(vertices, indices, { 16, true, 1024 }), "cellsPerLongestAxis leaves the adaptive key");
+
+	// any change of the geometry, down to a single bit of one coordinate
+	size_t unchanged = 0;
+	for (int trial = 0; trial < 200; trial++) {
+		vector<float> changedVertices = vertices;
+		uint32_t bits;
+		float& coordinate = changedVertices[rng() % changedVertices.size()];
+		memcpy(&bits, &coordinate, sizeof(bits));
+		bits ^= 1u << (rng() % 32);
+		memcpy(&coordinate, &bits, sizeof(bits));
+		unchanged += key(changedVertices, indices, grid) == gridKey;
+
+		vector<uint32_t> changedIndices = indices;
+		uint32_t& index = changedIndices[rng() % changedIndices.size()];
+		index = (index + 1 + rng() % (vertices.size() / 3 - 1)) % (vertices.size() / 3);
+		unchanged += key(vertices, changedIndices, grid) == gridKey;
+	}
+	check(unchanged == 0, "a changed vertex or index changes the key");
+
+	// the same data split differently between the arrays, or cut short
+	vector<float> fewerVertices(vertices.begin(), vertices.end() - 3);
+	check(key(fewerVertices, indices, grid) != gridKey, "a dropped vertex changes the key");
+	vector<uint32_t> fewerIndices(indices.begin(), indices.end() - 3);
+	check(key(vertices, fewerIndices, grid) != gridKey, "a dropped triangle changes the key");
+	vector<uint32_t> swappedTriangles = indices;
+	std::swap_ranges(swappedTriangles.begin(), swappedTriangles.begin() + 3, swappedTriangles.begin() + 3);
+	check(swappedTriangles == indices || key(vertices, swappedTriangles, grid) != gridKey, "reordered triangles change the key");
+
+	printf("%zu failures\n", failures);
+	return failures == 0 ? 0 : 1;
+}